@@ -51,6 +51,21 @@ def _parse_args():
         default=1,
         help="Whether to use previously pickled IRModule and skip trace.",
     )
+    args.add_argument(
+        "--use-paged-kv-cache",
+        action="store_true",
+        default=False,
+        help="Store the KV cache in fixed-size pages of a pool shared by all sessions, "
+        "managed by the mlc_llm runtime. Only supported for llama models.",
+    )
+    args.add_argument(
+        "--kv-cache-quantization",
+        type=str,
+        choices=["none", "int8"],
+        default="none",
+        help="Store the KV cache in int8 with a scale per token and head, which halves its "
+        "memory from float16. Only supported for llama models.",
+    )
     args.add_argument("--debug-dump", action="store_true", default=False)
     args.add_argument("--debug-load-script", action="store_true", default=False)
 
@@ -191,11 +206,17 @@ def mod_transform_before_build(
     """First-stage: Legalize ops and trace"""
     model_names = [
         "encoding",
+        "verification",
         "decoding",
         "create_kv_cache",
+        "kv_cache_rotate",
         "softmax_with_temperature",
+        "sample_top_p",
         "get_metadata",
     ]
+    # not every model defines all of the functions, e.g. kv_cache_rotate
+    gv_names = [gv.name_hint for gv in mod.get_global_vars()]
+    model_names = [name for name in model_names if name in gv_names]
 
     if args.quantization.mode != "no":
         mod = mlc_llm.transform.GroupQuantize(
@@ -307,6 +328,10 @@ if __name__ == "__main__":
         if not use_cache:
             if ARGS.model_category == "llama":
                 mod, params = llama.get_model(ARGS, config)
+            elif ARGS.kv_cache_quantization != "none":
+                raise ValueError(
+                    f"KV cache quantization is not supported for {ARGS.model_category}"
+                )
             elif ARGS.model_category == "gpt_neox":
                 mod, params = gpt_neox.get_model(
                     ARGS.model, ARGS.model_path, ARGS.quantization.model_dtype, config
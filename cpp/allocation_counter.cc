@@ -0,0 +1,68 @@
+/*!
+ *  Copyright (c) 2023 by Contributors
+ * \file allocation_counter.cc
+ * \brief The replacement of the global operator new that counts allocations per thread.
+ */
+#include "allocation_counter.h"
+
+#ifdef MLC_LLM_COUNT_ALLOCATIONS
+#include <cstdlib>
+#include <new>
+
+namespace {
+
+// constant initialized, so operator new may run before any dynamic initialization
+thread_local int64_t thread_allocation_count = 0;
+
+void* CountedAlloc(std::size_t size) noexcept {
+  ++thread_allocation_count;
+  return std::malloc(size == 0 ? 1 : size);
+}
+
+}  // namespace
+
+// The aligned forms are left to the standard library, which pairs them with its own delete.
+void* operator new(std::size_t size) {
+  void* ptr = CountedAlloc(size);
+  if (ptr == nullptr) throw std::bad_alloc();
+  return ptr;
+}
+
+void* operator new[](std::size_t size) {
+  void* ptr = CountedAlloc(size);
+  if (ptr == nullptr) throw std::bad_alloc();
+  return ptr;
+}
+
+void* operator new(std::size_t size, const std::nothrow_t&) noexcept { return CountedAlloc(size); }
+
+void* operator new[](std::size_t size, const std::nothrow_t&) noexcept {
+  return CountedAlloc(size);
+}
+
+void operator delete(void* ptr) noexcept { std::free(ptr); }
+
+void operator delete[](void* ptr) noexcept { std::free(ptr); }
+
+void operator delete(void* ptr, std::size_t) noexcept { std::free(ptr); }
+
+void operator delete[](void* ptr, std::size_t) noexcept { std::free(ptr); }
+
+void operator delete(void* ptr, const std::nothrow_t&) noexcept { std::free(ptr); }
+
+void operator delete[](void* ptr, const std::nothrow_t&) noexcept { std::free(ptr); }
+#endif  // MLC_LLM_COUNT_ALLOCATIONS
+
+namespace mlc {
+namespace llm {
+
+int64_t ThreadAllocationCount() {
+#ifdef MLC_LLM_COUNT_ALLOCATIONS
+  return thread_allocation_count;
+#else
+  return -1;
+#endif
+}
+
+}  // namespace llm
+}  // namespace mlc
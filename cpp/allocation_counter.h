@@ -0,0 +1,23 @@
+/*!
+ *  Copyright (c) 2023 by Contributors
+ * \file allocation_counter.h
+ * \brief Counting the heap allocations of a thread, to keep the per-token loop free of them.
+ */
+#ifndef MLC_LLM_CPP_ALLOCATION_COUNTER_H_
+#define MLC_LLM_CPP_ALLOCATION_COUNTER_H_
+
+#include <cstdint>
+
+namespace mlc {
+namespace llm {
+
+/*!
+ * \return The number of calls to operator new made by the calling thread so far, or -1 if the
+ *  library is built without MLC_LLM_COUNT_ALLOCATIONS, which replaces the global operator new.
+ */
+int64_t ThreadAllocationCount();
+
+}  // namespace llm
+}  // namespace mlc
+
+#endif  // MLC_LLM_CPP_ALLOCATION_COUNTER_H_
@@ -6,19 +6,29 @@
 // NOTE we only interact with the module through tvm runtime
 // so there is no need to depend on a header interface
 // the same set of operations can be implemented in other languages
+#define PICOJSON_USE_INT64
+
 #include <tvm/runtime/device_api.h>
 #include <tvm/runtime/module.h>
 #include <tvm/runtime/registry.h>
 
+#include <picojson.h>
+
+#include <algorithm>
 #include <argparse/argparse.hpp>
 #include <bitset>
+#include <chrono>
 #include <cstdio>
 #include <filesystem>
 #include <fstream>
+#include <iomanip>
+#include <iterator>
 #include <optional>
 #include <string>
+#include <unordered_map>
 #include <vector>
 
+#include "device_name.h"
 #include "llm_chat.h"
 
 const std::vector<std::string> quantization_presets = {"q3f16_0",  //
@@ -27,61 +37,27 @@ const std::vector<std::string> quantization_presets = {"q3f16_0",  //
                                                        "q0f32",    //
                                                        "q0f16"};
 
-std::string DetectDeviceName(std::string device_name) {
-  using tvm::runtime::DeviceAPI;
-  if (device_name == "auto") {
-    bool allow_missing = true;
-    if (DeviceAPI::Get(DLDevice{kDLCUDA, 0}, allow_missing)) {
-      return "cuda";
-    }
-    if (DeviceAPI::Get(DLDevice{kDLMetal, 0}, allow_missing)) {
-      return "metal";
-    }
-    if (DeviceAPI::Get(DLDevice{kDLVulkan, 0}, allow_missing)) {
-      return "vulkan";
-    }
-    if (DeviceAPI::Get(DLDevice{kDLOpenCL, 0}, allow_missing)) {
-      return "opencl";
-    }
-    LOG(FATAL) << "Cannot auto detect device-name";
-  }
-  return device_name;
-}
-
-DLDevice GetDevice(const std::string& device_name, int device_id) {
-  if (device_name == "cuda") return DLDevice{kDLCUDA, device_id};
-  if (device_name == "metal") return DLDevice{kDLMetal, device_id};
-  if (device_name == "vulkan") return DLDevice{kDLVulkan, device_id};
-  if (device_name == "opencl") return DLDevice{kDLOpenCL, device_id};
-  LOG(FATAL) << "Do not recognize device name " << device_name;
-  return DLDevice{kDLCPU, 0};
-}
-
 /*!
- * \brief Search for file path return the first result.
- *
- * \param search_paths The paths to search for the file.
- * \param names The names of to look for.
- * \param suffixes The suffix to look for.
+ * \brief Parse a comma separated list of device ids, such as "0,1,2,3".
+ * \return The device ids, empty if the text is empty.
  */
-std::optional<std::filesystem::path> FindFile(const std::vector<std::string>& search_paths,
-                                              const std::vector<std::string>& names,
-                                              const std::vector<std::string>& suffixes) {
-  std::vector<std::filesystem::path> ret;
-  for (auto prefix : search_paths) {
-    for (auto name : names) {
-      for (auto suffix : suffixes) {
-        std::filesystem::path path(prefix + "/" + name + suffix);
-        if (std::filesystem::exists(path)) {
-          path = std::filesystem::canonical(path);
-          if (std::filesystem::is_regular_file(path)) {
-            return path;
-          }
-        }
-      }
+std::vector<int> ParseDeviceIds(const std::string& text) {
+  std::vector<int> device_ids;
+  std::istringstream is(text);
+  std::string item;
+  while (std::getline(is, item, ',')) {
+    size_t end = 0;
+    int device_id = -1;
+    try {
+      device_id = std::stoi(item, &end);
+    } catch (const std::exception&) {
     }
+    if (device_id < 0 || end != item.size()) {
+      LOG(FATAL) << "Invalid device id \"" << item << "\" in --device-ids " << text;
+    }
+    device_ids.push_back(device_id);
   }
-  return std::nullopt;
+  return device_ids;
 }
 
 /**
@@ -106,39 +82,249 @@ std::string GetArchSuffix() {
   return "";
 }
 
-std::vector<std::string> CountUTF8(const std::string& s) {
-  // assume that the string is always valid utf8
-  std::vector<std::string> ret;
-  for (size_t pos = 0; pos < s.size();) {
-    if ((s[pos] & 0x80) == 0x00) {
-      ret.push_back(s.substr(pos, 1));
-      pos += 1;
-    } else if (pos + 1 < s.size() && (s[pos] & 0xE0) == 0xC0 && (s[pos + 1] & 0xC0) == 0x80) {
-      ret.push_back(s.substr(pos, 2));
-      pos += 2;
-    } else if (pos + 1 < s.size() && (s[pos] & 0xF0) == 0xE0 && (s[pos + 1] & 0xC0) == 0x80 &&
-               (s[pos + 2] & 0xC0) == 0x80) {
-      ret.push_back(s.substr(pos, 3));
-      pos += 3;
-    } else if (pos + 2 < s.size() && (s[pos] & 0xF8) == 0xF0 && (s[pos + 1] & 0xC0) == 0x80 &&
-               (s[pos + 2] & 0xC0) == 0x80 && (s[pos + 3] & 0xC0) == 0x80) {
-      ret.push_back(s.substr(pos, 4));
-      pos += 4;
+/*!
+ * \brief An index of the models and libraries in the artifact path, built by listing the
+ *  directories once instead of probing every candidate path of every lookup.
+ *
+ * A model is a directory with mlc-chat-config.json, either "<artifact>/<local_id>/params" with
+ * its libraries in "<artifact>/<local_id>", or "<artifact>/prebuilt/<local_id>" with the
+ * libraries in "<artifact>/prebuilt/lib". The index is saved to a file in the artifact path
+ * with the modification times of the listed directories, and is listed again when one of them
+ * changes, which happens when an entry of the directory is added, removed or renamed.
+ */
+class ArtifactIndex {
+ public:
+  struct Model {
+    std::string local_id;
+    // the canonical paths of the config and of its directory
+    std::string config_path, model_path;
+    // the directory of the libraries of the model
+    std::string lib_dir;
+    // whether the model directory has ndarray-cache.json
+    bool has_params{false};
+  };
+
+  explicit ArtifactIndex(std::string artifact_path)
+      : artifact_path_(std::move(artifact_path)),
+        index_path_(artifact_path_ + "/.mlc-artifact-index.json") {
+    if (!this->Load() || this->IsStale()) this->Rebuild();
+  }
+
+  /*!
+   * \return The first of the local ids that is a model, listing the directories again if none
+   *  is, or nullopt if none is found.
+   */
+  std::optional<Model> FindModel(const std::vector<std::string>& local_ids) {
+    for (int attempt = 0; attempt < 2; ++attempt) {
+      for (const std::string& local_id : local_ids) {
+        auto it = models_.find(local_id);
+        if (it != models_.end()) return it->second;
+      }
+      if (attempt == 0 && !this->RebuildIfStale()) break;
+    }
+    return std::nullopt;
+  }
+
+  /*!
+   * \return The canonical path of the first of the library file names in the directory,
+   *  listing the directories again if none is found, or nullopt if none is found.
+   */
+  std::optional<std::string> FindLib(const std::string& lib_dir,
+                                     const std::vector<std::string>& file_names) {
+    for (int attempt = 0; attempt < 2; ++attempt) {
+      for (const std::string& file_name : file_names) {
+        auto it = libs_.find(lib_dir + "/" + file_name);
+        if (it != libs_.end()) return it->second;
+      }
+      if (attempt == 0 && !this->RebuildIfStale()) break;
+    }
+    return std::nullopt;
+  }
+
+ private:
+  static std::string ModificationTime(const std::filesystem::path& dir) {
+    std::error_code ec;
+    auto time = std::filesystem::last_write_time(dir, ec);
+    // the count does not fit the double of a JSON number
+    return ec ? "" : std::to_string(time.time_since_epoch().count());
+  }
+
+  // Whether a listed directory changed since it was listed.
+  bool IsStale() const {
+    for (const auto& [dir, mtime] : dir_mtimes_) {
+      if (ModificationTime(dir) != mtime) return true;
+    }
+    return false;
+  }
+
+  bool RebuildIfStale() {
+    if (!this->IsStale()) return false;
+    this->Rebuild();
+    return true;
+  }
+
+  // Record the modification time of a directory, and return its entries.
+  std::vector<std::filesystem::directory_entry> ListDir(const std::filesystem::path& dir) {
+    dir_mtimes_.emplace_back(dir.string(), ModificationTime(dir));
+    std::vector<std::filesystem::directory_entry> entries;
+    std::error_code ec;
+    for (std::filesystem::directory_iterator it(dir, ec), end; !ec && it != end;
+         it.increment(ec)) {
+      entries.push_back(*it);
+    }
+    return entries;
+  }
+
+  void AddModel(const std::string& local_id, const std::filesystem::path& dir,
+                const std::string& lib_dir, bool is_prebuilt) {
+    bool has_config = false;
+    Model model;
+    for (const auto& entry : this->ListDir(dir)) {
+      std::string name = entry.path().filename().string();
+      if (name == "mlc-chat-config.json" && entry.is_regular_file()) {
+        std::filesystem::path config_path = std::filesystem::canonical(entry.path());
+        model.config_path = config_path.string();
+        model.model_path = config_path.parent_path().string();
+        has_config = true;
+      } else if (name == "ndarray-cache.json" && entry.is_regular_file()) {
+        model.has_params = true;
+      }
+    }
+    if (!has_config) return;
+    model.local_id = local_id;
+    model.lib_dir = lib_dir;
+    // "<local_id>/params" comes first in the search order
+    if (is_prebuilt) {
+      models_.emplace(local_id, model);
     } else {
-      LOG(FATAL) << "Invalid UTF8 string";
+      models_[local_id] = model;
     }
   }
-  return std::move(ret);
-}
+
+  void AddLibs(const std::string& lib_dir) {
+    std::vector<std::string> suffixes = GetLibSuffixes();
+    for (const auto& entry : this->ListDir(lib_dir)) {
+      std::string name = entry.path().filename().string();
+      bool is_lib = std::any_of(suffixes.begin(), suffixes.end(), [&](const std::string& s) {
+        return name.size() > s.size() && name.compare(name.size() - s.size(), s.size(), s) == 0;
+      });
+      if (is_lib && entry.is_regular_file()) {
+        libs_[lib_dir + "/" + name] = std::filesystem::canonical(entry.path()).string();
+      }
+    }
+  }
+
+  void Rebuild() {
+    models_.clear();
+    libs_.clear();
+    dir_mtimes_.clear();
+    // Create the index file before listing, so that creating it does not change the recorded
+    // time of the artifact path. It is then overwritten in place.
+    if (!std::filesystem::exists(index_path_)) {
+      std::ofstream touch(index_path_);
+    }
+    std::filesystem::path root(artifact_path_);
+    for (const auto& entry : this->ListDir(root)) {
+      if (!entry.is_directory()) continue;
+      std::string name = entry.path().filename().string();
+      if (name == "prebuilt") {
+        std::string lib_dir = (entry.path() / "lib").string();
+        for (const auto& model_entry : this->ListDir(entry.path())) {
+          if (!model_entry.is_directory()) continue;
+          std::string local_id = model_entry.path().filename().string();
+          if (local_id == "lib") continue;
+          this->AddModel(local_id, model_entry.path(), lib_dir, true);
+        }
+        this->AddLibs(lib_dir);
+      } else {
+        this->AddModel(name, entry.path() / "params", entry.path().string(), false);
+        this->AddLibs(entry.path().string());
+      }
+    }
+    this->Save();
+  }
+
+  bool Load() {
+    std::ifstream is(index_path_);
+    if (!is.good()) return false;
+    std::string text((std::istreambuf_iterator<char>(is)), std::istreambuf_iterator<char>());
+    picojson::value index;
+    std::string err = picojson::parse(index, text);
+    if (!err.empty() || !index.is<picojson::object>()) return false;
+    picojson::object obj = index.get<picojson::object>();
+    if (!obj["models"].is<picojson::array>() || !obj["libs"].is<picojson::object>() ||
+        !obj["dirs"].is<picojson::object>()) {
+      return false;
+    }
+    for (const picojson::value& value : obj["models"].get<picojson::array>()) {
+      if (!value.is<picojson::object>()) return false;
+      picojson::object entry = value.get<picojson::object>();
+      Model model;
+      model.local_id = entry["local_id"].to_str();
+      model.config_path = entry["config_path"].to_str();
+      model.model_path = entry["model_path"].to_str();
+      model.lib_dir = entry["lib_dir"].to_str();
+      model.has_params = entry["has_params"].is<bool>() && entry["has_params"].get<bool>();
+      models_.emplace(model.local_id, model);
+    }
+    for (const auto& [key, value] : obj["libs"].get<picojson::object>()) {
+      libs_[key] = value.to_str();
+    }
+    for (const auto& [dir, mtime] : obj["dirs"].get<picojson::object>()) {
+      dir_mtimes_.emplace_back(dir, mtime.to_str());
+    }
+    return true;
+  }
+
+  // Save the index, an artifact path that is not writable keeps it in memory only.
+  void Save() const {
+    picojson::array models;
+    for (const auto& [local_id, model] : models_) {
+      picojson::object entry;
+      entry["local_id"] = picojson::value(model.local_id);
+      entry["config_path"] = picojson::value(model.config_path);
+      entry["model_path"] = picojson::value(model.model_path);
+      entry["lib_dir"] = picojson::value(model.lib_dir);
+      entry["has_params"] = picojson::value(model.has_params);
+      models.push_back(picojson::value(entry));
+    }
+    picojson::object libs;
+    for (const auto& [key, path] : libs_) {
+      libs[key] = picojson::value(path);
+    }
+    picojson::object dirs;
+    for (const auto& [dir, mtime] : dir_mtimes_) {
+      dirs[dir] = picojson::value(mtime);
+    }
+    picojson::object index;
+    index["models"] = picojson::value(models);
+    index["libs"] = picojson::value(libs);
+    index["dirs"] = picojson::value(dirs);
+    std::ofstream os(index_path_, std::ios::trunc);
+    if (os.good()) os << picojson::value(index).serialize(true);
+  }
+
+  std::string artifact_path_, index_path_;
+  // the models by local id, and the canonical library paths by "<lib_dir>/<file name>"
+  std::unordered_map<std::string, Model> models_;
+  std::unordered_map<std::string, std::string> libs_;
+  // the listed directories and their modification times when they were listed
+  std::vector<std::pair<std::string, std::string>> dir_mtimes_;
+};
 
 void PrintSpecialCommands() {
   std::cout << "You can use the following special commands:\n"
             << "  /help               print the special commands\n"
             << "  /exit               quit the cli\n"
             << "  /stats              print out the latest stats (token/sec)\n"
+            << "  /stats json         print out the latest stats of each phase as JSON\n"
             << "  /reset              restart a fresh chat\n"
+            << "  /save path          save the chat to the file \"path\"\n"
+            << "  /load path          resume the chat saved in the file \"path\"\n"
             << "  /reload [model_id]  reload model \"model_id\" from disk, or reload the current "
                "model if model_id is not specified\n"
+            << "  /switch model_id    switch to model \"model_id\", and keep the current model "
+               "resident if the memory budget allows\n"
             << std::endl
             << std::flush;
 }
@@ -149,17 +335,35 @@ void PrintSpecialCommands() {
  * \param chat_mod The chat module.
  * \param executable The model library to initialize the chat module.
  * \param model_path The model path with contains the model config, tokenizer and parameters.
+ * \param draft_lib_path The library of the draft model for speculative decoding, empty if none.
+ * \param draft_model_path The model path of the draft model.
+ * \param trace_file The file to write the Chrome trace of the phases to at exit, empty if none.
+ *  Loading another model restarts the trace.
  */
 void Chat(tvm::runtime::Module chat_mod, tvm::runtime::Module executable, std::string model_path,
           std::function<std::pair<std::string, std::string>(std::vector<std::string>)>
               f_search_model_path,
-          int stream_interval = 2) {
-  // initialize chat context
-  chat_mod.GetFunction("reload")(executable, tvm::String(model_path));
+          std::string draft_lib_path = "", std::string draft_model_path = "",
+          std::string trace_file = "", int stream_interval = 2) {
+  // initialize chat context, models are resident under their model path
+  auto f_load_model = chat_mod.GetFunction("load_model");
+  auto f_select_model = chat_mod.GetFunction("select_model");
+  auto f_has_model = chat_mod.GetFunction("has_model");
+  f_load_model(tvm::String(model_path), executable, tvm::String(model_path));
+  f_select_model(tvm::String(model_path));
+  if (!draft_lib_path.empty()) {
+    chat_mod.GetFunction("load_draft_model")(
+        tvm::runtime::Module::LoadFromFile(draft_lib_path), tvm::String(draft_model_path));
+  }
+  auto f_start_trace = [&]() {
+    if (trace_file != "") chat_mod.GetFunction("start_trace")();
+  };
+  f_start_trace();
   auto f_stop = chat_mod.GetFunction("stopped");
   auto f_encode = chat_mod.GetFunction("encode");
   auto f_decode = chat_mod.GetFunction("decode");
   auto f_stats = chat_mod.GetFunction("runtime_stats_text");
+  auto f_get_message_delta = chat_mod.GetFunction("get_message_delta");
   auto f_get_role0 = chat_mod.GetFunction("get_role0");
   auto f_get_role1 = chat_mod.GetFunction("get_role1");
   std::string role0 = f_get_role0();
@@ -182,6 +386,7 @@ void Chat(tvm::runtime::Module chat_mod, tvm::runtime::Module executable, std::s
       is >> reload_prompt >> local_id;
       if (local_id == "") {
         chat_mod.GetFunction("reload")(executable, tvm::String(model_path));
+        f_start_trace();
         std::cout << "RELOAD THE SAME MODEL SUCCESS" << std::endl << std::flush;
       } else {
         std::string lib_path;
@@ -192,11 +397,57 @@ void Chat(tvm::runtime::Module chat_mod, tvm::runtime::Module executable, std::s
         std::string role1_str = f_get_role1();
         role0 = role0_str;
         role1 = role1_str;
+        f_start_trace();
         std::cout << "LOAD MODEL " << local_id << " SUCCESS" << std::endl << std::flush;
       }
       continue;
+    } else if (inp.substr(0, 7) == "/switch") {
+      std::istringstream is(inp);
+      std::string switch_prompt;
+      std::string local_id;
+      is >> switch_prompt >> local_id;
+      if (local_id == "") {
+        std::cout << "Please specify the model_id to switch to" << std::endl << std::flush;
+        continue;
+      }
+      std::string lib_path;
+      std::tie(lib_path, model_path) = f_search_model_path({local_id});
+      // keep the executable of the selected model for /reload
+      executable = tvm::runtime::Module::LoadFromFile(lib_path);
+      if (!static_cast<bool>(f_has_model(tvm::String(model_path)))) {
+        f_load_model(tvm::String(model_path), executable, tvm::String(model_path));
+      }
+      f_select_model(tvm::String(model_path));
+      std::string role0_str = f_get_role0();
+      std::string role1_str = f_get_role1();
+      role0 = role0_str;
+      role1 = role1_str;
+      f_start_trace();
+      std::cout << "SWITCH TO MODEL " << local_id << " SUCCESS" << std::endl << std::flush;
+      continue;
+    } else if (inp.substr(0, 5) == "/save" || inp.substr(0, 5) == "/load") {
+      std::istringstream is(inp);
+      std::string command;
+      std::string session_path;
+      is >> command >> session_path;
+      if (session_path == "") {
+        std::cout << "Please specify the session file" << std::endl << std::flush;
+        continue;
+      }
+      if (command == "/save") {
+        chat_mod.GetFunction("save_session")(tvm::String(session_path));
+        std::cout << "SAVE CHAT TO " << session_path << " SUCCESS" << std::endl << std::flush;
+      } else {
+        chat_mod.GetFunction("load_session")(tvm::String(session_path));
+        std::cout << "LOAD CHAT FROM " << session_path << " SUCCESS" << std::endl << std::flush;
+      }
+      continue;
     } else if (inp.substr(0, 5) == "/exit") {
       break;
+    } else if (inp.substr(0, 11) == "/stats json") {
+      std::string stats_json = chat_mod.GetFunction("runtime_stats_json")();
+      std::cout << stats_json << std::endl << std::flush;
+      continue;
     } else if (inp.substr(0, 6) == "/stats") {
       std::string stats_text = f_stats();
       std::cout << stats_text << std::endl << std::flush;
@@ -206,41 +457,139 @@ void Chat(tvm::runtime::Module chat_mod, tvm::runtime::Module executable, std::s
       continue;
     }
 
-    std::string prev_printed = "";
-    auto printed_UTF8_chars = CountUTF8(prev_printed);
-
     std::cout << role1 << ": " << std::flush;
     f_encode(inp);
     for (size_t i = 0; !f_stop(); ++i) {
       f_decode();
       if (i % stream_interval == 0 || f_stop()) {
-        std::string cur_msg = chat_mod.GetFunction("get_message")();
-        // delete the previous message, and print the current message
-        std::string print = "";
+        std::string delta = f_get_message_delta();
+        std::cout << delta << std::flush;
+      }
+    }
 
-        auto cur_UTF8_chars = CountUTF8(cur_msg);
+    std::cout << std::endl << std::flush;
+  }
+  if (trace_file != "") {
+    std::string trace_json = chat_mod.GetFunction("trace_json")();
+    std::ofstream(trace_file) << trace_json;
+  }
+}
 
-        size_t i = 0;
-        for (; i < std::min(printed_UTF8_chars.size(), cur_UTF8_chars.size()); ++i) {
-          if (printed_UTF8_chars[i] != cur_UTF8_chars[i]) {
-            break;
-          }
-        }
-        for (size_t j = i; j < printed_UTF8_chars.size(); ++j) {
-          print += "\b \b";
-        }
-        for (size_t j = i; j < cur_UTF8_chars.size(); ++j) {
-          print += cur_UTF8_chars[j];
-        }
-        std::cout << print << std::flush;
+/*!
+ * \brief Generate the outputs of a batch of prompts with the batched engine.
+ *
+ * Each line of the batch file is a JSON object with a "prompt" and an optional "id". The
+ * outputs are written as JSON lines in the order of the prompts, with the "id" (the line
+ * number of the prompt if absent), the "output" and the "latency" in seconds from the time
+ * the request is added until it finishes.
+ *
+ * \param engine_mod The engine module.
+ * \param executable The model library to initialize the engine module.
+ * \param model_path The model path with contains the model config, tokenizer and parameters.
+ * \param batch_file The JSONL file of the prompts.
+ * \param output_file The JSONL file to write the outputs to, stdout if empty.
+ * \param concurrency The maximum number of requests generated at the same time.
+ */
+void RunBatch(tvm::runtime::Module engine_mod, tvm::runtime::Module executable,
+              std::string model_path, std::string batch_file, std::string output_file,
+              int concurrency) {
+  using Clock = std::chrono::high_resolution_clock;
+  struct BatchRequest {
+    picojson::value id;
+    std::string prompt;
+    std::string output;
+    double latency{0};
+  };
+  std::ifstream batch_istream(batch_file);
+  if (!batch_istream) {
+    std::cerr << "Cannot open batch file " << batch_file << std::endl;
+    exit(1);
+  }
+  std::vector<BatchRequest> requests;
+  std::string line;
+  for (int64_t line_no = 1; std::getline(batch_istream, line); ++line_no) {
+    if (line.find_first_not_of(" \t\r") == std::string::npos) continue;
+    picojson::value value;
+    std::string err = picojson::parse(value, line);
+    if (!err.empty() || !value.is<picojson::object>() || !value.contains("prompt") ||
+        !value.get("prompt").is<std::string>()) {
+      std::cerr << batch_file << ":" << line_no << ": expect an object with a \"prompt\" string"
+                << std::endl;
+      exit(1);
+    }
+    BatchRequest request;
+    request.id = value.contains("id") ? value.get("id")
+                                      : picojson::value(static_cast<double>(line_no));
+    request.prompt = value.get("prompt").get<std::string>();
+    requests.push_back(std::move(request));
+  }
 
-        prev_printed = cur_msg;
-        printed_UTF8_chars = std::move(cur_UTF8_chars);
+  engine_mod.GetFunction("reload")(executable, tvm::String(model_path));
+  engine_mod.GetFunction("set_max_batch_size")(concurrency);
+  auto f_add_request = engine_mod.GetFunction("add_request");
+  auto f_remove_request = engine_mod.GetFunction("remove_request");
+  auto f_step = engine_mod.GetFunction("step");
+  auto f_stopped = engine_mod.GetFunction("stopped");
+  auto f_get_message = engine_mod.GetFunction("get_message");
+
+  // Requests are added as others finish, so the latency does not count queueing in the engine.
+  struct InFlight {
+    size_t index;
+    int64_t request_id;
+    Clock::time_point tstart;
+  };
+  std::vector<InFlight> in_flight;
+  size_t next_request = 0;
+  auto tstart = Clock::now();
+  while (next_request < requests.size() || !in_flight.empty()) {
+    while (next_request < requests.size() && static_cast<int>(in_flight.size()) < concurrency) {
+      int64_t request_id = f_add_request(requests[next_request].prompt);
+      in_flight.push_back({next_request++, request_id, Clock::now()});
+    }
+    f_step();
+    auto tnow = Clock::now();
+    std::vector<InFlight> still_in_flight;
+    for (const InFlight& item : in_flight) {
+      if (!static_cast<bool>(f_stopped(item.request_id))) {
+        still_in_flight.push_back(item);
+        continue;
       }
+      BatchRequest& request = requests[item.index];
+      request.output = f_get_message(item.request_id).operator std::string();
+      request.latency = static_cast<double>((tnow - item.tstart).count()) / 1e9;
+      f_remove_request(item.request_id);
     }
+    in_flight = std::move(still_in_flight);
+  }
+  double total_time = static_cast<double>((Clock::now() - tstart).count()) / 1e9;
 
-    std::cout << std::endl << std::flush;
+  std::ofstream output_ostream;
+  if (!output_file.empty()) {
+    output_ostream.open(output_file);
+    if (!output_ostream) {
+      std::cerr << "Cannot open output file " << output_file << std::endl;
+      exit(1);
+    }
   }
+  std::ostream& os = output_file.empty() ? std::cout : output_ostream;
+  for (const BatchRequest& request : requests) {
+    picojson::object result;
+    result["id"] = request.id;
+    result["output"] = picojson::value(request.output);
+    result["latency"] = picojson::value(request.latency);
+    os << picojson::value(result).serialize() << "\n";
+  }
+  os << std::flush;
+
+  std::string stats_text = engine_mod.GetFunction("runtime_stats_text")();
+  std::cerr << "Finished " << requests.size() << " requests in " << std::setprecision(2)
+            << std::fixed << total_time << " s (";
+  if (requests.empty() || total_time <= 0) {
+    std::cerr << "n/a";
+  } else {
+    std::cerr << requests.size() / total_time;
+  }
+  std::cerr << " req/s), " << stats_text << std::endl;
 }
 
 int main(int argc, char* argv[]) {
@@ -252,8 +601,42 @@ int main(int argc, char* argv[]) {
   args.add_argument("--quantization").default_value("auto");
   args.add_argument("--device-name").default_value("auto");
   args.add_argument("--device_id").default_value(0).scan<'i', int>();
+  args.add_argument("--device-ids")
+      .help("comma separated ids of the devices to run on, such as \"0,1\", overrides --device_id")
+      .default_value("");
   args.add_argument("--artifact-path").default_value("dist");
   args.add_argument("--evaluate").default_value(false).implicit_value(true);
+  args.add_argument("--bench")
+      .help("benchmark prefill and decode, and print the results as JSON")
+      .default_value(false)
+      .implicit_value(true);
+  args.add_argument("--bench-config")
+      .help("JSON object of the benchmark sweep, such as '{\"prompt_lens\": [128], "
+            "\"gen_lens\": [64], \"batch_sizes\": [1, 4], \"warmup\": 1, \"repeat\": 5}'")
+      .default_value("");
+  args.add_argument("--bench-output")
+      .help("JSON file to write the benchmark results to, stdout if not given")
+      .default_value("");
+  args.add_argument("--batch-file")
+      .help("JSONL file of prompts to generate with the batched engine instead of chatting")
+      .default_value("");
+  args.add_argument("--batch-output")
+      .help("JSONL file to write the batch outputs to, stdout if not given")
+      .default_value("");
+  args.add_argument("--concurrency")
+      .help("maximum number of batch requests generated at the same time")
+      .default_value(8)
+      .scan<'i', int>();
+  args.add_argument("--trace-file")
+      .help("file to write a Chrome trace of the runtime phases to, opened by Perfetto")
+      .default_value("");
+  args.add_argument("--draft-local-id")
+      .help("local id of a smaller model that drafts tokens for speculative decoding")
+      .default_value("");
+  args.add_argument("--memory-budget")
+      .help("device memory budget of the resident models in MB, unlimited if 0")
+      .default_value(0)
+      .scan<'i', int>();
 
   try {
     args.parse_args(argc, argv);
@@ -268,6 +651,15 @@ int main(int argc, char* argv[]) {
   std::string quantization = args.get<std::string>("--quantization");
   std::string device_name = DetectDeviceName(args.get<std::string>("--device-name"));
   int device_id = args.get<int>("--device_id");
+  std::vector<int> device_ids = ParseDeviceIds(args.get<std::string>("--device-ids"));
+  if (device_ids.size() > 1) {
+    // the runtime drives one vm on one device, tensor parallelism needs a model library built
+    // with sharded weights and collectives
+    std::cerr << "Running a model across " << device_ids.size() << " devices is not supported "
+              << "by this runtime, please select one device in --device-ids" << std::endl;
+    return 1;
+  }
+  if (!device_ids.empty()) device_id = device_ids[0];
   DLDevice device = GetDevice(device_name, device_id);
   std::string artifact_path = args.get<std::string>("--artifact-path");
   std::string arch_suffix = GetArchSuffix();
@@ -288,75 +680,86 @@ int main(int argc, char* argv[]) {
     }
   }
 
+  ArtifactIndex artifact_index(artifact_path);
   auto f_search_model_path =
-      [artifact_path, device_name, arch_suffix](
+      [&artifact_index, artifact_path, device_name, arch_suffix](
           std::vector<std::string> local_id_candidates) -> std::pair<std::string, std::string> {
-    std::optional<std::filesystem::path> config_path_opt;
-    std::string local_id;
-
     // Search for mlc-chat-config.json.
-    for (auto local_id_candidate : local_id_candidates) {
-      std::vector<std::string> config_search_paths = {
-          artifact_path + "/" + local_id_candidate + "/params",  //
-          artifact_path + "/prebuilt/" + local_id_candidate};
-      config_path_opt = FindFile(config_search_paths, {"mlc-chat-config"}, {".json"});
-      if (config_path_opt) {
-        local_id = local_id_candidate;
-        break;
-      }
-    }
-    if (!config_path_opt) {
+    std::optional<ArtifactIndex::Model> model = artifact_index.FindModel(local_id_candidates);
+    if (!model) {
       std::cerr << "Cannot find \"mlc-chat-config.json\" in path \"" << artifact_path << "/"
                 << local_id_candidates[0] << "/params/\", \"" << artifact_path
                 << "/prebuilt/" + local_id_candidates[0] << "\" or other candidate paths.";
       exit(1);
     }
-    std::cout << "Use config " << config_path_opt.value().string() << std::endl;
-    std::filesystem::path model_path = config_path_opt.value().parent_path();
+    std::cout << "Use config " << model->config_path << std::endl;
 
     // Locate the library.
-    std::string lib_name = local_id + "-" + device_name;
-    std::string lib_dir_path;
-    if (model_path.string().compare(model_path.string().length() - 7, 7, "/params") == 0) {
-      lib_dir_path = model_path.parent_path().string();
-    } else {
-      lib_dir_path = model_path.parent_path().string() + "/lib";
+    std::string lib_name = model->local_id + "-" + device_name;
+    std::vector<std::string> lib_file_names;
+    for (const std::string& name : {lib_name, lib_name + arch_suffix}) {
+      for (const std::string& suffix : GetLibSuffixes()) {
+        lib_file_names.push_back(name + suffix);
+      }
     }
-    std::optional<std::filesystem::path> lib_path_opt =
-        FindFile({lib_dir_path}, {lib_name, lib_name + arch_suffix}, GetLibSuffixes());
-    if (!lib_path_opt) {
+    std::optional<std::string> lib_path = artifact_index.FindLib(model->lib_dir, lib_file_names);
+    if (!lib_path) {
       std::cerr << "Cannot find library \"" << lib_name << GetLibSuffixes().back()
-                << "\" and other library candidate in " << lib_dir_path << std::endl;
+                << "\" and other library candidate in " << model->lib_dir << std::endl;
       exit(1);
     }
-    std::cout << "Use lib " << lib_path_opt.value().string() << std::endl;
+    std::cout << "Use lib " << lib_path.value() << std::endl;
 
     // Locate the params.
-    auto params_json_opt = FindFile({model_path}, {"ndarray-cache"}, {".json"});
-    if (!params_json_opt) {
-      std::cerr << "Cannot find ndarray-cache.json for params in " << model_path << std::endl;
+    if (!model->has_params) {
+      std::cerr << "Cannot find ndarray-cache.json for params in " << model->model_path
+                << std::endl;
       exit(1);
     }
-    std::string params = params_json_opt.value().parent_path().string();
 
-    return {lib_path_opt.value().string(), model_path.string()};
+    return {lib_path.value(), model->model_path};
   };
 
   auto [lib_path, model_path] = f_search_model_path(local_id_candidates);
 
   try {
     auto lib = Module::LoadFromFile(lib_path);
+    std::string batch_file = args.get<std::string>("--batch-file");
+    if (batch_file != "") {
+      Module engine_mod = mlc::llm::CreateEngineModule(device);
+      RunBatch(engine_mod, lib, model_path, batch_file, args.get<std::string>("--batch-output"),
+               args.get<int>("--concurrency"));
+      return 0;
+    }
     std::cout << "Initializing the chat module..." << std::endl;
     Module chat_mod = mlc::llm::CreateChatModule(device);
+    chat_mod.GetFunction("set_memory_budget")(
+        static_cast<int64_t>(args.get<int>("--memory-budget")) << 20);
 
     std::cout << "Finish loading" << std::endl;
     PrintSpecialCommands();
 
-    if (args.get<bool>("--evaluate")) {
+    if (args.get<bool>("--bench")) {
+      chat_mod.GetFunction("reload")(lib, tvm::String(model_path));
+      std::string report =
+          chat_mod.GetFunction("benchmark")(args.get<std::string>("--bench-config"));
+      std::string bench_output = args.get<std::string>("--bench-output");
+      if (bench_output != "") {
+        std::ofstream(bench_output) << report << std::endl;
+      } else {
+        std::cout << report << std::endl;
+      }
+    } else if (args.get<bool>("--evaluate")) {
       chat_mod.GetFunction("reload")(lib, tvm::String(model_path));
       chat_mod.GetFunction("evaluate")();
     } else {
-      Chat(chat_mod, lib, model_path, f_search_model_path);
+      std::string draft_local_id = args.get<std::string>("--draft-local-id");
+      std::string draft_lib_path, draft_model_path;
+      if (draft_local_id != "") {
+        std::tie(draft_lib_path, draft_model_path) = f_search_model_path({draft_local_id});
+      }
+      Chat(chat_mod, lib, model_path, f_search_model_path, draft_lib_path, draft_model_path,
+           args.get<std::string>("--trace-file"));
     }
   } catch (const std::runtime_error& err) {
     // catch exception so error message
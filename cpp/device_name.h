@@ -0,0 +1,45 @@
+/*!
+ *  Copyright (c) 2023 by Contributors
+ * \file device_name.h
+ * \brief The device names accepted by the command line front ends.
+ */
+#ifndef MLC_LLM_CPP_DEVICE_NAME_H_
+#define MLC_LLM_CPP_DEVICE_NAME_H_
+
+#include <tvm/runtime/device_api.h>
+#include <tvm/runtime/logging.h>
+
+#include <string>
+
+/*! \return The device name, or the first available GPU device if it is "auto". */
+inline std::string DetectDeviceName(std::string device_name) {
+  using tvm::runtime::DeviceAPI;
+  if (device_name == "auto") {
+    bool allow_missing = true;
+    if (DeviceAPI::Get(DLDevice{kDLCUDA, 0}, allow_missing)) {
+      return "cuda";
+    }
+    if (DeviceAPI::Get(DLDevice{kDLMetal, 0}, allow_missing)) {
+      return "metal";
+    }
+    if (DeviceAPI::Get(DLDevice{kDLVulkan, 0}, allow_missing)) {
+      return "vulkan";
+    }
+    if (DeviceAPI::Get(DLDevice{kDLOpenCL, 0}, allow_missing)) {
+      return "opencl";
+    }
+    LOG(FATAL) << "Cannot auto detect device-name";
+  }
+  return device_name;
+}
+
+inline DLDevice GetDevice(const std::string& device_name, int device_id) {
+  if (device_name == "cuda") return DLDevice{kDLCUDA, device_id};
+  if (device_name == "metal") return DLDevice{kDLMetal, device_id};
+  if (device_name == "vulkan") return DLDevice{kDLVulkan, device_id};
+  if (device_name == "opencl") return DLDevice{kDLOpenCL, device_id};
+  LOG(FATAL) << "Do not recognize device name " << device_name;
+  return DLDevice{kDLCPU, 0};
+}
+
+#endif  // MLC_LLM_CPP_DEVICE_NAME_H_
@@ -0,0 +1,490 @@
+/*!
+ *  Copyright (c) 2023 by Contributors
+ * \file grammar.cc
+ * \brief Implementation of the regular expression constraints.
+ */
+#include "grammar.h"
+
+#include <tvm/runtime/logging.h>
+
+#include <algorithm>
+#include <bitset>
+#include <cctype>
+#include <limits>
+#include <map>
+#include <memory>
+
+namespace mlc {
+namespace llm {
+
+namespace {
+
+// The maximum number of states of a compiled automaton.
+constexpr int32_t kMaxDFAStates = 1 << 14;
+// The maximum count of a bounded repetition.
+constexpr int64_t kMaxRepeat = 1000;
+
+using ByteSet = std::bitset<256>;
+
+/*! \brief A node of the parsed regular expression. */
+struct RegexNode {
+  enum class Kind { kEmpty, kBytes, kConcat, kAlt, kRepeat };
+  Kind kind = Kind::kEmpty;
+  // the bytes matched by kBytes
+  ByteSet bytes;
+  // the operands of kConcat and kAlt, or the repeated node of kRepeat
+  std::vector<std::unique_ptr<RegexNode>> children;
+  // the repetition counts of kRepeat, max_count is -1 if unbounded
+  int64_t min_count = 0, max_count = 0;
+};
+
+ByteSet ByteRange(int lo, int hi) {
+  ByteSet bytes;
+  for (int c = lo; c <= hi; ++c) bytes.set(c);
+  return bytes;
+}
+
+/*! \brief Parse a regular expression by recursive descent. */
+class RegexParser {
+ public:
+  explicit RegexParser(const std::string& pattern) : pattern_(pattern) {}
+
+  std::unique_ptr<RegexNode> Parse() {
+    std::unique_ptr<RegexNode> node = ParseAlt();
+    ICHECK_EQ(pos_, pattern_.size()) << "Unmatched \")\" in regex " << pattern_;
+    return node;
+  }
+
+ private:
+  std::unique_ptr<RegexNode> ParseAlt() {
+    std::unique_ptr<RegexNode> first = ParseConcat();
+    if (!Peek('|')) return first;
+    auto node = std::make_unique<RegexNode>();
+    node->kind = RegexNode::Kind::kAlt;
+    node->children.push_back(std::move(first));
+    while (Peek('|')) {
+      ++pos_;
+      node->children.push_back(ParseConcat());
+    }
+    return node;
+  }
+
+  std::unique_ptr<RegexNode> ParseConcat() {
+    auto node = std::make_unique<RegexNode>();
+    node->kind = RegexNode::Kind::kConcat;
+    while (pos_ < pattern_.size() && !Peek('|') && !Peek(')')) {
+      node->children.push_back(ParseRepeat());
+    }
+    return node;
+  }
+
+  std::unique_ptr<RegexNode> ParseRepeat() {
+    std::unique_ptr<RegexNode> node = ParseAtom();
+    while (pos_ < pattern_.size()) {
+      int64_t min_count = 0, max_count = -1;
+      char c = pattern_[pos_];
+      if (c == '{' && pos_ + 1 < pattern_.size() &&
+          std::isdigit(static_cast<unsigned char>(pattern_[pos_ + 1]))) {
+        ParseCounts(&min_count, &max_count);
+      } else if (c == '*' || c == '+' || c == '?') {
+        min_count = c == '+' ? 1 : 0;
+        max_count = c == '?' ? 1 : -1;
+        ++pos_;
+      } else {
+        break;
+      }
+      // a lazy quantifier matches the same texts
+      if (Peek('?')) ++pos_;
+      auto repeat = std::make_unique<RegexNode>();
+      repeat->kind = RegexNode::Kind::kRepeat;
+      repeat->min_count = min_count;
+      repeat->max_count = max_count;
+      repeat->children.push_back(std::move(node));
+      node = std::move(repeat);
+    }
+    return node;
+  }
+
+  // Parse "{n}", "{n,}" or "{n,m}", leaving pos_ after the closing brace. A brace that does
+  // not start a repetition is a literal.
+  void ParseCounts(int64_t* min_count, int64_t* max_count) {
+    ++pos_;
+    *min_count = ParseNumber();
+    *max_count = *min_count;
+    if (Peek(',')) {
+      ++pos_;
+      *max_count = Peek('}') ? -1 : ParseNumber();
+    }
+    ICHECK(Peek('}')) << "Invalid repetition in regex " << pattern_;
+    ++pos_;
+    ICHECK(*max_count == -1 || *min_count <= *max_count)
+        << "Invalid repetition in regex " << pattern_;
+    ICHECK_LE(std::max(*min_count, *max_count), kMaxRepeat)
+        << "Repetition count exceeds " << kMaxRepeat << " in regex " << pattern_;
+  }
+
+  int64_t ParseNumber() {
+    size_t begin = pos_;
+    int64_t value = 0;
+    while (pos_ < pattern_.size() && std::isdigit(static_cast<unsigned char>(pattern_[pos_]))) {
+      value = std::min(value * 10 + (pattern_[pos_++] - '0'), kMaxRepeat + 1);
+    }
+    ICHECK_GT(pos_, begin) << "Invalid repetition in regex " << pattern_;
+    return value;
+  }
+
+  std::unique_ptr<RegexNode> ParseAtom() {
+    char c = pattern_[pos_++];
+    if (c == '(') {
+      if (pattern_.compare(pos_, 2, "?:") == 0) pos_ += 2;
+      std::unique_ptr<RegexNode> node = ParseAlt();
+      ICHECK(Peek(')')) << "Unmatched \"(\" in regex " << pattern_;
+      ++pos_;
+      return node;
+    }
+    ICHECK(c != '*' && c != '+' && c != '?') << "Nothing to repeat in regex " << pattern_;
+    auto node = std::make_unique<RegexNode>();
+    if (c == '^' || c == '$') return node;
+    node->kind = RegexNode::Kind::kBytes;
+    if (c == '.') {
+      node->bytes = ~ByteRange('\n', '\n');
+    } else if (c == '[') {
+      node->bytes = ParseClass();
+    } else if (c == '\\') {
+      node->bytes = ParseEscape();
+    } else {
+      node->bytes.set(static_cast<unsigned char>(c));
+    }
+    return node;
+  }
+
+  // Parse a bracket class after its "[".
+  ByteSet ParseClass() {
+    bool negate = Peek('^');
+    if (negate) ++pos_;
+    ByteSet bytes;
+    bool first = true;
+    while (true) {
+      ICHECK_LT(pos_, pattern_.size()) << "Unmatched \"[\" in regex " << pattern_;
+      char c = pattern_[pos_++];
+      if (c == ']' && !first) break;
+      first = false;
+      if (c == '\\') {
+        bytes |= ParseEscape();
+        continue;
+      }
+      ICHECK(static_cast<unsigned char>(c) < 0x80)
+          << "Non-ASCII characters in a class are not supported in regex " << pattern_;
+      int lo = static_cast<unsigned char>(c);
+      if (Peek('-') && pos_ + 1 < pattern_.size() && pattern_[pos_ + 1] != ']') {
+        int hi = static_cast<unsigned char>(pattern_[pos_ + 1]);
+        ICHECK_LE(lo, hi) << "Invalid class range in regex " << pattern_;
+        pos_ += 2;
+        bytes |= ByteRange(lo, hi);
+      } else {
+        bytes.set(lo);
+      }
+    }
+    return negate ? ~bytes : bytes;
+  }
+
+  // Parse an escape after its backslash.
+  ByteSet ParseEscape() {
+    ICHECK_LT(pos_, pattern_.size()) << "Trailing backslash in regex " << pattern_;
+    char c = pattern_[pos_++];
+    ByteSet digit = ByteRange('0', '9');
+    ByteSet word = ByteRange('a', 'z') | ByteRange('A', 'Z') | digit;
+    word.set('_');
+    ByteSet space;
+    for (char s : std::string(" \t\n\r\f\v")) space.set(s);
+    ByteSet bytes;
+    switch (c) {
+      case 'd': return digit;
+      case 'D': return ~digit;
+      case 'w': return word;
+      case 'W': return ~word;
+      case 's': return space;
+      case 'S': return ~space;
+      case 'n': bytes.set('\n'); return bytes;
+      case 't': bytes.set('\t'); return bytes;
+      case 'r': bytes.set('\r'); return bytes;
+      case 'f': bytes.set('\f'); return bytes;
+      case 'v': bytes.set('\v'); return bytes;
+      default: bytes.set(static_cast<unsigned char>(c)); return bytes;
+    }
+  }
+
+  bool Peek(char c) const { return pos_ < pattern_.size() && pattern_[pos_] == c; }
+
+  const std::string& pattern_;
+  size_t pos_{0};
+};
+
+/*! \brief A nondeterministic automaton built by the Thompson construction. */
+class RegexNFA {
+ public:
+  struct State {
+    // the states reached without reading a byte
+    std::vector<int32_t> epsilon;
+    // the state reached by reading one of the bytes, -1 if none
+    ByteSet bytes;
+    int32_t next = -1;
+  };
+
+  explicit RegexNFA(const RegexNode& root) {
+    std::pair<int32_t, int32_t> fragment = Build(root);
+    start_ = fragment.first;
+    accept_ = fragment.second;
+  }
+
+  int32_t start() const { return start_; }
+  int32_t accept() const { return accept_; }
+  const std::vector<State>& states() const { return states_; }
+
+ private:
+  int32_t NewState() {
+    ICHECK_LT(states_.size(), static_cast<size_t>(kMaxDFAStates) * 16)
+        << "The regex is too large";
+    states_.emplace_back();
+    return states_.size() - 1;
+  }
+
+  // Build a fragment with one entry and one exit state.
+  std::pair<int32_t, int32_t> Build(const RegexNode& node) {
+    switch (node.kind) {
+      case RegexNode::Kind::kEmpty: {
+        int32_t s = NewState();
+        return {s, s};
+      }
+      case RegexNode::Kind::kBytes: {
+        int32_t s = NewState();
+        int32_t e = NewState();
+        states_[s].bytes = node.bytes;
+        states_[s].next = e;
+        return {s, e};
+      }
+      case RegexNode::Kind::kConcat: {
+        int32_t s = NewState();
+        int32_t e = s;
+        for (const auto& child : node.children) {
+          std::pair<int32_t, int32_t> fragment = Build(*child);
+          states_[e].epsilon.push_back(fragment.first);
+          e = fragment.second;
+        }
+        return {s, e};
+      }
+      case RegexNode::Kind::kAlt: {
+        int32_t s = NewState();
+        int32_t e = NewState();
+        for (const auto& child : node.children) {
+          std::pair<int32_t, int32_t> fragment = Build(*child);
+          states_[s].epsilon.push_back(fragment.first);
+          states_[fragment.second].epsilon.push_back(e);
+        }
+        return {s, e};
+      }
+      case RegexNode::Kind::kRepeat: {
+        const RegexNode& child = *node.children[0];
+        int32_t s = NewState();
+        int32_t e = s;
+        for (int64_t i = 0; i < node.min_count; ++i) {
+          std::pair<int32_t, int32_t> fragment = Build(child);
+          states_[e].epsilon.push_back(fragment.first);
+          e = fragment.second;
+        }
+        if (node.max_count < 0) {
+          std::pair<int32_t, int32_t> fragment = Build(child);
+          int32_t loop_exit = NewState();
+          states_[e].epsilon.push_back(fragment.first);
+          states_[e].epsilon.push_back(loop_exit);
+          states_[fragment.second].epsilon.push_back(fragment.first);
+          states_[fragment.second].epsilon.push_back(loop_exit);
+          return {s, loop_exit};
+        }
+        for (int64_t i = node.min_count; i < node.max_count; ++i) {
+          std::pair<int32_t, int32_t> fragment = Build(child);
+          int32_t skip_exit = NewState();
+          states_[e].epsilon.push_back(fragment.first);
+          states_[e].epsilon.push_back(skip_exit);
+          states_[fragment.second].epsilon.push_back(skip_exit);
+          e = skip_exit;
+        }
+        return {s, e};
+      }
+    }
+    LOG(FATAL) << "Unknown regex node";
+    return {-1, -1};
+  }
+
+  std::vector<State> states_;
+  int32_t start_, accept_;
+};
+
+// Add the states reachable from the given states without reading a byte, in place.
+void EpsilonClosure(const RegexNFA& nfa, std::vector<int32_t>* states) {
+  std::vector<bool> seen(nfa.states().size(), false);
+  std::vector<int32_t> stack = *states;
+  states->clear();
+  while (!stack.empty()) {
+    int32_t s = stack.back();
+    stack.pop_back();
+    if (seen[s]) continue;
+    seen[s] = true;
+    states->push_back(s);
+    for (int32_t t : nfa.states()[s].epsilon) {
+      if (!seen[t]) stack.push_back(t);
+    }
+  }
+  std::sort(states->begin(), states->end());
+}
+
+}  // namespace
+
+RegexDFA::RegexDFA(const std::string& pattern) {
+  std::unique_ptr<RegexNode> root = RegexParser(pattern).Parse();
+  RegexNFA nfa(*root);
+  // subset construction, every nonempty subset can still reach the accept state
+  std::map<std::vector<int32_t>, int32_t> state_ids;
+  std::vector<std::vector<int32_t>> subsets;
+  auto get_state = [&](std::vector<int32_t> subset) {
+    auto it = state_ids.find(subset);
+    if (it != state_ids.end()) return it->second;
+    ICHECK_LT(subsets.size(), kMaxDFAStates) << "The regex is too complex: " << pattern;
+    int32_t id = subsets.size();
+    state_ids.emplace(subset, id);
+    accepting_.push_back(std::binary_search(subset.begin(), subset.end(), nfa.accept()));
+    subsets.push_back(std::move(subset));
+    transitions_.emplace_back();
+    transitions_.back().fill(-1);
+    return id;
+  };
+  std::vector<int32_t> start{nfa.start()};
+  EpsilonClosure(nfa, &start);
+  get_state(start);
+  for (size_t id = 0; id < subsets.size(); ++id) {
+    for (int byte = 0; byte < 256; ++byte) {
+      std::vector<int32_t> next;
+      for (int32_t s : subsets[id]) {
+        const RegexNFA::State& state = nfa.states()[s];
+        if (state.next >= 0 && state.bytes.test(byte)) next.push_back(state.next);
+      }
+      if (next.empty()) continue;
+      EpsilonClosure(nfa, &next);
+      int32_t next_id = get_state(std::move(next));
+      transitions_[id][byte] = next_id;
+    }
+  }
+}
+
+TokenGrammar::TokenGrammar(RegexDFA dfa, const std::vector<std::string>& token_texts,
+                           const std::vector<int32_t>& stop_tokens)
+    : dfa_(std::move(dfa)), token_texts_(token_texts) {
+  int64_t vocab_size = token_texts_.size();
+  num_words_ = (vocab_size + 63) / 64;
+  allowed_.assign(num_words_ * dfa_.NumStates(), 0);
+  // A trie of the token texts, so that tokens sharing a prefix walk the automaton once.
+  struct TrieNode {
+    std::vector<std::pair<uint8_t, int32_t>> children;
+    std::vector<int32_t> tokens;
+  };
+  std::vector<TrieNode> trie(1);
+  for (int64_t token = 0; token < vocab_size; ++token) {
+    int32_t node = 0;
+    for (char c : token_texts_[token]) {
+      uint8_t byte = static_cast<uint8_t>(c);
+      auto it = std::find_if(trie[node].children.begin(), trie[node].children.end(),
+                             [byte](const auto& child) { return child.first == byte; });
+      if (it != trie[node].children.end()) {
+        node = it->second;
+        continue;
+      }
+      trie[node].children.emplace_back(byte, trie.size());
+      node = trie.size();
+      trie.emplace_back();
+    }
+    // tokens without text never advance the automaton and are not allowed
+    if (node != 0) trie[node].tokens.push_back(token);
+  }
+  std::vector<std::pair<int32_t, int32_t>> stack;
+  for (int32_t state = 0; state < dfa_.NumStates(); ++state) {
+    uint64_t* bits = allowed_.data() + state * num_words_;
+    stack.assign(1, {0, state});
+    while (!stack.empty()) {
+      auto [node, dfa_state] = stack.back();
+      stack.pop_back();
+      for (int32_t token : trie[node].tokens) {
+        bits[token / 64] |= uint64_t(1) << (token % 64);
+      }
+      for (const auto& [byte, child] : trie[node].children) {
+        int32_t next = dfa_.Next(dfa_state, byte);
+        if (next >= 0) stack.emplace_back(child, next);
+      }
+    }
+    bool any_allowed = std::any_of(bits, bits + num_words_, [](uint64_t w) { return w != 0; });
+    // stop once the text matches, or when no token can continue it
+    if (dfa_.IsAccepting(state) || !any_allowed) {
+      for (int32_t token : stop_tokens) {
+        if (token >= 0 && token < vocab_size) bits[token / 64] |= uint64_t(1) << (token % 64);
+      }
+    }
+  }
+  for (int32_t token : stop_tokens) {
+    if (token >= 0 && token < vocab_size) token_texts_[token].clear();
+  }
+}
+
+int32_t TokenGrammar::Advance(int32_t state, int32_t token) const {
+  ICHECK_GE(state, 0) << "The constrained text is already finished";
+  ICHECK(token >= 0 && token < vocab_size()) << "Token " << token << " is out of the vocabulary";
+  const uint64_t* bits = allowed_.data() + state * num_words_;
+  ICHECK((bits[token / 64] >> (token % 64)) & 1) << "Token " << token << " is not allowed";
+  if (token_texts_[token].empty()) return -1;
+  for (char c : token_texts_[token]) {
+    state = dfa_.Next(state, static_cast<uint8_t>(c));
+  }
+  return state;
+}
+
+void TokenGrammar::MaskLogits(int32_t state, float* logits, int64_t vocab_size) const {
+  ICHECK_GE(state, 0) << "The constrained text is already finished";
+  ICHECK_EQ(vocab_size, this->vocab_size()) << "The grammar is built for another vocabulary";
+  const uint64_t* bits = allowed_.data() + state * num_words_;
+  const float neg_inf = -std::numeric_limits<float>::infinity();
+  for (int64_t w = 0; w < num_words_; ++w) {
+    uint64_t word = bits[w];
+    if (word == ~uint64_t(0)) continue;
+    int64_t begin = w * 64;
+    int64_t end = std::min(begin + 64, vocab_size);
+    // branchless so that the compiler vectorizes the select
+    for (int64_t i = begin; i < end; ++i) {
+      logits[i] = ((word >> (i - begin)) & 1) ? logits[i] : neg_inf;
+    }
+  }
+}
+
+bool MapByteFallbackTokens(std::vector<std::string>* token_texts) {
+  const std::string replacement_char = "\xEF\xBF\xBD";
+  const std::vector<std::string>& texts = *token_texts;
+  // the printable ASCII bytes, which every tokenizer decodes to themselves
+  auto is_run = [&](size_t first) {
+    for (int byte = 0x21; byte < 0x7F; ++byte) {
+      if (texts[first + byte] != std::string(1, static_cast<char>(byte))) return false;
+    }
+    for (int byte = 0x80; byte < 0x100; ++byte) {
+      if (texts[first + byte] != replacement_char) return false;
+    }
+    return true;
+  };
+  for (size_t first = 0; first + 256 <= texts.size(); ++first) {
+    // the last byte rules out most ids with one comparison
+    if (texts[first + 0xFF] != replacement_char || !is_run(first)) continue;
+    for (int byte = 0; byte < 256; ++byte) {
+      (*token_texts)[first + byte] = std::string(1, static_cast<char>(byte));
+    }
+    return true;
+  }
+  return false;
+}
+
+}  // namespace llm
+}  // namespace mlc
@@ -0,0 +1,102 @@
+/*!
+ *  Copyright (c) 2023 by Contributors
+ * \file grammar.h
+ * \brief Regular expression constraints on the generated text, as masks over the vocabulary.
+ */
+#ifndef MLC_LLM_CPP_GRAMMAR_H_
+#define MLC_LLM_CPP_GRAMMAR_H_
+
+#include <array>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+namespace mlc {
+namespace llm {
+
+/*!
+ * \brief A deterministic automaton over bytes that recognizes a regular expression.
+ *
+ * The expression matches the whole text and supports literals, the escapes \d \w \s \D \W \S
+ * and escaped punctuation, ".", bracket classes with ranges and negation, groups, "|", and
+ * the quantifiers "*", "+", "?", "{n}", "{n,}" and "{n,m}". Characters outside ASCII are
+ * matched as their UTF-8 bytes, and "^" and "$" are ignored.
+ */
+class RegexDFA {
+ public:
+  explicit RegexDFA(const std::string& pattern);
+
+  /*! \return The state before any byte. */
+  int32_t Start() const { return 0; }
+
+  /*! \return The state after the byte, or -1 if no text with the prefix matches. */
+  int32_t Next(int32_t state, uint8_t byte) const { return transitions_[state][byte]; }
+
+  /*! \return Whether the text read up to the state matches. */
+  bool IsAccepting(int32_t state) const { return accepting_[state]; }
+
+  int32_t NumStates() const { return transitions_.size(); }
+
+ private:
+  std::vector<std::array<int32_t, 256>> transitions_;
+  std::vector<bool> accepting_;
+};
+
+/*!
+ * \brief The tokens allowed in each state of a RegexDFA, for the vocabulary of a model.
+ *
+ * A token is allowed if its text keeps the generated text a prefix of a match, and a stop
+ * token is allowed once the text matches. The allowed tokens of all states are computed
+ * once as bitsets, by walking a trie of the token texts along the automaton, so masking the
+ * logits of a step does not look at the token texts.
+ */
+class TokenGrammar {
+ public:
+  /*!
+   * \param dfa The automaton of the constraint.
+   * \param token_texts The text of each token, empty for tokens that do not produce text.
+   * \param stop_tokens The tokens that end the generation.
+   */
+  TokenGrammar(RegexDFA dfa, const std::vector<std::string>& token_texts,
+               const std::vector<int32_t>& stop_tokens);
+
+  int32_t Start() const { return dfa_.Start(); }
+
+  /*! \return The state after generating the token in the state, -1 for a stop token. */
+  int32_t Advance(int32_t state, int32_t token) const;
+
+  /*!
+   * \brief Set the logits of the tokens not allowed in the state to -inf.
+   * \param state The current state.
+   * \param logits The logits over the vocabulary.
+   * \param vocab_size The number of logits, which must be the vocabulary size of the grammar.
+   */
+  void MaskLogits(int32_t state, float* logits, int64_t vocab_size) const;
+
+  int64_t vocab_size() const { return token_texts_.size(); }
+
+ private:
+  RegexDFA dfa_;
+  std::vector<std::string> token_texts_;
+  // The number of 64-bit words of a bitset, and the bitsets of all states one after another.
+  int64_t num_words_;
+  std::vector<uint64_t> allowed_;
+};
+
+/*!
+ * \brief Replace the texts of the byte fallback tokens <0x00> ... <0xFF> of a vocabulary by
+ *  the bytes they stand for.
+ *
+ * Decoded alone, the fallback tokens of the bytes 0x80 to 0xFF give U+FFFD rather than their
+ * byte, so a grammar would never allow them inside a multi-byte character. The tokens are
+ * found as a run of 256 ids whose texts are the ASCII characters of their bytes up to 0x7F
+ * and U+FFFD after, which is how SentencePiece vocabularies with byte fallback lay them out.
+ * \param token_texts The text of each token, updated in place.
+ * \return Whether the byte fallback tokens are found.
+ */
+bool MapByteFallbackTokens(std::vector<std::string>* token_texts);
+
+}  // namespace llm
+}  // namespace mlc
+
+#endif  // MLC_LLM_CPP_GRAMMAR_H_
@@ -9,21 +9,39 @@
 
 #include <picojson.h>
 #include <tokenizers_cpp.h>
+#include <tvm/runtime/device_api.h>
 #include <tvm/runtime/module.h>
 #include <tvm/runtime/ndarray.h>
 #include <tvm/runtime/registry.h>
 #include <tvm/runtime/relax_vm/memory_manager.h>
 
+#include <algorithm>
+#include <atomic>
 #include <cctype>
 #include <chrono>
+#include <deque>
 #include <filesystem>
 #include <fstream>
+#include <functional>
+#include <future>
 #include <iomanip>
 #include <list>
 #include <memory>
+#include <mutex>
+#include <numeric>
 #include <optional>
 #include <random>
 #include <string>
+#include <thread>
+#include <unordered_map>
+
+#include "grammar.h"
+#include "mapped_file.h"
+#include "metrics.h"
+#include "paged_kv_cache.h"
+#include "param_loader.h"
+#include "request_queue.h"
+#include "sampler.h"
 
 namespace mlc {
 namespace llm {
@@ -331,6 +349,32 @@ class Conversation {
 
   void AppendMessage(std::string role) { this->messages.push_back({role}); }
 
+  /*!
+   * \brief Tokenize a prompt segment, reusing the tokens cached for the segment at the same
+   *  index when its content is unchanged.
+   * \param index The index of the segment in GetPromptArray, where 0 is the system prompt
+   *  and i is the (i-1)-th message.
+   * \param text The text of the segment to tokenize.
+   * \param fencode The function that tokenizes text.
+   * \return The tokens of text.
+   */
+  std::vector<int32_t> EncodePromptCached(
+      size_t index, const std::string& text,
+      const std::function<std::vector<int32_t>(const std::string&)>& fencode) {
+    if (index >= this->token_cache_.size()) {
+      this->token_cache_.resize(index + 1);
+    }
+    PromptTokenCache& entry = this->token_cache_[index];
+    size_t hash = std::hash<std::string>()(text);
+    if (!entry.valid || entry.hash != hash || entry.length != text.length()) {
+      entry.tokens = fencode(text);
+      entry.hash = hash;
+      entry.length = text.length();
+      entry.valid = true;
+    }
+    return entry.tokens;
+  }
+
   std::string conv_template;
   SeparatorStyle separator_style{SeparatorStyle::kSingle};
   std::string sep{"###"}, sep2{""};
@@ -338,7 +382,18 @@ class Conversation {
   std::vector<std::vector<std::string>> messages;
 
  private:
+  /*! \brief The tokens of a prompt segment and the hash of its content. */
+  struct PromptTokenCache {
+    bool valid{false};
+    size_t hash{0};
+    size_t length{0};
+    std::vector<int32_t> tokens;
+  };
+
   std::string system_;
+  // Token cache of the prompt segments, indexed by the segment index in GetPromptArray.
+  // Entries are kept across resets since the content hash tells whether they are stale.
+  std::vector<PromptTokenCache> token_cache_;
 };
 
 //----------------------------
@@ -384,16 +439,192 @@ std::unique_ptr<Tokenizer> TokenizerFromPath(const std::string& path) {
   }
 }
 
+/*!
+ * \brief A tokenizer shared by the chats of all models loaded from the same tokenizer files.
+ *  The calls are serialized, since the tokenizers do not all allow concurrent calls.
+ */
+class SharedTokenizer : public Tokenizer {
+ public:
+  explicit SharedTokenizer(std::unique_ptr<Tokenizer> tokenizer)
+      : tokenizer_(std::move(tokenizer)) {}
+
+  std::vector<int32_t> Encode(const std::string& text) final {
+    std::lock_guard<std::mutex> lock(mutex_);
+    return tokenizer_->Encode(text);
+  }
+
+  std::string Decode(const std::vector<int32_t>& ids) final {
+    std::lock_guard<std::mutex> lock(mutex_);
+    return tokenizer_->Decode(ids);
+  }
+
+ private:
+  std::mutex mutex_;
+  std::unique_ptr<Tokenizer> tokenizer_;
+};
+
+// The number of tokenizers kept by LoadTokenizer after their chats are gone.
+constexpr size_t kTokenizerCacheSize = 4;
+
+/*!
+ * \brief Load the tokenizer of a model path like TokenizerFromPath, reusing the tokenizer loaded
+ *  before from the same files if they have not changed, so that reloading a model does not
+ *  parse its tokenizer again. The most recently loaded tokenizers are kept.
+ */
+std::shared_ptr<Tokenizer> LoadTokenizer(const std::string& path) {
+  // the files TokenizerFromPath may read, with their sizes and modification times
+  std::ostringstream signature;
+  for (const char* name : {"tokenizer.model", "vocab.json", "merges.txt", "added_tokens.json",
+                           "tokenizer.json"}) {
+    std::filesystem::path file(path + "/" + name);
+    std::error_code ec;
+    auto size = std::filesystem::file_size(file, ec);
+    if (ec) continue;
+    signature << name << ":" << size << ":"
+              << std::filesystem::last_write_time(file, ec).time_since_epoch().count() << ";";
+  }
+  std::error_code ec;
+  std::filesystem::path canonical_path = std::filesystem::weakly_canonical(path, ec);
+  std::string key = (ec ? path : canonical_path.string()) + "|" + signature.str();
+
+  static std::mutex mutex;
+  // the cached tokenizers by key, the most recently used first
+  static std::list<std::pair<std::string, std::shared_ptr<Tokenizer>>> cache;
+  {
+    std::lock_guard<std::mutex> lock(mutex);
+    auto it = std::find_if(cache.begin(), cache.end(),
+                           [&](const auto& entry) { return entry.first == key; });
+    if (it != cache.end()) {
+      cache.splice(cache.begin(), cache, it);
+      return it->second;
+    }
+  }
+  // parse outside the lock, a concurrent load of the same files at worst parses them twice
+  std::shared_ptr<Tokenizer> tokenizer = std::make_shared<SharedTokenizer>(TokenizerFromPath(path));
+  std::lock_guard<std::mutex> lock(mutex);
+  cache.remove_if([&](const auto& entry) { return entry.first == key; });
+  cache.emplace_front(key, tokenizer);
+  if (cache.size() > kTokenizerCacheSize) cache.pop_back();
+  return tokenizer;
+}
+
 //------------------------------
 // Chat module
 //------------------------------
 class LLMChatModule;
+class LLMEngine;
+class ChatSessionServer;
+
+/*!
+ * \brief The KV cache rows of the bos and the system prompt, shared by the chats of a loaded
+ *  model so that new and reset conversations do not prefill them again.
+ */
+struct SystemPrefixKVCache {
+  // the prefix tokens, empty if nothing is cached
+  std::vector<int32_t> tokens;
+  // the rows of the prefix in each KV cache
+  std::vector<NDArray> rows;
+};
+
+/*!
+ * \brief The token texts of a loaded model and the grammars compiled over them, shared by the
+ *  chats forked from the model.
+ */
+struct GrammarCache {
+  // guards the cache, since sessions run on another thread than the selected chat
+  std::mutex mutex;
+  // the text of each token, computed by the first constrained step
+  std::vector<std::string> token_texts;
+  // the grammars by their regex
+  std::unordered_map<std::string, std::shared_ptr<const TokenGrammar>> grammars;
+};
+
+/*!
+ * \brief The sampling parameters passed to the softmax and the device sampling, kept on the
+ *  device and shared by the chats of a loaded model. A parameter is only copied to the device
+ *  when it changes, instead of on every step.
+ */
+class DeviceSamplingParams {
+ public:
+  explicit DeviceSamplingParams(DLDevice device)
+      : temperature_(NDArray::Empty({}, DataType::Float(32), device)),
+        top_p_(NDArray::Empty({}, DataType::Float(32), device)) {}
+
+  /*! \return The temperature on device, set to temperature. */
+  NDArray Temperature(float temperature) {
+    Update(temperature_, &host_temperature_, temperature);
+    return temperature_;
+  }
+
+  /*! \return The top_p on device, set to top_p. */
+  NDArray TopP(float top_p) {
+    Update(top_p_, &host_top_p_, top_p);
+    return top_p_;
+  }
+
+ private:
+  static void Update(NDArray param, std::optional<float>* host_value, float value) {
+    if (*host_value == value) return;
+    param.CopyFromBytes(&value, sizeof(float));
+    *host_value = value;
+  }
+
+  NDArray temperature_, top_p_;
+  // the values on device, nullopt before the first copy
+  std::optional<float> host_temperature_, host_top_p_;
+};
+
+// The magic, and the bytes of the magic and the header length, at the start of a session file.
+constexpr const char* kSessionMagic = "MLCSESS1";
+constexpr int64_t kSessionPrefixBytes = 16;
+// The alignment of the KV cache data in a session file.
+constexpr int64_t kSessionDataAlignment = 64;
+
+/*!
+ * \brief A host array in page-locked memory on devices that have it, which the device copies
+ *  to and from by DMA without a bounce buffer, and asynchronously when the copy is on a stream.
+ *  Other devices get a plain CPU array.
+ */
+class PinnedHostArray {
+ public:
+  PinnedHostArray() = default;
+
+  PinnedHostArray(ShapeTuple shape, DLDataType dtype, DLDevice device) {
+    DLDevice host{kDLCPU, 0};
+    if (device.device_type == kDLCUDA) {
+      host.device_type = kDLCUDAHost;
+    } else if (device.device_type == kDLROCM) {
+      host.device_type = kDLROCMHost;
+    }
+    storage_ = NDArray::Empty(shape, dtype, host);
+    if (host.device_type == kDLCPU) {
+      view_ = storage_;
+      return;
+    }
+    // host functions such as the CPU sampling only accept CPU arrays
+    DLTensor tensor = *storage_.operator->();
+    tensor.device = DLDevice{kDLCPU, 0};
+    view_ = NDArray::FromExternalDLTensor(tensor);
+  }
+
+  bool defined() const { return storage_.defined(); }
+
+  /*! \return The array viewed as a CPU array, valid while this object is alive. */
+  const NDArray& cpu() const { return view_; }
+
+ private:
+  // the allocation, and a CPU view of it
+  NDArray storage_{nullptr};
+  NDArray view_{nullptr};
+};
 
 /*!
  * \brief Implements the chat conversation wrapper
  */
 class LLMChat {
   friend class LLMChatModule;
+  friend class LLMEngine;
+  friend class ChatSessionServer;
 
  public:
   explicit LLMChat(DLDevice device) : device_(device) {}
@@ -407,16 +638,45 @@ class LLMChat {
        << this->encode_total_tokens / this->encode_total_time << " tok/s"
        << ", decode: " << std::setprecision(1) << std::fixed
        << this->decode_total_tokens / this->decode_total_time << " tok/s";
+    if (this->spec_draft_tokens > 0) {
+      os << ", draft-accept-rate: " << std::setprecision(1) << std::fixed
+         << 100.0 * this->spec_accepted_tokens / this->spec_draft_tokens << "%";
+    }
+    if (ThreadAllocationCount() >= 0 && this->decode_total_tokens > 0) {
+      os << ", decode-allocs: " << std::setprecision(1) << std::fixed
+         << static_cast<double>(runtime_stats_.Counter("decode_allocs")) /
+                this->decode_total_tokens
+         << "/tok";
+    }
     // os << ", sample-cost: " << std::setprecision(1) << std::fixed
     //    << 100 * (this->sample_total_time / this->decode_total_time) << "%";
     return os.str();
   }
 
+  /*!
+   * \return JSON string of the runtime stats, with the throughputs of RuntimeStatsText and the
+   *  timings of each phase since the stats were reset.
+   */
+  std::string RuntimeStatsJSON() {
+    picojson::object stats = runtime_stats_.AsJSON();
+    stats["prefill_tok_s"] = picojson::value(
+        encode_total_time > 0 ? encode_total_tokens / encode_total_time : 0.0);
+    stats["decode_tok_s"] = picojson::value(
+        decode_total_time > 0 ? decode_total_tokens / decode_total_time : 0.0);
+    return picojson::value(stats).serialize();
+  }
+
   void Reload(tvm::runtime::Module executable, String model_path) {
-    // Step 1. Set tokenizer.
-    this->tokenizer_ = TokenizerFromPath(model_path);
+    // Step 1. Start loading params, which overlaps with the tokenizer and vm initialization.
+    std::string param_path = model_path;
+    DLDevice device = device_;
+    std::future<Array<NDArray>> params_future = std::async(
+        std::launch::async, [param_path, device]() { return LoadParams(param_path, device); });
 
-    // Step 2. Initialize vm, we use the packed function mechanism
+    // Step 2. Set tokenizer.
+    this->tokenizer_ = LoadTokenizer(model_path);
+
+    // Step 3. Initialize vm, we use the packed function mechanism
     // so there is no explicit abi dependency on these extra
     // classes other than basic tvm runtime.
     auto fload_exec = executable->GetFunction("vm_load_executable");
@@ -429,35 +689,15 @@ class LLMChat {
 
     encoding_func_ = vm_->GetFunction("encoding");
     decoding_func_ = vm_->GetFunction("decoding");
+    decoding_batch_func_ = vm_->GetFunction("decoding_batch");
     encoding_without_cache_func_ = vm_->GetFunction("encoding_without_cache");
     softmax_func_ = vm_->GetFunction("softmax_with_temperature");
     get_metadata_func_ = vm_->GetFunction("get_metadata");
+    kv_cache_rotate_func_ = vm_->GetFunction("kv_cache_rotate");
+    sample_top_p_func_ = vm_->GetFunction("sample_top_p");
+    verification_func_ = vm_->GetFunction("verification");
 
-    auto fsample_topp_from_prob_ptr =
-        tvm::runtime::Registry::Get("vm.builtin.sample_top_p_from_prob");
-    ICHECK(fsample_topp_from_prob_ptr)
-        << "Cannot find env function vm.builtin.sample_top_p_from_prob";
-    fsample_topp_from_prob_ = *fsample_topp_from_prob_ptr;
-    auto fsample_topp_from_logits_ptr =
-        tvm::runtime::Registry::Get("vm.builtin.sample_top_p_from_logits");
-    ICHECK(fsample_topp_from_logits_ptr)
-        << "Cannot find env function vm.builtin.sample_top_p_from_logits";
-    fsample_topp_from_logits_ = *fsample_topp_from_logits_ptr;
-
-    // Step 3. Load params in nd-array cache.
-    const PackedFunc* fload_cache = tvm::runtime::Registry::Get("vm.builtin.ndarray_cache.load");
-    ICHECK(fload_cache) << "TVM runtime cannot find vm.builtin.ndarray_cache.load";
-    (*fload_cache)(model_path, static_cast<int32_t>(device_.device_type), device_.device_id);
-
-    const PackedFunc* fload_params =
-        tvm::runtime::Registry::Get("vm.builtin.param_array_from_cache");
-    ICHECK(fload_params) << "Cannot find env function vm.builtin.param_array_from_cache";
-    params_ = (*fload_params)("param", -1);
-
-    // Step 4. KV cache creation.
-    kv_cache_ = vm_->GetFunction("create_kv_cache")();
-
-    // Step 5. Process config json string.
+    // Step 4. Process config json string.
     std::ifstream config_istream((model_path + "/mlc-chat-config.json").c_str());
     std::ostringstream config_ostream;
     ICHECK(config_istream);
@@ -476,8 +716,33 @@ class LLMChat {
     this->top_p_ = config["top_p"].get<double>();
     this->mean_gen_len_ = config["mean_gen_len"].get<int64_t>();
     this->shift_fill_factor_ = config["shift_fill_factor"].get<double>();
+    if (config.count("shift_retain_kv")) {
+      ICHECK(config["shift_retain_kv"].is<bool>());
+      this->shift_retain_kv_ = config["shift_retain_kv"].get<bool>();
+    }
+    if (config.count("top_k")) {
+      ICHECK(config["top_k"].is<int64_t>());
+      this->top_k_ = config["top_k"].get<int64_t>();
+    }
+    if (config.count("repetition_penalty")) {
+      ICHECK(config["repetition_penalty"].is<double>());
+      this->repetition_penalty_ = config["repetition_penalty"].get<double>();
+      ICHECK_GT(this->repetition_penalty_, 0) << "The repetition penalty must be positive";
+    }
+    if (config.count("sample_on_device")) {
+      ICHECK(config["sample_on_device"].is<bool>());
+      this->sample_on_device_ = config["sample_on_device"].get<bool>();
+    }
+    if (config.count("system_prefix_cache")) {
+      ICHECK(config["system_prefix_cache"].is<bool>());
+      this->use_system_prefix_cache_ = config["system_prefix_cache"].get<bool>();
+    }
+    if (config.count("prefill_chunk_size")) {
+      ICHECK(config["prefill_chunk_size"].is<int64_t>());
+      this->prefill_chunk_size_ = config["prefill_chunk_size"].get<int64_t>();
+    }
 
-    // Step 6. Process metadata
+    // Step 5. Process metadata
     String metadata_str = this->get_metadata_func_();
     picojson::value metadata_info;
     picojson::parse(metadata_info, std::string(metadata_str));
@@ -496,7 +761,17 @@ class LLMChat {
       this->stop_tokens_.push_back(static_cast<int32_t>(stop_token.get<int64_t>()));
     }
 
-    // Step 7. Initialize conversation.
+    // Step 6. Wait for the params.
+    params_ = params_future.get();
+
+    // Step 7. KV cache creation.
+    this->InitKVCachePool(metadata, config);
+    kv_cache_ = this->CreateKVCache();
+    this->system_prefix_cache_ = std::make_shared<SystemPrefixKVCache>();
+    this->sampling_params_ = std::make_shared<DeviceSamplingParams>(device_);
+    this->grammar_cache_ = std::make_shared<GrammarCache>();
+
+    // Step 8. Initialize conversation.
     this->conversation_ = Conversation::Create(conv_template);
     this->stop_str_ = this->conversation_.separator_style == Conversation::SeparatorStyle::kSingle
                           ? this->conversation_.sep
@@ -526,6 +801,14 @@ class LLMChat {
       this->stop_tokens_.push_back(static_cast<int32_t>(stop_token.get<int64_t>()));
     }
 
+    this->InitKVCachePool(metadata, {});
+    if (kv_cache_pool_.defined()) {
+      this->kv_cache_ = this->CreateKVCache();
+    }
+    this->system_prefix_cache_ = std::make_shared<SystemPrefixKVCache>();
+    this->sampling_params_ = std::make_shared<DeviceSamplingParams>(device_);
+    this->grammar_cache_ = std::make_shared<GrammarCache>();
+
     this->conversation_ = Conversation::Create(conv_template);
     this->temperature_ = temperature;
     this->top_p_ = top_p;
@@ -537,6 +820,39 @@ class LLMChat {
     this->ResetChat();
   }
 
+  /*!
+   * \brief Create a new chat that shares the loaded model with this chat.
+   *
+   * The vm, params and tokenizer are shared, while the new chat owns its
+   * conversation, KV cache and per-step buffers.
+   * \return The forked chat.
+   */
+  std::unique_ptr<LLMChat> Fork() {
+    std::unique_ptr<LLMChat> chat = std::make_unique<LLMChat>(*this);
+    chat->input_token_ids_ = NDArray(nullptr);
+    chat->input_token_view_ = NDArray(nullptr);
+    chat->logits_on_cpu_ = NDArray(nullptr);
+    chat->logits_host_ = PinnedHostArray();
+    chat->input_token_host_ = PinnedHostArray();
+    chat->input_host_offset_ = 0;
+    chat->pending_logits_or_prob_ = NDArray(nullptr);
+    chat->kv_shift_buffer_ = NDArray(nullptr);
+    chat->kv_shift_moved_ = NDArray(nullptr);
+    chat->spec_logits_host_ = PinnedHostArray();
+    chat->draft_ = nullptr;
+    chat->grammar_regex_.clear();
+    chat->grammar_ = nullptr;
+    chat->kv_cache_ = chat->CreateKVCache();
+    chat->output_ids_.clear();
+    chat->output_message_.clear();
+    chat->detok_prefix_offset_ = chat->detok_read_offset_ = 0;
+    chat->message_delta_pos_ = 0;
+    chat->encounter_stop_str_ = false;
+    chat->ResetRuntimeStats();
+    chat->ResetChat();
+    return chat;
+  }
+
   void ResetChat() {
     this->conversation_.messages.clear();
     this->ClearKVCache();
@@ -544,6 +860,12 @@ class LLMChat {
     this->start_pos_ = 0;
     this->cur_pos_ = 0;
     this->add_bos_ = true;
+    this->system_kv_len_ = 0;
+    this->message_kv_pos_.clear();
+    this->pending_system_prefix_.clear();
+    this->prefill_tokens_.clear();
+    this->prefill_offset_ = 0;
+    this->seq_len_limit_ = 0;
   }
 
   /*! \brief reset the runtime stats. */
@@ -553,6 +875,216 @@ class LLMChat {
     this->encode_total_time = 0;
     this->decode_total_time = 0;
     this->sample_total_time = 0;
+    this->spec_draft_tokens = 0;
+    this->spec_accepted_tokens = 0;
+    this->runtime_stats_.Reset();
+  }
+
+  /*!
+   * \brief Save the conversation and its KV cache, so that LoadSession resumes the conversation
+   *  without prefilling it again.
+   *
+   * The file starts with the magic "MLCSESS1", the little-endian uint64 length of a JSON header
+   * and the header, which holds the conversation state and the layout of the KV cache. The
+   * filled rows of each cache follow at the 64-byte aligned data_offset of the header, one
+   * cache after another.
+   * \param path The file to write, which is replaced once it is fully written.
+   */
+  void SaveSession(const std::string& path) {
+    ICHECK(!this->InPrefill()) << "Cannot save a session in the middle of a prefill";
+    ICHECK_GT(kv_num_heads_, 0) << "The model metadata does not describe its KV cache";
+    picojson::array messages;
+    for (const std::vector<std::string>& message : conversation_.messages) {
+      picojson::array fields;
+      for (const std::string& field : message) {
+        fields.push_back(picojson::value(field));
+      }
+      messages.push_back(picojson::value(fields));
+    }
+    picojson::array message_kv_pos, kv_token_ids;
+    for (int64_t pos : message_kv_pos_) {
+      message_kv_pos.push_back(picojson::value(pos));
+    }
+    for (int32_t token : kv_token_ids_) {
+      kv_token_ids.push_back(picojson::value(static_cast<int64_t>(token)));
+    }
+
+    // Gather the filled rows of each cache, which may live in pages.
+    this->SyncComputeStream();
+    const PackedFunc* fview = this->GetKVCacheFunc("view");
+    ShapeTuple shape({total_seq_len_, kv_num_heads_, kv_head_dim_});
+    std::vector<std::string> rows(total_seq_len_ > 0 ? kv_cache_.size() : 0);
+    DLDataType dtype = kv_dtype_;
+    for (size_t i = 0; i < rows.size(); ++i) {
+      NDArray view = (*fview)(kv_cache_[i], shape);
+      dtype = view->dtype;
+      rows[i].resize(GetDataSize(*view.operator->()));
+      view.CopyToBytes(rows[i].data(), rows[i].size());
+    }
+    int64_t row_bytes = rows.empty() ? 0 : rows[0].size();
+
+    picojson::object header;
+    header["model_name"] = picojson::value(model_name_);
+    header["conv_template"] = picojson::value(conversation_.conv_template);
+    header["messages"] = picojson::value(messages);
+    header["total_seq_len"] = picojson::value(total_seq_len_);
+    header["add_bos"] = picojson::value(add_bos_);
+    header["system_kv_len"] = picojson::value(system_kv_len_);
+    header["message_kv_pos"] = picojson::value(message_kv_pos);
+    header["kv_token_ids"] = picojson::value(kv_token_ids);
+    header["num_caches"] = picojson::value(static_cast<int64_t>(rows.size()));
+    header["num_heads"] = picojson::value(kv_num_heads_);
+    header["head_dim"] = picojson::value(kv_head_dim_);
+    header["dtype"] = picojson::value(DLDataType2String(dtype));
+    header["cache_nbytes"] = picojson::value(row_bytes);
+    // the offset depends on the header length, which depends on the digits of the offset
+    int64_t data_offset = 0;
+    std::string header_str;
+    while (true) {
+      header["data_offset"] = picojson::value(data_offset);
+      header_str = picojson::value(header).serialize();
+      int64_t end = kSessionPrefixBytes + header_str.size();
+      if (data_offset >= end) break;
+      data_offset = (end + kSessionDataAlignment - 1) / kSessionDataAlignment *
+                    kSessionDataAlignment;
+    }
+
+    std::string tmp_path = path + ".tmp";
+    {
+      std::ofstream os(tmp_path, std::ios::binary | std::ios::trunc);
+      ICHECK(os) << "Cannot open " << tmp_path;
+      uint64_t header_len = header_str.size();
+      unsigned char len_bytes[8];
+      for (int b = 0; b < 8; ++b) {
+        len_bytes[b] = static_cast<unsigned char>(header_len >> (8 * b));
+      }
+      os.write(kSessionMagic, 8);
+      os.write(reinterpret_cast<const char*>(len_bytes), 8);
+      os.write(header_str.data(), header_str.size());
+      std::string padding(data_offset - kSessionPrefixBytes - header_str.size(), '\0');
+      os.write(padding.data(), padding.size());
+      for (const std::string& cache_rows : rows) {
+        os.write(cache_rows.data(), cache_rows.size());
+      }
+      ICHECK(os) << "Cannot write " << tmp_path;
+    }
+    std::filesystem::rename(tmp_path, path);
+  }
+
+  /*!
+   * \brief Resume the conversation saved by SaveSession, replacing the current one. The KV
+   *  cache is copied to the device from the memory-mapped file, and the next prompt continues
+   *  the saved conversation.
+   * \param path The file written by SaveSession.
+   */
+  void LoadSession(const std::string& path) {
+    ICHECK_GT(kv_num_heads_, 0) << "The model metadata does not describe its KV cache";
+    MappedFile file(path);
+    ICHECK(file.size() >= kSessionPrefixBytes && std::equal(kSessionMagic, kSessionMagic + 8,
+                                                            file.data()))
+        << path << " is not a session file";
+    uint64_t header_len = 0;
+    for (int b = 7; b >= 0; --b) {
+      header_len = (header_len << 8) | static_cast<unsigned char>(file.data()[8 + b]);
+    }
+    ICHECK_LE(kSessionPrefixBytes + header_len, file.size()) << path << " is truncated";
+    picojson::value header_value;
+    std::string err = picojson::parse(
+        header_value, std::string(file.data() + kSessionPrefixBytes, header_len));
+    ICHECK(err.empty() && header_value.is<picojson::object>())
+        << "Invalid session header in " << path << ": " << err;
+    picojson::object header = header_value.get<picojson::object>();
+    ICHECK(header["model_name"].is<std::string>() && header["conv_template"].is<std::string>());
+    ICHECK_EQ(header["model_name"].get<std::string>(), model_name_)
+        << "The session is saved by another model";
+    ICHECK_EQ(header["conv_template"].get<std::string>(), conversation_.conv_template)
+        << "The session is saved with another conversation template";
+    ICHECK(header["num_heads"].is<int64_t>() && header["head_dim"].is<int64_t>());
+    ICHECK(header["num_heads"].get<int64_t>() == kv_num_heads_ &&
+           header["head_dim"].get<int64_t>() == kv_head_dim_)
+        << "The session KV cache does not match the model";
+    ICHECK(header["total_seq_len"].is<int64_t>() && header["num_caches"].is<int64_t>() &&
+           header["cache_nbytes"].is<int64_t>() && header["data_offset"].is<int64_t>() &&
+           header["dtype"].is<std::string>());
+    int64_t total_seq_len = header["total_seq_len"].get<int64_t>();
+    int64_t num_caches = header["num_caches"].get<int64_t>();
+    int64_t cache_nbytes = header["cache_nbytes"].get<int64_t>();
+    int64_t data_offset = header["data_offset"].get<int64_t>();
+    ICHECK(total_seq_len >= 0 && num_caches >= 0 && cache_nbytes >= 0 && data_offset >= 0)
+        << "Invalid session header in " << path;
+    ICHECK_LE(total_seq_len, max_window_size_) << "The session exceeds the window size";
+    ICHECK(total_seq_len == 0 || num_caches == static_cast<int64_t>(kv_cache_.size()))
+        << "The session KV cache does not match the model";
+    DLDataType dtype = String2DLDataType(header["dtype"].get<std::string>());
+    ICHECK(total_seq_len == 0 || DataType(dtype) == DataType(kv_dtype_))
+        << "The session KV cache has dtype " << header["dtype"].get<std::string>()
+        << ", but the model caches " << DLDataType2String(kv_dtype_);
+    // divide instead of multiplying, so that a forged size cannot overflow
+    int64_t data_bytes = static_cast<int64_t>(file.size()) - data_offset;
+    ICHECK(data_bytes >= 0 && (num_caches == 0 || cache_nbytes <= data_bytes / num_caches))
+        << path << " is truncated";
+
+    std::vector<std::vector<std::string>> messages;
+    ICHECK(header["messages"].is<picojson::array>());
+    for (const picojson::value& message : header["messages"].get<picojson::array>()) {
+      ICHECK(message.is<picojson::array>());
+      std::vector<std::string> fields;
+      for (const picojson::value& field : message.get<picojson::array>()) {
+        ICHECK(field.is<std::string>());
+        fields.push_back(field.get<std::string>());
+      }
+      messages.push_back(std::move(fields));
+    }
+    std::vector<int64_t> message_kv_pos;
+    ICHECK(header["message_kv_pos"].is<picojson::array>());
+    for (const picojson::value& pos : header["message_kv_pos"].get<picojson::array>()) {
+      ICHECK(pos.is<int64_t>());
+      ICHECK(pos.get<int64_t>() >= -1 && pos.get<int64_t>() <= total_seq_len)
+          << "Invalid message position in " << path;
+      message_kv_pos.push_back(pos.get<int64_t>());
+    }
+    ICHECK_EQ(message_kv_pos.size(), messages.size()) << "Invalid session header in " << path;
+    std::vector<int32_t> kv_token_ids;
+    ICHECK(header["kv_token_ids"].is<picojson::array>());
+    for (const picojson::value& token : header["kv_token_ids"].get<picojson::array>()) {
+      ICHECK(token.is<int64_t>());
+      kv_token_ids.push_back(static_cast<int32_t>(token.get<int64_t>()));
+    }
+    ICHECK_EQ(static_cast<int64_t>(kv_token_ids.size()), total_seq_len)
+        << "Invalid session header in " << path;
+    ICHECK(header["add_bos"].is<bool>() && header["system_kv_len"].is<int64_t>());
+    int64_t system_kv_len = header["system_kv_len"].get<int64_t>();
+    ICHECK(system_kv_len >= 0 && system_kv_len <= total_seq_len)
+        << "Invalid session header in " << path;
+
+    // Everything is checked before the chat is reset, except what needs the device.
+    this->ResetChat();
+    if (total_seq_len > 0) {
+      NDArray rows =
+          NDArray::Empty({total_seq_len, kv_num_heads_, kv_head_dim_}, dtype, device_);
+      ICHECK_EQ(GetDataSize(*rows.operator->()), cache_nbytes)
+          << "The session KV cache does not match the model";
+      ICHECK(this->ReserveKVCache(total_seq_len))
+          << "The KV cache pool has no room for the session";
+      const PackedFunc* fappend = this->GetKVCacheFunc("append");
+      for (int64_t i = 0; i < num_caches; ++i) {
+        // the append copies the rows out before the next upload on the same stream
+        rows.CopyFromBytes(file.data() + data_offset + i * cache_nbytes, cache_nbytes);
+        (*fappend)(kv_cache_[i], rows);
+      }
+      this->SyncComputeStream();
+    }
+    conversation_.messages = std::move(messages);
+    total_seq_len_ = total_seq_len;
+    add_bos_ = header["add_bos"].get<bool>();
+    system_kv_len_ = system_kv_len;
+    message_kv_pos_ = std::move(message_kv_pos);
+    kv_token_ids_ = std::move(kv_token_ids);
+    output_ids_.clear();
+    output_message_.clear();
+    detok_prefix_offset_ = detok_read_offset_ = 0;
+    message_delta_pos_ = 0;
+    encounter_stop_str_ = false;
   }
 
   std::vector<int32_t> GetPromptTokens() {
@@ -567,14 +1099,14 @@ class LLMChat {
     if (this->add_bos_) {
       tokens.insert(tokens.begin(), bos_token_id_);
     }
-    auto first_prompt_tokens = this->tokenizer_->Encode(prompts[0]);
+    auto first_prompt_tokens = this->EncodePrompt(prompts, 0);
     tokens.insert(tokens.end(), first_prompt_tokens.begin(), first_prompt_tokens.end());
     int ctx_length = tokens.size();
     std::list<std::vector<int32_t>> context;
 
     bool need_shift_window = false;
     for (int i = prompts.size() - 1; i > 0; i--) {
-      auto encoded = this->tokenizer_->Encode((this->add_prefix_space_ ? " " : "") + prompts[i]);
+      auto encoded = this->EncodePrompt(prompts, i);
       ctx_length += encoded.size();
       if (this->total_seq_len_ + ctx_length + this->mean_gen_len_ >= this->max_window_size_) {
         need_shift_window = true;
@@ -583,50 +1115,243 @@ class LLMChat {
       context.push_front(encoded);
     }
     if (!need_shift_window) {
-      for (const auto& ctx : context) {
-        tokens.insert(tokens.end(), ctx.begin(), ctx.end());
+      bool is_full_prompt = prompts.size() == this->conversation_.messages.size() + 1;
+      if (is_full_prompt) {
+        this->system_kv_len_ = this->total_seq_len_ + tokens.size();
+      }
+      this->AppendContext(prompts, 1, context, &tokens);
+      if (is_full_prompt) {
+        this->ReuseSystemPrefix(&tokens);
       }
       return tokens;
     }
+    if (this->CanRetainKVCache(prompts)) {
+      return this->ShiftWindowRetainKVCache(prompts);
+    }
     // need shift window and re-encode
     this->total_seq_len_ = 0;
     this->ClearKVCache();
+    this->message_kv_pos_.assign(this->conversation_.messages.size(), -1);
     context.clear();
     tokens.clear();
     if (this->add_bos_) {
       tokens.insert(tokens.begin(), bos_token_id_);
     }
     auto all_prompts = this->conversation_.GetPromptArray();
-    first_prompt_tokens = this->tokenizer_->Encode(all_prompts[0]);
+    first_prompt_tokens = this->EncodePrompt(all_prompts, 0);
     tokens.insert(tokens.end(), first_prompt_tokens.begin(), first_prompt_tokens.end());
+    this->system_kv_len_ = tokens.size();
     ctx_length = tokens.size();
+    int first_segment = all_prompts.size();
     for (int i = all_prompts.size() - 1; i > 0; i--) {
-      auto encoded = this->tokenizer_->Encode(all_prompts[i]);
+      auto encoded = this->EncodePrompt(all_prompts, i);
       ctx_length += encoded.size();
       if (ctx_length >= this->shift_fill_factor_ * this->max_window_size_ &&
           i + 2 < all_prompts.size()) {
         break;
       }
       context.push_front(encoded);
+      first_segment = i;
     }
-    for (const auto& ctx : context) {
-      tokens.insert(tokens.end(), ctx.begin(), ctx.end());
-    }
+    this->AppendContext(all_prompts, first_segment, context, &tokens);
     if (tokens.size() + this->mean_gen_len_ >= this->max_window_size_) {
       LOG(FATAL) << "Exceed max window length curr=" << tokens.size();
     }
+    this->ReuseSystemPrefix(&tokens);
+    return tokens;
+  }
+
+  /*!
+   * \brief Append the encoded prompt segments to tokens, and record the KV cache position
+   *  where each of their messages starts.
+   * \param prompts The result of GetPromptArray or GetPromptArrayUnprocessed.
+   * \param first_segment The index in prompts of the first segment in context.
+   * \param context The encoded segments, in order.
+   * \param tokens The prompt tokens to append to.
+   */
+  void AppendContext(const std::vector<std::string>& prompts, size_t first_segment,
+                     const std::list<std::vector<int32_t>>& context,
+                     std::vector<int32_t>* tokens) {
+    size_t num_messages = this->conversation_.messages.size();
+    this->message_kv_pos_.resize(num_messages, -1);
+    size_t i = first_segment;
+    for (const auto& ctx : context) {
+      // the i-th segment of prompts holds the message counted (prompts.size() - i) from the end
+      this->message_kv_pos_[num_messages - (prompts.size() - i)] =
+          this->total_seq_len_ + tokens->size();
+      tokens->insert(tokens->end(), ctx.begin(), ctx.end());
+      ++i;
+    }
+  }
+
+  /*!
+   * \brief Start an empty KV cache from the shared system prefix cache when it holds the
+   *  leading bos and system prompt tokens of the prompt, and drop them from the prompt.
+   *  Otherwise the prefix is captured into the shared cache once the prompt is prefilled.
+   * \param tokens The prompt tokens, starting with the system_kv_len_ prefix tokens.
+   */
+  void ReuseSystemPrefix(std::vector<int32_t>* tokens) {
+    if (!this->use_system_prefix_cache_ || this->system_prefix_cache_ == nullptr ||
+        this->kv_num_heads_ == 0 || this->total_seq_len_ != 0 ||
+        static_cast<int64_t>(tokens->size()) <= this->system_kv_len_) {
+      return;
+    }
+    // the prefix is prefilled with the prompt once the engine reserves pages for it
+    if (kv_cache_pool_.defined() &&
+        kv_cache_pool_->NumFreePages() < kv_cache_pool_->NumPagesFor(this->system_kv_len_)) {
+      return;
+    }
+    std::vector<int32_t> prefix(tokens->begin(), tokens->begin() + this->system_kv_len_);
+    if (this->system_prefix_cache_->tokens != prefix) {
+      this->pending_system_prefix_ = prefix;
+      return;
+    }
+    const PackedFunc* fappend = this->GetKVCacheFunc("append");
+    for (size_t i = 0; i < kv_cache_.size(); ++i) {
+      (*fappend)(kv_cache_[i], this->system_prefix_cache_->rows[i]);
+    }
+    this->total_seq_len_ = this->system_kv_len_;
+    this->kv_token_ids_ = prefix;
+    tokens->erase(tokens->begin(), tokens->begin() + this->system_kv_len_);
+  }
+
+  /*! \brief Copy the KV cache rows of the pending system prefix into the shared cache. */
+  void CaptureSystemPrefix() {
+    int64_t prefix_len = this->pending_system_prefix_.size();
+    const PackedFunc* fview = this->GetKVCacheFunc("view");
+    SystemPrefixKVCache prefix_cache;
+    for (size_t i = 0; i < kv_cache_.size(); ++i) {
+      NDArray view =
+          (*fview)(kv_cache_[i], ShapeTuple({total_seq_len_, kv_num_heads_, kv_head_dim_}));
+      NDArray rows = NDArray::Empty({prefix_len, kv_num_heads_, kv_head_dim_}, view->dtype,
+                                    device_);
+      CopyKVCacheRows(view, 0, rows, 0, prefix_len);
+      prefix_cache.rows.push_back(rows);
+    }
+    prefix_cache.tokens = std::move(this->pending_system_prefix_);
+    this->pending_system_prefix_.clear();
+    *this->system_prefix_cache_ = std::move(prefix_cache);
+  }
+
+  /*! \return Whether the window can shift by dropping old turns from the KV cache. */
+  bool CanRetainKVCache(const std::vector<std::string>& prompts) {
+    // The first prompt of a conversation has no cached history to keep.
+    return this->shift_retain_kv_ && this->kv_cache_rotate_func_ != nullptr &&
+           this->kv_num_heads_ > 0 && this->system_kv_len_ > 0 &&
+           prompts.size() < this->conversation_.messages.size() + 1;
+  }
+
+  /*!
+   * \brief Shift the window by dropping the oldest turns from the KV cache, while keeping the
+   *  system prompt and the recent turns cached, so that only the new prompt is prefilled.
+   * \param prompts The result of GetPromptArrayUnprocessed.
+   * \return The tokens of the new prompt.
+   */
+  std::vector<int32_t> ShiftWindowRetainKVCache(const std::vector<std::string>& prompts) {
+    size_t num_messages = this->conversation_.messages.size();
+    this->message_kv_pos_.resize(num_messages, -1);
+    std::vector<int32_t> sep_tokens = this->EncodePrompt(prompts, 0);
+    std::list<std::vector<int32_t>> context;
+    int64_t new_length = sep_tokens.size();
+    for (size_t i = 1; i < prompts.size(); ++i) {
+      context.push_back(this->EncodePrompt(prompts, i));
+      new_length += context.back().size();
+    }
+    // Keep the turns from the earliest user message after which the context fits in the
+    // shift fill factor. The last two messages are the new prompt, not yet in the cache.
+    size_t num_cached_messages = num_messages - 2;
+    size_t first_kept = num_cached_messages;
+    for (size_t m = 2; m < num_cached_messages; m += 2) {
+      if (this->message_kv_pos_[m] < 0) continue;
+      int64_t kept_length =
+          this->system_kv_len_ + this->total_seq_len_ - this->message_kv_pos_[m] + new_length;
+      if (kept_length < this->shift_fill_factor_ * this->max_window_size_) {
+        first_kept = m;
+        break;
+      }
+    }
+    std::vector<int32_t> tokens;
+    int64_t erase_end = this->total_seq_len_;
+    if (first_kept < num_cached_messages) {
+      erase_end = this->message_kv_pos_[first_kept];
+      // the separator closes the last cached message
+      tokens = sep_tokens;
+    }
+    int64_t delta = erase_end - this->system_kv_len_;
+    if (this->total_seq_len_ - delta + new_length + this->mean_gen_len_ >= this->max_window_size_) {
+      LOG(FATAL) << "Exceed max window length curr=" << this->total_seq_len_ - delta + new_length;
+    }
+    this->EraseKVCache(this->system_kv_len_, erase_end);
+    this->total_seq_len_ -= delta;
+    for (size_t m = 0; m < num_cached_messages; ++m) {
+      if (m < first_kept) {
+        this->message_kv_pos_[m] = -1;
+      } else if (this->message_kv_pos_[m] >= 0) {
+        this->message_kv_pos_[m] -= delta;
+      }
+    }
+    this->AppendContext(prompts, 1, context, &tokens);
     return tokens;
   }
 
+  /*!
+   * \brief Tokenize the i-th segment of the prompts through the conversation token cache.
+   *  The segments after the first one get the prefix space of the model, so a segment has
+   *  the same tokens whichever prompt array it comes from.
+   * \param prompts The result of GetPromptArray or GetPromptArrayUnprocessed.
+   * \param i The index of the segment in prompts.
+   */
+  std::vector<int32_t> EncodePrompt(const std::vector<std::string>& prompts, size_t i) {
+    std::string text = (i > 0 && this->add_prefix_space_ ? " " : "") + prompts[i];
+    // Both prompt arrays end with the latest message, so the index of a segment in
+    // GetPromptArray is counted from the end. GetPromptArrayUnprocessed holds the last
+    // two messages, optionally after a separator which does not appear in GetPromptArray.
+    size_t num_full_prompts = this->conversation_.messages.size() + 1;
+    bool is_separator = prompts.size() < num_full_prompts && prompts.size() > 2 && i == 0;
+    if (is_separator || prompts.size() > num_full_prompts) {
+      return this->tokenizer_->Encode(text);
+    }
+    size_t index = num_full_prompts - (prompts.size() - i);
+    return this->conversation_.EncodePromptCached(
+        index, text, [this](const std::string& text) { return this->tokenizer_->Encode(text); });
+  }
+
   // get statically allocated input token
   NDArray GetInputTokenNDArray(const std::vector<int32_t>& token_ids) {
+    return this->GetInputTokenNDArray(token_ids.data(), token_ids.size());
+  }
+
+  NDArray GetInputTokenNDArray(const int32_t* token_ids, int64_t num_tokens) {
+    PhaseScope scope(&runtime_stats_, "h2d_copy");
     if (!input_token_ids_.defined()) {
       input_token_ids_ = NDArray::Empty({1, max_window_size_}, DataType::Int(32), device_);
+      input_token_host_ = PinnedHostArray({2 * max_window_size_}, DataType::Int(32), device_);
+      input_host_offset_ = 0;
+    }
+    ICHECK_LE(num_tokens, input_token_ids_->shape[1]) << "Input tokens exceed window size";
+    // The copy of a previous call may still read the host buffer, so each call writes after the
+    // previous one and the buffer is reused from the start once the stream is drained.
+    const NDArray& host = input_token_host_.cpu();
+    if (input_host_offset_ + num_tokens > host->shape[0]) {
+      this->SyncComputeStream();
+      input_host_offset_ = 0;
+    }
+    std::copy(token_ids, token_ids + num_tokens,
+              static_cast<int32_t*>(host->data) + input_host_offset_);
+    // decode steps all take one token, so they reuse the view of the previous step
+    if (!input_token_view_.defined() || input_token_view_->shape[1] != num_tokens) {
+      input_token_view_ = input_token_ids_.CreateView(ShapeTuple({1, num_tokens}),
+                                                      input_token_ids_->dtype);
     }
-    ICHECK_LE(token_ids.size(), input_token_ids_->shape[1]) << "Input tokens exceed window size";
-    NDArray view = input_token_ids_.CreateView(
-        ShapeTuple({1, static_cast<int64_t>(token_ids.size())}), input_token_ids_->dtype);
-    view.CopyFromBytes(token_ids.data(), token_ids.size() * sizeof(int32_t));
+    const NDArray& view = input_token_view_;
+    int64_t shape[2] = {1, num_tokens};
+    DLTensor from = *host.operator->();
+    from.ndim = 2;
+    from.shape = shape;
+    from.byte_offset = input_host_offset_ * sizeof(int32_t);
+    DLTensor to = *view.operator->();
+    NDArray::CopyFromTo(&from, &to, this->ComputeStream());
+    input_host_offset_ += num_tokens;
     return view;
   }
 
@@ -639,38 +1364,103 @@ class LLMChat {
    * \brief Generate the next token given a prompt.
    */
   void EncodeStep(std::string inp) {
+    this->BeginPrefill(inp);
+    while (!this->PrefillChunk(prefill_chunk_size_)) {
+    }
+  }
+
+  /*!
+   * \brief Add the prompt to the conversation and tokenize it, to be prefilled by PrefillChunk.
+   * \param inp The user input.
+   */
+  void BeginPrefill(std::string inp) {
     if (reset_stats_per_encode_) {
       this->ResetRuntimeStats();
     }
     output_ids_.clear();
+    // the decode steps append to these without growing them
+    output_ids_.reserve(max_window_size_);
+    kv_token_ids_.reserve(max_window_size_);
     output_message_.clear();
+    detok_prefix_offset_ = detok_read_offset_ = 0;
+    message_delta_pos_ = 0;
     encounter_stop_str_ = false;
 
     conversation_.AppendMessage(conversation_.roles[0], inp);
     conversation_.AppendMessage(conversation_.roles[1]);
 
-    auto prompt_tokens = this->GetPromptTokens();
+    std::vector<int32_t> prompt_tokens;
+    {
+      PhaseScope scope(&runtime_stats_, "tokenize");
+      prompt_tokens = this->GetPromptTokens();
+    }
     int64_t token_len = static_cast<int64_t>(prompt_tokens.size());
+    cur_pos_ = token_len;
+    start_pos_ = token_len;
+    grammar_state_ = 0;
+    prefill_tokens_ = std::move(prompt_tokens);
+    prefill_offset_ = 0;
+  }
 
-    auto input_data = this->GetInputTokenNDArray(prompt_tokens);
+  /*! \return Whether the prompt given to BeginPrefill is not fully prefilled yet. */
+  bool InPrefill() const { return prefill_offset_ < prefill_tokens_.size(); }
 
+  /*!
+   * \brief Prefill the next chunk of the prompt given to BeginPrefill, and sample the first
+   *  token after the last chunk. Splitting a long prompt bounds the activation memory of the
+   *  prefill, and lets the engine decode other sequences between the chunks.
+   * \param max_tokens The maximum number of tokens in the chunk, all remaining tokens if it is
+   *  not positive.
+   * \return Whether the prompt is fully prefilled.
+   */
+  bool PrefillChunk(int64_t max_tokens) {
+    AllocationScope allocs(&runtime_stats_, "prefill_allocs");
+    int64_t num_remaining = prefill_tokens_.size() - prefill_offset_;
+    int64_t token_len = max_tokens > 0 ? std::min(num_remaining, max_tokens) : num_remaining;
+    const int32_t* chunk = prefill_tokens_.data() + prefill_offset_;
+    prefill_offset_ += token_len;
+    bool is_last_chunk = prefill_offset_ == prefill_tokens_.size();
+
+    auto input_data = this->GetInputTokenNDArray(chunk, token_len);
     total_seq_len_ += token_len;
-    cur_pos_ = token_len;
-    start_pos_ = token_len;
+    kv_token_ids_.insert(kv_token_ids_.end(), chunk, chunk + token_len);
 
     auto tstart = std::chrono::high_resolution_clock::now();
-    if (temperature_ < 1e-6f) {
+    if (!is_last_chunk) {
+      // only the logits of the last token are used
+      this->Forward(input_data, total_seq_len_);
+      this->SyncComputeStream();
+      auto tend = std::chrono::high_resolution_clock::now();
+      this->encode_total_time += static_cast<double>((tend - tstart).count()) / 1e9;
+      this->encode_total_tokens += token_len;
+      runtime_stats_.Record("prefill", tstart, tend);
+      runtime_stats_.Count("prefill_tokens", token_len);
+      return false;
+    }
+    prefill_tokens_.clear();
+    prefill_offset_ = 0;
+    NDArray token_on_device{nullptr};
+    if (this->UseDeviceSampling()) {
+      token_on_device = this->SampleOnDevice(this->Forward(input_data, total_seq_len_));
+    } else if (this->UseLogitsOnCPU()) {
       this->UpdateLogitsOrProbOnCPU(this->Forward(input_data, total_seq_len_));
     } else {
       this->UpdateLogitsOrProbOnCPU(
           this->Softmax(this->Forward(input_data, total_seq_len_), temperature_));
     }
-    TVMSynchronize(device_.device_type, device_.device_id, nullptr);
+    this->SyncComputeStream();
     auto tend = std::chrono::high_resolution_clock::now();
+    if (!pending_system_prefix_.empty()) {
+      this->CaptureSystemPrefix();
+    }
 
     this->encode_total_time += static_cast<double>((tend - tstart).count()) / 1e9;
     this->encode_total_tokens += token_len;
-    if (temperature_ < 1e-6f) {
+    runtime_stats_.Record("prefill", tstart, tend);
+    runtime_stats_.Count("prefill_tokens", token_len);
+    if (token_on_device.defined()) {
+      next_token_ = this->TokenToCPU(token_on_device);
+    } else if (this->UseLogitsOnCPU()) {
       next_token_ = this->SampleFromLogitsOnCPU();
     } else {
       next_token_ = this->SampleFromProbOnCPU();
@@ -678,76 +1468,380 @@ class LLMChat {
     if (model_name_.find("vicuna") == 0) {
       add_bos_ = false;
     }
+    return true;
   }
 
   void DecodeStep() {
+    // the acceptance test of the draft tokens only models temperature and top-p
+    if (draft_ != nullptr && !this->UseHostOnlySampling()) {
+      this->SpeculativeDecodeStep();
+      return;
+    }
+    this->LaunchDecodeStep();
+    this->FinishDecodeStep();
+  }
+
+  /*!
+   * \brief Enqueue the forward pass of a decode step without waiting for its result,
+   *  and update the output message while the device runs it.
+   * \note Every call must be followed by FinishDecodeStep, which samples the next token.
+   */
+  void LaunchDecodeStep() {
+    AllocationScope allocs(&runtime_stats_, "decode_allocs");
     output_ids_.push_back(next_token_);
-    output_message_ = RemoveStopStr(tokenizer_->Decode(output_ids_));
 
-    auto input_data = GetInputTokenNDArray({next_token_});
+    auto input_data = this->GetInputTokenNDArray(&next_token_, 1);
 
     total_seq_len_ += 1;
+    kv_token_ids_.push_back(next_token_);
     cur_pos_ += 1;
 
-    auto tstart = std::chrono::high_resolution_clock::now();
-    if (temperature_ < 1e-6f) {
-      this->UpdateLogitsOrProbOnCPU(this->Forward(input_data, total_seq_len_));
+    decode_tstart_ = std::chrono::high_resolution_clock::now();
+    if (this->UseDeviceSampling()) {
+      pending_logits_or_prob_ = this->SampleOnDevice(this->Forward(input_data, total_seq_len_));
+    } else if (this->UseLogitsOnCPU()) {
+      pending_logits_or_prob_ = this->Forward(input_data, total_seq_len_);
     } else {
-      this->UpdateLogitsOrProbOnCPU(
-          this->Softmax(this->Forward(input_data, total_seq_len_), temperature_));
+      pending_logits_or_prob_ =
+          this->Softmax(this->Forward(input_data, total_seq_len_), temperature_);
+    }
+    // Kernel launches are asynchronous, so detokenization overlaps with the forward pass
+    // instead of delaying it. This holds only while nothing above synchronizes the stream:
+    // the input copy goes through the pinned buffer, and DeviceSamplingParams copies the
+    // temperature and top_p (a synchronizing CopyFromBytes) only when they change.
+    this->UpdateOutputMessage();
+  }
+
+  /*!
+   * \brief Advance the sequence by its next token in a decode step of LLMEngine that runs the
+   *  forward passes of all sequences in one call, and update the output message meanwhile.
+   * \note Every call must be followed by FinishBatchedDecodeStep with the logits of the step.
+   */
+  void BeginBatchedDecodeStep() {
+    output_ids_.push_back(next_token_);
+    total_seq_len_ += 1;
+    kv_token_ids_.push_back(next_token_);
+    cur_pos_ += 1;
+    decode_tstart_ = std::chrono::high_resolution_clock::now();
+    this->UpdateOutputMessage();
+  }
+
+  /*!
+   * \brief Sample the next token of a batched decode step on the host.
+   * \param logits The logits of the sequence in the batch, which are modified.
+   * \param vocab_size The number of logits.
+   */
+  void FinishBatchedDecodeStep(float* logits, int64_t vocab_size) {
+    auto tsample_start = std::chrono::high_resolution_clock::now();
+    next_token_ = this->SampleFromHostLogits(logits, vocab_size);
+    auto tend = std::chrono::high_resolution_clock::now();
+    this->decode_total_time += static_cast<double>((tend - decode_tstart_).count()) / 1e9;
+    this->sample_total_time += static_cast<double>((tend - tsample_start).count()) / 1e9;
+    this->decode_total_tokens += 1;
+    runtime_stats_.Record("decode", decode_tstart_, tend);
+    runtime_stats_.Record("sample", tsample_start, tend);
+    runtime_stats_.Count("decode_tokens", 1);
+  }
+
+  /*!
+   * \brief Wait for the forward pass enqueued by LaunchDecodeStep and sample the next token.
+   */
+  void FinishDecodeStep() {
+    AllocationScope allocs(&runtime_stats_, "decode_allocs");
+    ICHECK(pending_logits_or_prob_.defined()) << "LaunchDecodeStep is not called";
+    NDArray token_on_device{nullptr};
+    if (this->UseDeviceSampling()) {
+      token_on_device = pending_logits_or_prob_;
+    } else {
+      this->UpdateLogitsOrProbOnCPU(pending_logits_or_prob_);
     }
-    TVMSynchronize(device_.device_type, device_.device_id, nullptr);
+    pending_logits_or_prob_ = NDArray(nullptr);
+    this->SyncComputeStream();
     auto tsample_start = std::chrono::high_resolution_clock::now();
-    if (temperature_ < 1e-6f) {
+    if (token_on_device.defined()) {
+      next_token_ = this->TokenToCPU(token_on_device);
+    } else if (this->UseLogitsOnCPU()) {
       next_token_ = this->SampleFromLogitsOnCPU();
     } else {
       next_token_ = this->SampleFromProbOnCPU();
     }
     auto tend = std::chrono::high_resolution_clock::now();
 
-    this->decode_total_time += static_cast<double>((tend - tstart).count()) / 1e9;
+    this->decode_total_time += static_cast<double>((tend - decode_tstart_).count()) / 1e9;
     this->sample_total_time += static_cast<double>((tend - tsample_start).count()) / 1e9;
     this->decode_total_tokens += 1;
+    runtime_stats_.Record("decode", decode_tstart_, tend);
+    runtime_stats_.Record("sample", tsample_start, tend);
+    runtime_stats_.Count("decode_tokens", 1);
   }
 
-  bool Stopped() {
-    if (std::any_of(stop_tokens_.begin(), stop_tokens_.end(),
-                    [this](int32_t token) { return token == next_token_; })) {
-      return true;
+  /*!
+   * \brief Load a draft model which shares the tokenizer of this model, and decode with
+   *  speculative decoding from now on.
+   * \param executable The model library of the draft model.
+   * \param model_path The model path of the draft model.
+   * \param num_draft_tokens The number of tokens the draft model proposes in a decode step.
+   */
+  void LoadDraftModel(tvm::runtime::Module executable, String model_path,
+                      int64_t num_draft_tokens) {
+    ICHECK(verification_func_ != nullptr)
+        << "The model does not support verification, please rebuild it to use a draft model";
+    ICHECK_GT(kv_num_heads_, 0) << "Speculative decoding needs the KV cache in the metadata";
+    ICHECK_GT(num_draft_tokens, 0) << "The draft model must propose at least one token";
+    std::shared_ptr<LLMChat> draft = std::make_shared<LLMChat>(device_);
+    draft->Reload(executable, model_path);
+    ICHECK_GT(draft->kv_num_heads_, 0) << "The draft model needs the KV cache in the metadata";
+    if (!kv_cache_pool_.defined() || !draft->kv_cache_pool_.defined()) {
+      LOG(WARNING) << "Dropping rejected tokens copies the whole attention KV cache, build the "
+                      "models with --use-paged-kv-cache to drop them in place";
     }
-    return encounter_stop_str_ || total_seq_len_ >= max_window_size_;
+    draft_ = std::move(draft);
+    num_draft_tokens_ = num_draft_tokens;
   }
 
-  size_t FindEffectiveUTF8Pos(const std::string& s, size_t start_pos) {
-    int pos = s.size() - 1;
-    for (; pos >= 0; pos--) {
-      if ((s[pos] & 0x80) == 0x00) {
-        return pos + 1;
-      } else if (pos - 1 >= 0 && (s[pos - 1] & 0xE0) == 0xC0 && (s[pos] & 0xC0) == 0x80) {
-        return pos + 1;
-      } else if (pos - 2 >= 0 && (s[pos - 2] & 0xF0) == 0xE0 && (s[pos - 1] & 0xC0) == 0x80 &&
-                 (s[pos] & 0xC0) == 0x80) {
-        return pos + 1;
-      } else if (pos - 3 >= 0 && (s[pos - 3] & 0xF8) == 0xF0 && (s[pos - 2] & 0xC0) == 0x80 &&
-                 (s[pos - 1] & 0xC0) == 0x80 && (s[pos] & 0xC0) == 0x80) {
-        return pos + 1;
+  /*! \brief Unload the draft model and decode one token per step again. */
+  void UnloadDraftModel() { draft_ = nullptr; }
+
+  /*!
+   * \brief Decode with speculative decoding. The draft model proposes tokens one by one, the
+   *  model verifies them all in one forward, and the longest accepted run is kept, followed
+   *  by a token sampled from the model.
+   *
+   * A proposal x drawn from the draft distribution q is accepted with probability
+   * min(1, p(x) / q(x)), where p is the distribution of the model, and on rejection the token
+   * is drawn from max(0, p - q) normalized. Both distributions are taken after temperature,
+   * top-k and top-p as HostSampler computes them, so the output follows the distribution of
+   * decoding with the model alone.
+   */
+  void SpeculativeDecodeStep() {
+    int64_t window = std::min(max_window_size_, draft_->max_window_size_);
+    int64_t num_draft = std::min(num_draft_tokens_, window - total_seq_len_ - 1);
+    if (num_draft <= 0) {
+      this->LaunchDecodeStep();
+      this->FinishDecodeStep();
+      return;
+    }
+    auto tstart = std::chrono::high_resolution_clock::now();
+    // Step 1. Bring the draft KV cache to the tokens in the KV cache, then propose.
+    this->SyncDraftKVCache();
+    auto tdraft = std::chrono::high_resolution_clock::now();
+    std::vector<int32_t> tokens = {next_token_};
+    int64_t vocab_size = 0;
+    for (int64_t i = 0; i < num_draft; ++i) {
+      draft_->UpdateLogitsOrProbOnCPU(draft_->AppendTokens({tokens.back()}));
+      this->SyncComputeStream();
+      const NDArray& draft_logits = draft_->logits_on_cpu_;
+      vocab_size = draft_logits->shape[2];
+      spec_draft_probs_.resize(num_draft * vocab_size);
+      float* q = spec_draft_probs_.data() + i * vocab_size;
+      this->ComputeSampleProbs(static_cast<const float*>(draft_logits->data), vocab_size, q);
+      tokens.push_back(this->SampleFromProbs(q, vocab_size));
+    }
+
+    runtime_stats_.Record("draft", tdraft, std::chrono::high_resolution_clock::now());
+
+    // Step 2. Verify the proposals in one forward.
+    output_ids_.push_back(next_token_);
+    int64_t past_len = total_seq_len_;
+    NDArray input_data = this->GetInputTokenNDArray(tokens);
+    total_seq_len_ += tokens.size();
+    kv_token_ids_.insert(kv_token_ids_.end(), tokens.begin(), tokens.end());
+    Array<ObjectRef> ret =
+        verification_func_(input_data, ShapeTuple({total_seq_len_}), kv_cache_, params_);
+    NDArray logits = Downcast<NDArray>(ret[0]);
+    this->UpdateOutputMessage();
+    ICHECK_EQ(logits->shape[2], vocab_size)
+        << "The draft model must share the vocabulary of the model";
+    if (!spec_logits_host_.defined() || spec_logits_host_.cpu()->shape[1] < logits->shape[1]) {
+      spec_logits_host_ = PinnedHostArray({1, num_draft_tokens_ + 1, vocab_size},
+                                          logits->dtype, device_);
+    }
+    DLTensor logits_to = *spec_logits_host_.cpu().operator->();
+    logits_to.shape = logits->shape;
+    NDArray::CopyFromTo(logits.operator->(), &logits_to, this->ComputeStream());
+    this->SyncComputeStream();
+    const float* target_logits = static_cast<const float*>(logits_to.data);
+
+    // Step 3. Accept the proposals in order, and sample the token after the accepted run.
+    spec_target_probs_.resize(vocab_size);
+    float* p = spec_target_probs_.data();
+    int64_t num_kept = num_draft + 1;
+    int32_t new_token = -1;
+    for (int64_t i = 0; i < num_draft; ++i) {
+      const float* q = spec_draft_probs_.data() + i * vocab_size;
+      int32_t token = tokens[i + 1];
+      this->ComputeSampleProbs(target_logits + i * vocab_size, vocab_size, p);
+      if (GetRandomNumber() * q[token] >= p[token]) {
+        for (int64_t j = 0; j < vocab_size; ++j) {
+          p[j] = std::max(p[j] - q[j], 0.0f);
+        }
+        num_kept = i + 1;
+        new_token = this->SampleFromProbs(p, vocab_size);
+        break;
+      }
+      // the tokens after an accepted stop token are never generated
+      if (std::find(stop_tokens_.begin(), stop_tokens_.end(), token) != stop_tokens_.end()) {
+        num_kept = i + 1;
+        new_token = token;
+        break;
       }
     }
-    return pos + 1;
+    if (new_token < 0) {
+      this->ComputeSampleProbs(target_logits + num_draft * vocab_size, vocab_size, p);
+      new_token = this->SampleFromProbs(p, vocab_size);
+    }
+
+    // Step 4. Drop the rows of the tokens after the accepted run.
+    this->TruncateKVCache(past_len + num_kept);
+    output_ids_.insert(output_ids_.end(), tokens.begin() + 1, tokens.begin() + num_kept);
+    cur_pos_ += num_kept;
+    next_token_ = new_token;
+    auto tend = std::chrono::high_resolution_clock::now();
+
+    this->decode_total_time += static_cast<double>((tend - tstart).count()) / 1e9;
+    this->decode_total_tokens += num_kept;
+    this->spec_draft_tokens += num_draft;
+    this->spec_accepted_tokens += num_kept - 1;
+    runtime_stats_.Record("decode", tstart, tend);
+    runtime_stats_.Count("decode_tokens", num_kept);
+    runtime_stats_.Count("draft_tokens", num_draft);
+    runtime_stats_.Count("accepted_draft_tokens", num_kept - 1);
   }
 
-  std::string GetMessage() {
-    // remove non-utf8 characters
-    std::string cropped_message =
-        output_message_.substr(0, FindEffectiveUTF8Pos(output_message_, 0));
-    return cropped_message;
+  /*!
+   * \brief Make the draft KV cache hold the tokens in the KV cache, keeping the rows of their
+   *  common prefix and prefilling the rest.
+   */
+  void SyncDraftKVCache() {
+    ICHECK_EQ(kv_token_ids_.size(), total_seq_len_);
+    const std::vector<int32_t>& draft_tokens = draft_->kv_token_ids_;
+    size_t num_common = 0;
+    while (num_common < draft_tokens.size() && num_common < kv_token_ids_.size() &&
+           draft_tokens[num_common] == kv_token_ids_[num_common]) {
+      ++num_common;
+    }
+    draft_->TruncateKVCache(num_common);
+    if (num_common < kv_token_ids_.size()) {
+      draft_->AppendTokens(
+          std::vector<int32_t>(kv_token_ids_.begin() + num_common, kv_token_ids_.end()));
+    }
   }
 
-  // do some quick evaluation of the tokenizer
-  void TryTokenizer() {
-    std::string input = "The capital of Canada is";
-    std::vector<int32_t> ids = tokenizer_->Encode(input);
-    std::ostringstream os;
+  /*!
+   * \brief Run the tokens through the model after the KV cache.
+   * \return The logits of the last token.
+   */
+  NDArray AppendTokens(const std::vector<int32_t>& tokens) {
+    NDArray input_data = this->GetInputTokenNDArray(tokens);
+    total_seq_len_ += tokens.size();
+    kv_token_ids_.insert(kv_token_ids_.end(), tokens.begin(), tokens.end());
+    return this->Forward(input_data, total_seq_len_);
+  }
+
+  /*! \brief Keep the first num_rows rows of the KV cache. */
+  void TruncateKVCache(int64_t num_rows) {
+    if (num_rows == total_seq_len_) return;
+    if (num_rows == 0) {
+      this->ClearKVCache();
+    } else {
+      this->EraseKVCache(num_rows, total_seq_len_);
+    }
+    total_seq_len_ = num_rows;
+  }
+
+  /*!
+   * \brief Compute the distribution sampling draws from, after temperature, top-k and top-p,
+   *  from the logits of one position. Greedy decoding puts all the mass on the argmax.
+   */
+  void ComputeSampleProbs(const float* logits, int64_t vocab_size, float* probs) {
+    host_sampler_.ComputeProbs(logits, vocab_size, temperature_, top_k_, top_p_, probs);
+  }
+
+  /*! \brief Sample a token from an unnormalized distribution. */
+  int32_t SampleFromProbs(const float* probs, int64_t vocab_size) {
+    return host_sampler_.SampleFromProbs(probs, vocab_size, 0, 1.0f, GetRandomNumber());
+  }
+
+  bool Stopped() const { return this->StoppedAtStop() || this->StoppedAtLength(); }
+
+  /*! \return Whether the generation ended at a stop token or a stop string. */
+  bool StoppedAtStop() const {
+    return encounter_stop_str_ ||
+           std::any_of(stop_tokens_.begin(), stop_tokens_.end(),
+                       [this](int32_t token) { return token == next_token_; });
+  }
+
+  /*! \return Whether the generation ended at the window or at seq_len_limit_. */
+  bool StoppedAtLength() const {
+    return total_seq_len_ >= max_window_size_ ||
+           (seq_len_limit_ > 0 && total_seq_len_ >= seq_len_limit_);
+  }
+
+  size_t FindEffectiveUTF8Pos(const std::string& s, size_t start_pos) {
+    int pos = s.size() - 1;
+    for (; pos >= 0; pos--) {
+      if ((s[pos] & 0x80) == 0x00) {
+        return pos + 1;
+      } else if (pos - 1 >= 0 && (s[pos - 1] & 0xE0) == 0xC0 && (s[pos] & 0xC0) == 0x80) {
+        return pos + 1;
+      } else if (pos - 2 >= 0 && (s[pos - 2] & 0xF0) == 0xE0 && (s[pos - 1] & 0xC0) == 0x80 &&
+                 (s[pos] & 0xC0) == 0x80) {
+        return pos + 1;
+      } else if (pos - 3 >= 0 && (s[pos - 3] & 0xF8) == 0xF0 && (s[pos - 2] & 0xC0) == 0x80 &&
+                 (s[pos - 1] & 0xC0) == 0x80 && (s[pos] & 0xC0) == 0x80) {
+        return pos + 1;
+      }
+    }
+    return pos + 1;
+  }
+
+  std::string GetMessage() {
+    if (this->Stopped()) this->UpdateOutputMessage(/*flush=*/true);
+    // remove non-utf8 characters
+    std::string cropped_message =
+        output_message_.substr(0, FindEffectiveUTF8Pos(output_message_, 0));
+    return cropped_message;
+  }
+
+  /*!
+   * \brief Get the output text finalized since the previous call in the same generation.
+   *
+   * The tail of the message that may turn out to be the beginning of the stop string is
+   * held back until the following tokens tell, or until the generation stops.
+   * \return The newly finalized UTF-8 text.
+   */
+  std::string GetMessageDelta() {
+    bool stopped = this->Stopped();
+    if (stopped) this->UpdateOutputMessage(/*flush=*/true);
+    size_t end = output_message_.size();
+    if (!stopped) {
+      // hold back the longest tail that begins a stop string
+      size_t held = 0;
+      this->ForEachStopStr([&](const std::string& stop_str) {
+        for (size_t n = std::min(stop_str.size() - 1, end - message_delta_pos_); n > held; --n) {
+          if (output_message_.compare(end - n, n, stop_str, 0, n) == 0) {
+            held = n;
+            break;
+          }
+        }
+      });
+      end -= held;
+      // do not split a UTF-8 character
+      while (end > message_delta_pos_ && (output_message_[end] & 0xC0) == 0x80) {
+        --end;
+      }
+    }
+    if (end <= message_delta_pos_) return "";
+    std::string delta = output_message_.substr(message_delta_pos_, end - message_delta_pos_);
+    message_delta_pos_ = end;
+    return delta;
+  }
+
+  // do some quick evaluation of the tokenizer
+  void TryTokenizer() {
+    std::string input = "The capital of Canada is";
+    std::vector<int32_t> ids = tokenizer_->Encode(input);
+    std::ostringstream os;
 
     for (size_t i = 0; i < ids.size(); ++i) {
       if (i != 0) os << ", ";
@@ -781,11 +1875,11 @@ class LLMChat {
     // start recording
     auto encoding_start = std::chrono::high_resolution_clock::now();
     this->Forward(input_data, token_len);
-    TVMSynchronize(device_.device_type, device_.device_id, nullptr);
+    this->SyncComputeStream();
 
     auto decoding_start = std::chrono::high_resolution_clock::now();
     this->UpdateLogitsOrProbOnCPU(this->Forward(first_sample_token, token_len + 1));
-    TVMSynchronize(device_.device_type, device_.device_id, nullptr);
+    this->SyncComputeStream();
     auto decoding_end = std::chrono::high_resolution_clock::now();
 
     // print first few logits for eyeballs
@@ -803,6 +1897,134 @@ class LLMChat {
               << "decoding-time=" << decoding_ms << "ms.";
   }
 
+  /*!
+   * \brief Benchmark prefill and decode over a sweep of prompt lengths, generation lengths
+   *  and batch sizes, on synthetic prompts and without stopping at stop tokens.
+   *
+   * The config is a JSON object with the optional lists "prompt_lens" (default [16, 128,
+   * 512]), "gen_lens" (default [32, 128]) and "batch_sizes" (default [1]), and the optional
+   * counts "warmup" (default 1) and "repeat" (default 3). The sequences of a batch run on
+   * chats forked from this chat and prefill one after another as in LLMEngine, so the time to
+   * first token of a sequence includes the prefills before it. A paged KV cache pool is
+   * resized to a window per sequence of the batch, which resets the conversation of this chat
+   * when the size changes.
+   * \param config_json The benchmark config.
+   * \return A JSON object with one result per setting, which holds the summaries of the time
+   *  to first token and the inter-token latency in milliseconds, and the throughputs.
+   */
+  std::string Benchmark(const std::string& config_json) {
+    picojson::value config_value;
+    std::string err = picojson::parse(config_value, config_json.empty() ? "{}" : config_json);
+    ICHECK(err.empty() && config_value.is<picojson::object>())
+        << "The benchmark config must be a JSON object: " << err;
+    auto config = config_value.get<picojson::object>();
+    auto get_list = [&](const std::string& key, std::vector<int64_t> value) {
+      if (config.count(key)) {
+        ICHECK(config[key].is<picojson::array>()) << key << " must be a list of integers";
+        value.clear();
+        for (const picojson::value& v : config[key].get<picojson::array>()) {
+          ICHECK(v.is<int64_t>() && v.get<int64_t>() > 0) << key << " must be positive";
+          value.push_back(v.get<int64_t>());
+        }
+      }
+      return value;
+    };
+    auto get_count = [&](const std::string& key, int64_t value) {
+      if (config.count(key)) {
+        ICHECK(config[key].is<int64_t>()) << key << " must be an integer";
+        value = config[key].get<int64_t>();
+      }
+      return value;
+    };
+    std::vector<int64_t> prompt_lens = get_list("prompt_lens", {16, 128, 512});
+    std::vector<int64_t> gen_lens = get_list("gen_lens", {32, 128});
+    std::vector<int64_t> batch_sizes = get_list("batch_sizes", {1});
+    int64_t warmup = get_count("warmup", 1);
+    int64_t repeat = get_count("repeat", 3);
+    ICHECK_GT(repeat, 0) << "repeat must be positive";
+
+    using Clock = std::chrono::high_resolution_clock;
+    auto elapsed_ms = [](Clock::time_point begin, Clock::time_point end) {
+      return static_cast<double>((end - begin).count()) / 1e6;
+    };
+    picojson::array results;
+    int64_t num_sequences = kv_cache_num_sequences_;
+    for (int64_t batch_size : batch_sizes) {
+      // the forks take their pages from the pool of this chat
+      this->ResizeKVCachePool(batch_size);
+      std::vector<std::unique_ptr<LLMChat>> seqs;
+      for (int64_t b = 0; b < batch_size; ++b) {
+        seqs.push_back(this->Fork());
+      }
+      for (int64_t prompt_len : prompt_lens) {
+        for (int64_t gen_len : gen_lens) {
+          if (prompt_len + gen_len > max_window_size_) {
+            LOG(WARNING) << "Skip prompt length " << prompt_len << " with generation length "
+                         << gen_len << ", which exceed the window size " << max_window_size_;
+            continue;
+          }
+          std::vector<int32_t> prompt(prompt_len);
+          for (int64_t i = 0; i < prompt_len; ++i) {
+            prompt[i] = static_cast<int32_t>(100 + i % 1000);
+          }
+          std::vector<double> ttft, itl;
+          double prefill_ms = 0, decode_ms = 0;
+          std::vector<int32_t> tokens(batch_size);
+          std::vector<NDArray> pending(batch_size);
+          for (int64_t r = 0; r < warmup + repeat; ++r) {
+            bool record = r >= warmup;
+            for (auto& seq : seqs) {
+              seq->ClearKVCache();
+              seq->total_seq_len_ = 0;
+              ICHECK(seq->ReserveKVCache(prompt_len + gen_len))
+                  << "The KV cache pool cannot hold " << batch_size << " sequences of "
+                  << prompt_len + gen_len << " tokens";
+            }
+            auto tstart = Clock::now();
+            for (int64_t b = 0; b < batch_size; ++b) {
+              tokens[b] = seqs[b]->SampleToken(seqs[b]->LaunchSampleToken(
+                  seqs[b]->AppendTokens(prompt)));
+              if (record) ttft.push_back(elapsed_ms(tstart, Clock::now()));
+            }
+            auto tdecode = Clock::now();
+            if (record) prefill_ms += elapsed_ms(tstart, tdecode);
+            for (int64_t step = 1; step < gen_len; ++step) {
+              auto tstep = Clock::now();
+              for (int64_t b = 0; b < batch_size; ++b) {
+                pending[b] = seqs[b]->LaunchSampleToken(seqs[b]->AppendTokens({tokens[b]}));
+              }
+              for (int64_t b = 0; b < batch_size; ++b) {
+                tokens[b] = seqs[b]->SampleToken(pending[b]);
+              }
+              if (record) itl.push_back(elapsed_ms(tstep, Clock::now()));
+            }
+            if (record) decode_ms += elapsed_ms(tdecode, Clock::now());
+          }
+          picojson::object result;
+          result["prompt_len"] = picojson::value(prompt_len);
+          result["gen_len"] = picojson::value(gen_len);
+          result["batch_size"] = picojson::value(batch_size);
+          result["ttft_ms"] = picojson::value(SummarizeLatencies(ttft));
+          result["itl_ms"] = picojson::value(SummarizeLatencies(itl));
+          result["prefill_tok_s"] =
+              picojson::value(repeat * batch_size * prompt_len / (prefill_ms / 1e3));
+          result["decode_tok_s"] = picojson::value(
+              decode_ms > 0 ? repeat * batch_size * (gen_len - 1) / (decode_ms / 1e3) : 0.0);
+          results.push_back(picojson::value(result));
+        }
+      }
+    }
+    this->ResizeKVCachePool(num_sequences);
+    picojson::object report;
+    report["model"] = picojson::value(model_name_);
+    report["device"] = picojson::value(std::string(DeviceName(device_.device_type)) + ":" +
+                                       std::to_string(device_.device_id));
+    report["warmup"] = picojson::value(warmup);
+    report["repeat"] = picojson::value(repeat);
+    report["results"] = picojson::value(results);
+    return picojson::value(report).serialize(true);
+  }
+
  private:
   int CountSubstr(const std::string& str, const std::string& sub) {
     if (sub.length() == 0) return 0;
@@ -818,33 +2040,346 @@ class LLMChat {
   NDArray Forward(NDArray inputs, int64_t cur_pos) {
     Array<ObjectRef> ret;
     if (inputs->shape[1] > 1) {
-      ret = encoding_func_(inputs, ShapeTuple({cur_pos}), kv_cache_, params_);
+      ret = encoding_func_(inputs, PositionShape(cur_pos), kv_cache_, params_);
     } else {
-      ret = decoding_func_(inputs, ShapeTuple({cur_pos}), kv_cache_, params_);
+      ret = decoding_func_(inputs, PositionShape(cur_pos), kv_cache_, params_);
     }
     return Downcast<NDArray>(ret[0]);
   }
 
+  /*!
+   * \brief Get the shape of a position to pass to a function of the vm. The shapes are created
+   *  once per position and never modified, so the decode steps after the first conversation
+   *  that reaches a position do not allocate one.
+   * \param pos The position.
+   */
+  ShapeTuple PositionShape(int64_t pos) {
+    if (pos >= static_cast<int64_t>(pos_shapes_.size())) {
+      pos_shapes_.resize(std::max<int64_t>(pos + 1, max_window_size_));
+    }
+    if (!pos_shapes_[pos].defined()) pos_shapes_[pos] = ShapeTuple({pos});
+    return pos_shapes_[pos];
+  }
+
   NDArray Softmax(NDArray input, float temperature) {
-    NDArray temperature_arr = NDArray::Empty({}, DataType::Float(32), device_);
-    temperature_arr.CopyFromBytes(&temperature, sizeof(float));
-    NDArray ret;
-    ret = softmax_func_(input, temperature_arr);
-    return ret;
+    PhaseScope scope(&runtime_stats_, "softmax");
+    return softmax_func_(input, this->GetSamplingParams()->Temperature(temperature));
+  }
+
+  /*! \return Whether to sample with the sample_top_p function of the model. */
+  bool UseDeviceSampling() const {
+    return sample_on_device_ && sample_top_p_func_ != nullptr && !this->UseHostOnlySampling();
+  }
+
+  /*! \return Whether sampling uses options that only HostSampler supports. */
+  bool UseHostOnlySampling() const {
+    return !grammar_regex_.empty() || top_k_ > 0 || repetition_penalty_ != 1.0;
+  }
+
+  /*! \return Whether to sample from the logits on the host instead of the probabilities. */
+  bool UseLogitsOnCPU() const {
+    return temperature_ < 1e-6f || !grammar_regex_.empty() || repetition_penalty_ != 1.0;
+  }
+
+  /*!
+   * \brief Constrain the replies from the next prompt on to match a regex, see RegexDFA for the
+   *  syntax, or remove the constraint if the regex is empty.
+   */
+  void SetRegexConstraint(const std::string& regex) {
+    grammar_ = nullptr;
+    grammar_regex_ = regex;
+    if (regex.empty()) return;
+    std::lock_guard<std::mutex> lock(grammar_cache_->mutex);
+    auto it = grammar_cache_->grammars.find(regex);
+    if (it != grammar_cache_->grammars.end()) {
+      grammar_ = it->second;
+    } else if (!grammar_cache_->token_texts.empty()) {
+      grammar_ = std::make_shared<TokenGrammar>(RegexDFA(regex), grammar_cache_->token_texts,
+                                                stop_tokens_);
+      grammar_cache_->grammars.emplace(regex, grammar_);
+    } else {
+      // report syntax errors now, the grammar is built once the vocabulary size is known
+      RegexDFA dfa(regex);
+    }
+  }
+
+  /*!
+   * \brief Get the grammar of the regex constraint, computing the token texts of the model on
+   *  the first use, since the vocabulary size is only known from the logits.
+   */
+  const TokenGrammar* GetGrammar(int64_t vocab_size) {
+    if (grammar_ != nullptr && grammar_->vocab_size() == vocab_size) return grammar_.get();
+    std::lock_guard<std::mutex> lock(grammar_cache_->mutex);
+    std::vector<std::string>& token_texts = grammar_cache_->token_texts;
+    if (static_cast<int64_t>(token_texts.size()) != vocab_size) {
+      // Decode each token after an anchor token, so the leading space of a token is kept.
+      std::vector<int32_t> anchor = tokenizer_->Encode("a");
+      ICHECK(!anchor.empty());
+      std::string anchor_text = tokenizer_->Decode({anchor.back()});
+      token_texts.assign(vocab_size, "");
+      for (int64_t token = 0; token < vocab_size; ++token) {
+        std::string text = tokenizer_->Decode({anchor.back(), static_cast<int32_t>(token)});
+        token_texts[token] = text.compare(0, anchor_text.size(), anchor_text) == 0
+                                 ? text.substr(anchor_text.size())
+                                 : tokenizer_->Decode({static_cast<int32_t>(token)});
+      }
+      // the fallback tokens of bytes that are not characters on their own decode to U+FFFD
+      MapByteFallbackTokens(&token_texts);
+      grammar_cache_->grammars.clear();
+    }
+    std::shared_ptr<const TokenGrammar>& grammar = grammar_cache_->grammars[grammar_regex_];
+    if (grammar == nullptr) {
+      grammar = std::make_shared<TokenGrammar>(RegexDFA(grammar_regex_), token_texts,
+                                               stop_tokens_);
+    }
+    grammar_ = grammar;
+    return grammar_.get();
+  }
+
+  /*!
+   * \brief Enqueue sampling the next token from the logits on device.
+   * \param logits The logits of the last position.
+   * \return The sampled token of shape (1,) on device, read by TokenToCPU.
+   */
+  NDArray SampleOnDevice(NDArray logits) {
+    // greedy decoding keeps the tokens whose probability reaches the max
+    float temperature = temperature_ < 1e-6f ? 1.0f : temperature_;
+    float top_p = temperature_ < 1e-6f ? 0.0f : top_p_;
+    DeviceSamplingParams* params = this->GetSamplingParams();
+    int64_t seed = static_cast<int64_t>(GetRandomNumber() * 2147483647.0);
+    // a new seed every step, so its shape is the one allocation of device sampling
+    return sample_top_p_func_(logits, params->Temperature(temperature), params->TopP(top_p),
+                              ShapeTuple({seed}));
+  }
+
+  /*! \brief Get the sampling parameter block, created here for chats from the legacy init. */
+  DeviceSamplingParams* GetSamplingParams() {
+    if (sampling_params_ == nullptr) {
+      sampling_params_ = std::make_shared<DeviceSamplingParams>(device_);
+    }
+    return sampling_params_.get();
+  }
+
+  /*! \brief Copy a token sampled by SampleOnDevice to the host. */
+  int32_t TokenToCPU(NDArray token) {
+    int32_t token_id;
+    token.CopyToBytes(&token_id, sizeof(int32_t));
+    return token_id;
+  }
+
+  /*!
+   * \brief Enqueue sampling from the logits of a forward, on device when it is supported.
+   * \return The pending result to pass to SampleToken.
+   */
+  NDArray LaunchSampleToken(NDArray logits) {
+    return this->UseDeviceSampling() ? this->SampleOnDevice(logits) : logits;
+  }
+
+  /*! \brief Wait for the result of LaunchSampleToken and get the sampled token. */
+  int32_t SampleToken(NDArray pending) {
+    if (this->UseDeviceSampling()) return this->TokenToCPU(pending);
+    this->UpdateLogitsOrProbOnCPU(pending);
+    this->SyncComputeStream();
+    return this->SampleFromLogitsOnCPU();
   }
 
   void UpdateLogitsOrProbOnCPU(NDArray logits_or_prob) {
-    if (!logits_on_cpu_.defined()) {
-      logits_on_cpu_ = logits_or_prob.CopyTo(DLDevice{kDLCPU, 0});
+    PhaseScope scope(&runtime_stats_, "logits_copy");
+    if (!logits_host_.defined()) {
+      logits_host_ = PinnedHostArray(logits_or_prob.Shape(), logits_or_prob->dtype, device_);
+      logits_on_cpu_ = logits_host_.cpu();
     } else {
       ICHECK_EQ(logits_on_cpu_->shape[0], logits_or_prob->shape[0])
           << "Expect size of logits remain unchanged";
-      logits_on_cpu_.CopyFrom(logits_or_prob);
     }
+    // the copy is asynchronous on a compute stream, readers synchronize it first
+    DLTensor to = *logits_on_cpu_.operator->();
+    NDArray::CopyFromTo(logits_or_prob.operator->(), &to, this->ComputeStream());
+  }
+
+  /*!
+   * \return The stream kernels are launched on, whose copies run in order with them. It is the
+   *  default stream unless the embedder sets another one.
+   */
+  TVMStreamHandle ComputeStream() const {
+    return DeviceAPI::Get(device_)->GetCurrentStream(device_);
+  }
+
+  /*! \brief Wait for the kernels and copies on the compute stream. */
+  void SyncComputeStream() { DeviceAPI::Get(device_)->StreamSync(device_, this->ComputeStream()); }
+
+  /*!
+   * \brief Read the KV cache shape from the metadata, and create the paged KV cache pool if
+   *  the model is built with the paged KV cache.
+   * \param metadata The model metadata.
+   * \param config The chat config, which optionally sets "kv_cache_page_size" and
+   *  "kv_cache_num_pages".
+   */
+  void InitKVCachePool(picojson::object metadata, picojson::object config) {
+    kv_cache_pool_ = PagedKVCachePool(nullptr);
+    kv_num_heads_ = kv_head_dim_ = 0;
+    if (!metadata.count("kv_cache")) return;
+    ICHECK(metadata["kv_cache"].is<picojson::object>());
+    auto kv_cache_info = metadata["kv_cache"].get<picojson::object>();
+    ICHECK(kv_cache_info["num_layers"].is<int64_t>());
+    ICHECK(kv_cache_info["num_heads"].is<int64_t>());
+    ICHECK(kv_cache_info["head_dim"].is<int64_t>());
+    kv_num_heads_ = kv_cache_info["num_heads"].get<int64_t>();
+    kv_head_dim_ = kv_cache_info["head_dim"].get<int64_t>();
+    if (kv_cache_info["dtype"].is<std::string>()) {
+      kv_dtype_ = String2DLDataType(kv_cache_info["dtype"].get<std::string>());
+    }
+    if (!kv_cache_info["paged"].is<bool>() || !kv_cache_info["paged"].get<bool>()) return;
+    ICHECK(kv_cache_info["dtype"].is<std::string>());
+    int64_t page_size = 16;
+    if (config.count("kv_cache_page_size")) {
+      ICHECK(config["kv_cache_page_size"].is<int64_t>());
+      page_size = config["kv_cache_page_size"].get<int64_t>();
+    }
+    // by default the pool holds one full window for each sequence that may run at once
+    int64_t num_pages = kv_cache_num_sequences_ * ((max_window_size_ + page_size - 1) / page_size);
+    kv_cache_num_pages_configured_ = config.count("kv_cache_num_pages");
+    if (kv_cache_num_pages_configured_) {
+      ICHECK(config["kv_cache_num_pages"].is<int64_t>());
+      num_pages = config["kv_cache_num_pages"].get<int64_t>();
+    }
+    kv_cache_pool_ = PagedKVCachePool(
+        kv_cache_info["num_layers"].get<int64_t>() * 2, num_pages, page_size, max_window_size_,
+        kv_num_heads_, kv_head_dim_, String2DLDataType(kv_cache_info["dtype"].get<std::string>()),
+        device_);
+  }
+
+  /*!
+   * \brief Size the default KV cache pool for num_sequences sequences running at once. The
+   *  pool is replaced, so no chat forked from this one may hold pages of the old pool. It is
+   *  kept when "kv_cache_num_pages" sets its size.
+   */
+  void ResizeKVCachePool(int64_t num_sequences) {
+    kv_cache_num_sequences_ = num_sequences;
+    if (!kv_cache_pool_.defined() || kv_cache_num_pages_configured_) return;
+    int64_t num_pages = num_sequences * kv_cache_pool_->NumPagesFor(max_window_size_);
+    if (num_pages == kv_cache_pool_->NumPages()) return;
+    bool has_kv_cache = !kv_cache_.empty();
+    this->ResetChat();
+    kv_cache_ = Array<ObjectRef>();
+    kv_cache_pool_ = kv_cache_pool_->CreateLike(num_pages);
+    if (has_kv_cache) {
+      kv_cache_ = this->CreateKVCache();
+    }
+  }
+
+  /*!
+   * \brief Reserve the KV cache pages of the first num_rows rows, so that the sequence does not
+   *  run out of pages in the middle of an engine step.
+   * \return Whether the pages are reserved, which is always true without the paged KV cache.
+   */
+  bool ReserveKVCache(int64_t num_rows) {
+    if (!kv_cache_pool_.defined()) return true;
+    PagedKVSequence seq = Downcast<PagedKVCache>(kv_cache_[0])->seq;
+    return kv_cache_pool_->TryReserve(seq.operator->(), num_rows);
+  }
+
+  /*! \return The length of the sequence once the prompt given to BeginPrefill is prefilled. */
+  int64_t PrefilledSeqLen() const {
+    return total_seq_len_ + static_cast<int64_t>(prefill_tokens_.size()) - prefill_offset_;
+  }
+
+  /*!
+   * \brief Estimate the device memory held by the chat, which is the params plus the KV cache.
+   *  A dense KV cache is counted at its full window, and is not counted if the metadata does
+   *  not describe it.
+   */
+  int64_t DeviceMemoryBytes() const {
+    int64_t nbytes = 0;
+    for (const NDArray& param : params_) {
+      nbytes += GetDataSize(*param.operator->());
+    }
+    if (kv_cache_pool_.defined()) {
+      nbytes += kv_cache_pool_->NumBytes();
+    } else {
+      nbytes += static_cast<int64_t>(kv_cache_.size()) * max_window_size_ * kv_num_heads_ *
+                kv_head_dim_ * ((kv_dtype_.bits * kv_dtype_.lanes + 7) / 8);
+    }
+    return nbytes;
+  }
+
+  /*!
+   * \brief Drop the rows [begin, end) of every KV cache, and move the rows after them forward.
+   *  The moved keys are rotated back by (end - begin) positions to match their new positions.
+   */
+  void EraseKVCache(int64_t begin, int64_t end) {
+    if (begin == end) return;
+    int64_t num_moved = total_seq_len_ - end;
+    ICHECK(kv_cache_rotate_func_ != nullptr || num_moved == 0)
+        << "The model does not support kv_cache_rotate";
+    const PackedFunc* fview = this->GetKVCacheFunc("view");
+    const PackedFunc* fappend = this->GetKVCacheFunc("append");
+    if (static_cast<int64_t>(kv_token_ids_.size()) == total_seq_len_) {
+      kv_token_ids_.erase(kv_token_ids_.begin() + begin, kv_token_ids_.begin() + end);
+    }
+    for (size_t i = 0; i < kv_cache_.size(); ++i) {
+      NDArray view =
+          (*fview)(kv_cache_[i], ShapeTuple({total_seq_len_, kv_num_heads_, kv_head_dim_}));
+      if (!kv_shift_buffer_.defined()) {
+        kv_shift_buffer_ = NDArray::Empty({max_window_size_, kv_num_heads_, kv_head_dim_},
+                                          view->dtype, device_);
+        kv_shift_moved_ = NDArray::Empty({max_window_size_, kv_num_heads_, kv_head_dim_},
+                                         view->dtype, device_);
+      }
+      // Gather the moved rows into an array of their own, as kernels ignore the byte offset.
+      NDArray moved = kv_shift_moved_.CreateView({num_moved, kv_num_heads_, kv_head_dim_},
+                                                 view->dtype);
+      CopyKVCacheRows(view, end, moved, 0, num_moved);
+      // the caches are ordered as [k0, v0, k1, v1, ...]
+      if (i % 2 == 0 && num_moved != 0) {
+        moved = kv_cache_rotate_func_(moved, ShapeTuple({end - begin}));
+      }
+      if (kv_cache_pool_.defined()) {
+        PagedKVCache cache = Downcast<PagedKVCache>(kv_cache_[i]);
+        kv_cache_pool_->Truncate(cache->seq.operator->(), cache->cache_index, begin);
+        (*fappend)(kv_cache_[i], moved);
+        continue;
+      }
+      // The view aliases the cache, so copy the kept rows out before clearing it.
+      NDArray kept = kv_shift_buffer_.CreateView(
+          {begin + num_moved, kv_num_heads_, kv_head_dim_}, view->dtype);
+      CopyKVCacheRows(view, 0, kept, 0, begin);
+      CopyKVCacheRows(moved, 0, kept, begin, num_moved);
+      const PackedFunc* fkv_clear =
+          tvm::runtime::Registry::Get("vm.builtin.attention_kv_cache_array_clear");
+      ICHECK(fkv_clear);
+      (*fkv_clear)(Array<ObjectRef>{kv_cache_[i]});
+      (*fappend)(kv_cache_[i], kept);
+    }
+  }
+
+  /*!
+   * \brief Get the KV cache function of the kind the model uses.
+   * \param name The name of the function, such as "view" or "append".
+   */
+  const PackedFunc* GetKVCacheFunc(const std::string& name) {
+    std::string prefix =
+        kv_cache_pool_.defined() ? "mlc.paged_kv_cache_" : "vm.builtin.attention_kv_cache_";
+    const PackedFunc* f = tvm::runtime::Registry::Get(prefix + name);
+    ICHECK(f) << "Cannot find env function " << prefix + name;
+    return f;
+  }
+
+  // Create kv cache
+  Array<ObjectRef> CreateKVCache() {
+    if (kv_cache_pool_.defined()) {
+      return kv_cache_pool_.CreateSequence();
+    }
+    return vm_->GetFunction("create_kv_cache")();
   }
 
   // Clear kv cache
   void ClearKVCache() {
+    kv_token_ids_.clear();
+    if (kv_cache_pool_.defined()) {
+      PagedKVCacheArrayClear(kv_cache_);
+      return;
+    }
     const PackedFunc* fkv_clear =
         tvm::runtime::Registry::Get("vm.builtin.attention_kv_cache_array_clear");
     ICHECK(fkv_clear);
@@ -858,38 +2393,125 @@ class LLMChat {
     return dis(gen);
   }
 
+  /*!
+   * \brief Sample from the logits on the host. The repetition penalty applies to the tokens of
+   *  the reply first. With a regex constraint, the tokens that break the constraint are masked
+   *  out, and the constraint advances by the sampled token.
+   */
   int32_t SampleFromLogitsOnCPU() {
     ICHECK(logits_on_cpu_.defined()) << "logits_on_cpu_ is not defined";
     ICHECK_EQ(logits_on_cpu_->ndim, 3) << "logits_on_cpu_ should be 3D";
     ICHECK_EQ(logits_on_cpu_->shape[0], 1) << "logits_on_cpu_ should be 1 batch";
-    return fsample_topp_from_logits_(logits_on_cpu_, top_p_, temperature_, GetRandomNumber());
+    int64_t vocab_size = logits_on_cpu_->shape[2];
+    float* logits =
+        static_cast<float*>(logits_on_cpu_->data) + (logits_on_cpu_->shape[1] - 1) * vocab_size;
+    return this->SampleFromHostLogits(logits, vocab_size);
+  }
+
+  /*! \brief Sample from logits on the host, which are modified by the penalty and the mask. */
+  int32_t SampleFromHostLogits(float* logits, int64_t vocab_size) {
+    host_sampler_.ApplyRepetitionPenalty(logits, vocab_size, output_ids_, repetition_penalty_);
+    const TokenGrammar* grammar = nullptr;
+    if (!grammar_regex_.empty()) {
+      PhaseScope scope(&runtime_stats_, "grammar_mask");
+      grammar = this->GetGrammar(vocab_size);
+      grammar->MaskLogits(grammar_state_, logits, vocab_size);
+    }
+    int32_t token = host_sampler_.SampleFromLogits(logits, vocab_size, temperature_, top_k_,
+                                                   top_p_, GetRandomNumber());
+    if (grammar != nullptr) {
+      grammar_state_ = grammar->Advance(grammar_state_, token);
+    }
+    return token;
   }
 
   int32_t SampleFromProbOnCPU() {
     ICHECK(logits_on_cpu_.defined()) << "logits_on_cpu_ is not defined";
     ICHECK_EQ(logits_on_cpu_->ndim, 3) << "logits_on_cpu_ should be 3D";
     ICHECK_EQ(logits_on_cpu_->shape[0], 1) << "logits_on_cpu_ should be 1 batch";
-    return fsample_topp_from_prob_(logits_on_cpu_, top_p_, GetRandomNumber());
+    int64_t vocab_size = logits_on_cpu_->shape[2];
+    const float* probs = static_cast<const float*>(logits_on_cpu_->data) +
+                         (logits_on_cpu_->shape[1] - 1) * vocab_size;
+    return host_sampler_.SampleFromProbs(probs, vocab_size, top_k_, top_p_, GetRandomNumber());
   }
 
-  std::string RemoveStopStr(std::string str) {
-    size_t pos = str.rfind(stop_str_);
+  /*!
+   * \brief Append the text of the tokens added to output_ids_ since the last call to
+   *  output_message_, and look for the stop string in the appended text.
+   *
+   * The new tokens are decoded together with the tokens of the previous update, since
+   * decoding them alone may drop the space before them. Text that ends with an incomplete
+   * UTF-8 character is held back until the following tokens complete it.
+   * \param flush Whether the generation has stopped, so that no token will complete the held
+   *  back text. It is then appended with the incomplete character replaced by U+FFFD.
+   */
+  void UpdateOutputMessage(bool flush = false) {
+    if (encounter_stop_str_) return;
+    if (flush && detok_read_offset_ == output_ids_.size()) return;
+    PhaseScope scope(&runtime_stats_, "detokenize");
+    // the id buffer keeps its capacity, the tokenizer returns new strings
+    detok_ids_.assign(output_ids_.begin() + detok_prefix_offset_,
+                      output_ids_.begin() + detok_read_offset_);
+    std::string prefix_text = tokenizer_->Decode(detok_ids_);
+    detok_ids_.insert(detok_ids_.end(), output_ids_.begin() + detok_read_offset_,
+                      output_ids_.end());
+    std::string new_text = tokenizer_->Decode(detok_ids_);
+    const std::string replacement_char = "\xEF\xBF\xBD";
+    if (new_text.size() <= prefix_text.size()) return;
+    size_t complete_size = FindEffectiveUTF8Pos(new_text, 0);
+    if (!flush &&
+        (complete_size != new_text.size() ||
+         new_text.compare(new_text.size() - std::min(new_text.size(), replacement_char.size()),
+                          replacement_char.size(), replacement_char) == 0)) {
+      return;
+    }
+    if (complete_size != new_text.size()) {
+      new_text.resize(std::max(complete_size, prefix_text.size()));
+      new_text += replacement_char;
+    }
+    // a stop string may start in the tail of the previous message
+    size_t max_stop_len = 0;
+    this->ForEachStopStr([&](const std::string& stop_str) {
+      max_stop_len = std::max(max_stop_len, stop_str.size());
+    });
+    size_t search_start = output_message_.size() - std::min(output_message_.size(), max_stop_len);
+    output_message_.append(new_text, prefix_text.size(), std::string::npos);
+    detok_prefix_offset_ = detok_read_offset_;
+    detok_read_offset_ = output_ids_.size();
+    size_t pos = std::string::npos;
+    this->ForEachStopStr([&](const std::string& stop_str) {
+      pos = std::min(pos, output_message_.find(stop_str, search_start));
+    });
     if (pos != std::string::npos) {
       encounter_stop_str_ = true;
-      str = str.substr(0, pos);
+      output_message_.resize(pos);
+    }
+  }
+
+  /*! \brief Call f with each nonempty stop string, that of the conversation first. */
+  template <typename F>
+  void ForEachStopStr(F f) const {
+    if (!stop_str_.empty()) f(stop_str_);
+    for (const std::string& stop_str : request_stop_strs_) {
+      if (!stop_str.empty()) f(stop_str);
     }
-    return str;
   }
 
   //----------------------------
   // Statistics
   //----------------------------
   bool reset_stats_per_encode_ = true;
+  // start time of the decode step in flight
+  std::chrono::high_resolution_clock::time_point decode_tstart_;
   double decode_total_time = 0;
   double sample_total_time = 0;
   double encode_total_time = 0;
   int64_t decode_total_tokens = 0;
   int64_t encode_total_tokens = 0;
+  int64_t spec_draft_tokens = 0;
+  int64_t spec_accepted_tokens = 0;
+  // per-phase timings and counters, and the optional trace of the phases
+  RuntimeStats runtime_stats_;
   //----------------------------
   // Conversation
   //----------------------------
@@ -901,26 +2523,81 @@ class LLMChat {
   int64_t total_seq_len_{0}, start_pos_{0}, cur_pos_{0}, skip_echo_len_{0};
   // max window size, mean generation length
   int64_t max_window_size_{768}, mean_gen_len_{128};
+  // the sequence length at which the generation stops before the window is full, if positive
+  int64_t seq_len_limit_{0};
   // shift window fill factor
   double shift_fill_factor_{0.3};
+  // whether to shift the window by dropping old turns from the KV cache instead of
+  // re-encoding the kept turns, used when the model provides kv_cache_rotate
+  bool shift_retain_kv_{true};
+  // the number of KV cache rows taken by the bos and the system prompt
+  int64_t system_kv_len_{0};
+  // the KV cache position where each message starts, -1 if the message is not in the cache
+  std::vector<int64_t> message_kv_pos_;
+  // whether new conversations start from the KV cache of the shared system prefix
+  bool use_system_prefix_cache_{true};
+  // the system prefix KV cache, shared by the chats forked from the same model
+  std::shared_ptr<SystemPrefixKVCache> system_prefix_cache_;
+  // the system prefix to capture after the prefill in flight, empty if none
+  std::vector<int32_t> pending_system_prefix_;
+  // the regex the replies must match, empty if they are not constrained
+  std::string grammar_regex_;
+  // the grammar of grammar_regex_ once it is built, and the state of the current reply in it
+  std::shared_ptr<const TokenGrammar> grammar_;
+  int32_t grammar_state_{0};
+  // the token texts and the grammars, shared by the chats forked from the same model
+  std::shared_ptr<GrammarCache> grammar_cache_;
+  // the maximum number of prompt tokens in one prefill forward, no limit if not positive
+  int64_t prefill_chunk_size_{512};
+  // the prompt being prefilled, and the number of its tokens prefilled so far
+  std::vector<int32_t> prefill_tokens_;
+  size_t prefill_offset_{0};
   // temperature
   double temperature_{0.8};
   // top_p
   double top_p_{0.95};
+  // the number of most likely tokens to sample from on the host, all tokens if not positive
+  int64_t top_k_{0};
+  // the penalty of the tokens already generated in the reply, 1 for no penalty
+  double repetition_penalty_{1.0};
+  // whether to sample on device when the model provides sample_top_p, instead of copying
+  // the logits to the host
+  bool sample_on_device_{true};
   // next_token
   int32_t next_token_{0};
   // output ids till now (refresh after encoding step)
   std::vector<int32_t> output_ids_;
   // output message till now (refresh after encoding step)
   std::string output_message_;
+  // output_ids_[detok_prefix_offset_:detok_read_offset_] are the tokens decoded by the
+  // previous update of output_message_
+  size_t detok_prefix_offset_{0}, detok_read_offset_{0};
+  // the tokens passed to the tokenizer by UpdateOutputMessage
+  std::vector<int32_t> detok_ids_;
+  // the length of output_message_ returned by GetMessageDelta so far
+  size_t message_delta_pos_{0};
   // whether to add bos as the first token
   bool add_bos_{true};
   // stop tokens
   std::vector<int32_t> stop_tokens_;
   // stop str
   std::string stop_str_;
+  // the stop strings of the LLMEngine request served by the chat, besides stop_str_
+  std::vector<std::string> request_stop_strs_;
   // Whether encounter stop str
   bool encounter_stop_str_{false};
+  // the tokens whose rows are in the KV cache, in order
+  std::vector<int32_t> kv_token_ids_;
+  //----------------------------
+  // Speculative decoding
+  //----------------------------
+  // the draft model that proposes tokens, nullptr when decoding without it
+  std::shared_ptr<LLMChat> draft_;
+  // the number of tokens the draft model proposes in a decode step
+  int64_t num_draft_tokens_{4};
+  // the draft distribution of each proposal, and the distribution of the model to check one
+  std::vector<float> spec_draft_probs_;
+  std::vector<float> spec_target_probs_;
   //----------------------------
   // Tokenizer
   //----------------------------
@@ -928,8 +2605,8 @@ class LLMChat {
   // If `add_prefix_space_` is set to `true`, a prefix space will be added to each non-leading
   // sentence. Otherwise, no prefix space will be added.
   bool add_prefix_space_{false};
-  // internal tokenizer
-  std::unique_ptr<Tokenizer> tokenizer_;
+  // internal tokenizer, shared by the chats forked from the same model
+  std::shared_ptr<Tokenizer> tokenizer_;
   // bos token
   int32_t bos_token_id_{1};
   // eos token id
@@ -945,24 +2622,154 @@ class LLMChat {
   PackedFunc encoding_func_;
   // decoding function
   PackedFunc decoding_func_;
+  // decodes one token of several sequences of the paged KV cache, undefined for other models
+  PackedFunc decoding_batch_func_;
   // encoding without cache
   PackedFunc encoding_without_cache_func_;
   // softmax
   PackedFunc softmax_func_;
   // get model metadata
   PackedFunc get_metadata_func_;
-  // sample top p from logits
-  PackedFunc fsample_topp_from_logits_;
-  // sample top p from prob
-  PackedFunc fsample_topp_from_prob_;
-  // input token id
+  // rotate cached keys back by a number of positions, undefined if the model does not support it
+  PackedFunc kv_cache_rotate_func_;
+  // sample the next token on device, undefined if the model does not support it
+  PackedFunc sample_top_p_func_;
+  // run several tokens and return the logits of all of them, undefined if the model does not
+  // support it
+  PackedFunc verification_func_;
+  // samples from the logits or probabilities on the host
+  HostSampler host_sampler_;
+  // input token id, and its view of the previous call of GetInputTokenNDArray
   NDArray input_token_ids_{nullptr};
+  NDArray input_token_view_{nullptr};
+  // the shape of each position passed to the vm, see PositionShape
+  std::vector<ShapeTuple> pos_shapes_;
   // local params
   Array<NDArray> params_;
   // KV cache
   Array<ObjectRef> kv_cache_;
+  // The pool of the paged KV cache, shared by the chats forked from the same model.
+  // Undefined when the model uses the attention kv cache of the vm.
+  PagedKVCachePool kv_cache_pool_{nullptr};
+  // The number of windows the pool holds by default, and whether the config sets its size.
+  int64_t kv_cache_num_sequences_{1};
+  bool kv_cache_num_pages_configured_{false};
   // Temp logits on cpu
   NDArray logits_on_cpu_{nullptr};
+  // Logits or prob of the decode step in flight, or its token when sampling on device
+  NDArray pending_logits_or_prob_{nullptr};
+  // The host buffers of the input tokens, and of the logits copied to logits_on_cpu_ and of
+  // the tokens verified by speculative decoding
+  PinnedHostArray input_token_host_, logits_host_, spec_logits_host_;
+  // The position in input_token_host_ to write the next input tokens at
+  int64_t input_host_offset_{0};
+  // The sampling parameters on device, shared by the chats forked from the same model
+  std::shared_ptr<DeviceSamplingParams> sampling_params_;
+  // The number of heads and head dimension of the KV cache, 0 if not given by the metadata
+  int64_t kv_num_heads_{0}, kv_head_dim_{0};
+  // The data type of the KV cache
+  DLDataType kv_dtype_{kDLFloat, 16, 1};
+  // Scratch buffers to move KV cache rows when the window shifts
+  NDArray kv_shift_buffer_{nullptr};
+  NDArray kv_shift_moved_{nullptr};
+};
+
+/*!
+ * \brief Serves chat sessions that share one loaded model to callers on any thread.
+ *
+ * The sessions are forked from the chat the server is created with, so they share its vm,
+ * params and tokenizer and own their conversations and KV caches. All work on the sessions
+ * runs on one worker thread, which takes tasks from a lock-free queue in submission order,
+ * so callers never contend on the device or on each other.
+ */
+class ChatSessionServer {
+ public:
+  explicit ChatSessionServer(LLMChat& chat) : vm_(chat.vm_) {
+    // the prototype is only used to fork sessions on the worker
+    prototype_ = chat.Fork();
+    prototype_->kv_cache_ = Array<ObjectRef>();
+    worker_ = std::thread([this]() { this->RunWorker(); });
+  }
+
+  ~ChatSessionServer() {
+    // an empty task stops the worker after the tasks submitted before it
+    tasks_.Push(std::function<void()>());
+    worker_.join();
+  }
+
+  /*! \return Whether the sessions are forked from a chat of the given vm. */
+  bool Serves(const Module& vm) const { return vm_.same_as(vm); }
+
+  /*!
+   * \brief Run f on the worker thread, and wait for its result. An error raised by f is
+   *  raised again on the calling thread.
+   */
+  template <typename F>
+  auto Run(F f) -> decltype(f()) {
+    using R = decltype(f());
+    auto task = std::make_shared<std::packaged_task<R()>>(std::move(f));
+    std::future<R> result = task->get_future();
+    tasks_.Push([task]() { (*task)(); });
+    return result.get();
+  }
+
+  /*!
+   * \brief Run f with the chat of a session on the worker thread, and wait for its result.
+   * \param session_id The id returned by CreateSession.
+   */
+  template <typename F>
+  auto RunSession(int64_t session_id, F f) -> decltype(f(std::declval<LLMChat*>())) {
+    return this->Run([this, session_id, f]() { return f(this->GetSession(session_id)); });
+  }
+
+  /*! \return The id of a new session with an empty conversation. */
+  int64_t CreateSession() {
+    int64_t session_id = next_session_id_.fetch_add(1);
+    this->Run([this, session_id]() { sessions_[session_id] = prototype_->Fork(); });
+    return session_id;
+  }
+
+  /*! \brief Remove a session and free its KV cache. */
+  void RemoveSession(int64_t session_id) {
+    this->Run([this, session_id]() {
+      ICHECK(sessions_.erase(session_id)) << "Unknown session id " << session_id;
+    });
+  }
+
+  /*! \return The number of sessions. */
+  int64_t NumSessions() {
+    return this->Run([this]() { return static_cast<int64_t>(sessions_.size()); });
+  }
+
+ private:
+  void RunWorker() {
+    while (true) {
+      std::function<void()> task = tasks_.Pop();
+      if (!task) break;
+      task();
+    }
+    // the sessions use the device, free them on the worker as well
+    sessions_.clear();
+    prototype_ = nullptr;
+  }
+
+  // Only called on the worker.
+  LLMChat* GetSession(int64_t session_id) {
+    auto it = sessions_.find(session_id);
+    ICHECK(it != sessions_.end()) << "Unknown session id " << session_id;
+    return it->second.get();
+  }
+
+  // The vm of the chat the sessions are forked from.
+  Module vm_;
+  // The chat to fork sessions from, and the sessions, only used on the worker.
+  std::unique_ptr<LLMChat> prototype_ = nullptr;
+  std::unordered_map<int64_t, std::unique_ptr<LLMChat>> sessions_;
+  // The id of the next session.
+  std::atomic<int64_t> next_session_id_{0};
+  // The tasks submitted to the worker, an empty task stops it.
+  MPSCQueue<std::function<void()>> tasks_;
+  std::thread worker_;
 };
 
 class LLMChatModule : public ModuleNode {
@@ -972,58 +2779,267 @@ class LLMChatModule : public ModuleNode {
     if (name == "reload") {
       return PackedFunc([this, sptr_to_self](TVMArgs args, TVMRetValue* rv) {
         ICHECK_EQ(args.size(), 2);
-        chat_ = nullptr;
+        std::lock_guard<std::mutex> lock(session_server_mutex_);
+        this->DiscardPendingChat();
+        this->ReleaseChat(std::move(chat_));
+        model_id_ = "";
         chat_ = std::make_unique<LLMChat>(LLMChat(device_));
-        (*fclear_ndarray_cache_)();
         chat_->Reload(args[0], args[1]);
       });
+    } else if (name == "load_model") {
+      return PackedFunc([this, sptr_to_self](TVMArgs args, TVMRetValue* rv) {
+        ICHECK_EQ(args.size(), 3);
+        std::lock_guard<std::mutex> lock(session_server_mutex_);
+        LoadModel(args[0], args[1], args[2]);
+      });
+    } else if (name == "select_model") {
+      return PackedFunc([this, sptr_to_self](TVMArgs args, TVMRetValue* rv) {
+        ICHECK_EQ(args.size(), 1);
+        std::lock_guard<std::mutex> lock(session_server_mutex_);
+        SelectModel(args[0]);
+      });
+    } else if (name == "unload_model") {
+      return PackedFunc([this, sptr_to_self](TVMArgs args, TVMRetValue* rv) {
+        ICHECK_EQ(args.size(), 1);
+        std::lock_guard<std::mutex> lock(session_server_mutex_);
+        std::string model_id = args[0];
+        ICHECK(model_id != model_id_) << "Cannot unload the selected model " << model_id;
+        auto it = FindResidentChat(model_id);
+        if (it == resident_chats_.end()) return;
+        this->ReleaseChat(std::move(it->second));
+        resident_chats_.erase(it);
+      });
+    } else if (name == "has_model") {
+      return PackedFunc([this, sptr_to_self](TVMArgs args, TVMRetValue* rv) {
+        ICHECK_EQ(args.size(), 1);
+        std::lock_guard<std::mutex> lock(session_server_mutex_);
+        std::string model_id = args[0];
+        bool selected = chat_ != nullptr && model_id == model_id_;
+        *rv = selected || FindResidentChat(model_id) != resident_chats_.end();
+      });
+    } else if (name == "resident_models") {
+      return PackedFunc([this, sptr_to_self](TVMArgs args, TVMRetValue* rv) {
+        std::lock_guard<std::mutex> lock(session_server_mutex_);
+        picojson::array model_ids;
+        if (chat_ != nullptr) model_ids.push_back(picojson::value(model_id_));
+        for (const auto& entry : resident_chats_) {
+          model_ids.push_back(picojson::value(entry.first));
+        }
+        *rv = picojson::value(model_ids).serialize();
+      });
+    } else if (name == "set_memory_budget") {
+      return PackedFunc([this, sptr_to_self](TVMArgs args, TVMRetValue* rv) {
+        ICHECK_EQ(args.size(), 1);
+        std::lock_guard<std::mutex> lock(session_server_mutex_);
+        memory_budget_ = args[0];
+        EvictModels(0);
+      });
+    } else if (name == "reload_async") {
+      return PackedFunc([this, sptr_to_self](TVMArgs args, TVMRetValue* rv) {
+        ICHECK(args.size() == 2 || args.size() == 3);
+        // the load runs on its own thread, the lock only guards pending_chat_
+        std::lock_guard<std::mutex> lock(session_server_mutex_);
+        ICHECK(!pending_chat_.valid()) << "Another model is being loaded";
+        tvm::runtime::Module executable = args[0];
+        std::string model_path = args[1];
+        keep_previous_chat_ = args.size() == 3 && static_cast<bool>(args[2]);
+        DLDevice device = device_;
+        pending_chat_ = std::async(std::launch::async, [executable, model_path, device]() {
+          std::unique_ptr<LLMChat> chat = std::make_unique<LLMChat>(device);
+          chat->Reload(executable, model_path);
+          return chat;
+        });
+      });
+    } else if (name == "reload_ready") {
+      return PackedFunc([this, sptr_to_self](TVMArgs args, TVMRetValue* rv) {
+        // polls without waiting, so the lock is not held across the load
+        std::lock_guard<std::mutex> lock(session_server_mutex_);
+        *rv = pending_chat_.valid() &&
+              pending_chat_.wait_for(std::chrono::seconds(0)) == std::future_status::ready;
+      });
+    } else if (name == "swap_model") {
+      return PackedFunc([this, sptr_to_self](TVMArgs args, TVMRetValue* rv) {
+        std::lock_guard<std::mutex> lock(session_server_mutex_);
+        SwapModel();
+      });
+    } else if (name == "release_previous_model") {
+      return PackedFunc([this, sptr_to_self](TVMArgs args, TVMRetValue* rv) {
+        std::lock_guard<std::mutex> lock(session_server_mutex_);
+        this->ReleaseChat(std::move(previous_chat_));
+      });
+    } else if (name == "remove_session") {
+      return PackedFunc([this, sptr_to_self](TVMArgs args, TVMRetValue* rv) {
+        ICHECK_EQ(args.size(), 1);
+        SessionServer()->RemoveSession(args[0]);
+      });
+    } else if (name == "num_sessions") {
+      return PackedFunc([this, sptr_to_self](TVMArgs args, TVMRetValue* rv) {
+        std::shared_ptr<ChatSessionServer> server = std::atomic_load(&session_server_);
+        *rv = server != nullptr ? server->NumSessions() : 0;
+      });
     }
 
     ICHECK(chat_ != nullptr);
     if (name == "evaluate") {
-      return PackedFunc([this, sptr_to_self](TVMArgs args, TVMRetValue* rv) { chat_->Evaluate(); });
+      return PackedFunc([this, sptr_to_self](TVMArgs args, TVMRetValue* rv) {
+        this->RunChat([](LLMChat* chat) { chat->Evaluate(); });
+      });
+    } else if (name == "benchmark") {
+      return PackedFunc([this, sptr_to_self](TVMArgs args, TVMRetValue* rv) {
+        ICHECK_LE(args.size(), 1);
+        std::string config = args.size() == 1 ? args[0].operator std::string() : "";
+        this->RunChat([&](LLMChat* chat) { *rv = chat->Benchmark(config); });
+      });
     } else if (name == "try_tokenizer") {
-      return PackedFunc(
-          [this, sptr_to_self](TVMArgs args, TVMRetValue* rv) { chat_->TryTokenizer(); });
+      return PackedFunc([this, sptr_to_self](TVMArgs args, TVMRetValue* rv) {
+        this->RunChat([](LLMChat* chat) { chat->TryTokenizer(); });
+      });
+    } else if (name == "create_session") {
+      return PackedFunc([this, sptr_to_self](TVMArgs args, TVMRetValue* rv) {
+        ICHECK_EQ(args.size(), 0);
+        *rv = CreateSession();
+      });
     } else if (name == "encode") {
       return PackedFunc([this, sptr_to_self](TVMArgs args, TVMRetValue* rv) {
-        ICHECK_EQ(args.size(), 1);
-        chat_->EncodeStep(args[0]);
+        ICHECK(args.size() == 1 || args.size() == 2);
+        if (args.size() == 1) {
+          this->RunChat([&](LLMChat* chat) { chat->EncodeStep(args[0]); });
+          return;
+        }
+        std::string inp = args[1];
+        SessionServer()->RunSession(args[0], [inp](LLMChat* chat) { chat->EncodeStep(inp); });
       });
     } else if (name == "decode") {
-      return PackedFunc(
-          [this, sptr_to_self](TVMArgs args, TVMRetValue* rv) { chat_->DecodeStep(); });
+      return PackedFunc([this, sptr_to_self](TVMArgs args, TVMRetValue* rv) {
+        ICHECK_LE(args.size(), 1);
+        if (args.size() == 0) {
+          this->RunChat([](LLMChat* chat) { chat->DecodeStep(); });
+          return;
+        }
+        SessionServer()->RunSession(args[0], [](LLMChat* chat) { chat->DecodeStep(); });
+      });
     } else if (name == "init_chat_legacy") {
       // TODO: remove the legacy initialization func after updating app and web sides.
       return PackedFunc([this, sptr_to_self](TVMArgs args, TVMRetValue* rv) {
         ICHECK_EQ(args.size(), 5);
-        chat_->InitChatLegacy(args[0], args[1], args[2], args[3], args[4]);
+        this->RunChat([&](LLMChat* chat) {
+          chat->InitChatLegacy(args[0], args[1], args[2], args[3], args[4]);
+        });
       });
     } else if (name == "reset_chat") {
       return PackedFunc([this, sptr_to_self](TVMArgs args, TVMRetValue* rv) {
-        ICHECK_EQ(args.size(), 0);
-        chat_->ResetChat();
+        ICHECK_LE(args.size(), 1);
+        if (args.size() == 0) {
+          this->RunChat([](LLMChat* chat) { chat->ResetChat(); });
+          return;
+        }
+        SessionServer()->RunSession(args[0], [](LLMChat* chat) { chat->ResetChat(); });
+      });
+    } else if (name == "save_session") {
+      return PackedFunc([this, sptr_to_self](TVMArgs args, TVMRetValue* rv) {
+        ICHECK(args.size() == 1 || args.size() == 2);
+        if (args.size() == 1) {
+          this->RunChat([&](LLMChat* chat) { chat->SaveSession(args[0]); });
+          return;
+        }
+        std::string path = args[1];
+        SessionServer()->RunSession(args[0], [path](LLMChat* chat) { chat->SaveSession(path); });
+      });
+    } else if (name == "load_session") {
+      return PackedFunc([this, sptr_to_self](TVMArgs args, TVMRetValue* rv) {
+        ICHECK(args.size() == 1 || args.size() == 2);
+        if (args.size() == 1) {
+          this->RunChat([&](LLMChat* chat) { chat->LoadSession(args[0]); });
+          return;
+        }
+        std::string path = args[1];
+        SessionServer()->RunSession(args[0], [path](LLMChat* chat) { chat->LoadSession(path); });
+      });
+    } else if (name == "set_regex_constraint") {
+      return PackedFunc([this, sptr_to_self](TVMArgs args, TVMRetValue* rv) {
+        ICHECK(args.size() == 1 || args.size() == 2);
+        if (args.size() == 1) {
+          this->RunChat([&](LLMChat* chat) { chat->SetRegexConstraint(args[0]); });
+          return;
+        }
+        std::string regex = args[1];
+        SessionServer()->RunSession(args[0],
+                                    [regex](LLMChat* chat) { chat->SetRegexConstraint(regex); });
       });
     } else if (name == "get_role0") {
       return PackedFunc([this, sptr_to_self](TVMArgs args, TVMRetValue* rv) {
-        *rv = chat_->conversation_.roles[0];
+        this->RunChat([&](LLMChat* chat) { *rv = chat->conversation_.roles[0]; });
       });
     } else if (name == "get_role1") {
       return PackedFunc([this, sptr_to_self](TVMArgs args, TVMRetValue* rv) {
-        *rv = chat_->conversation_.roles[1];
+        this->RunChat([&](LLMChat* chat) { *rv = chat->conversation_.roles[1]; });
       });
     } else if (name == "stopped") {
-      return PackedFunc(
-          [this, sptr_to_self](TVMArgs args, TVMRetValue* rv) { *rv = chat_->Stopped(); });
+      return PackedFunc([this, sptr_to_self](TVMArgs args, TVMRetValue* rv) {
+        ICHECK_LE(args.size(), 1);
+        if (args.size() == 0) {
+          this->RunChat([&](LLMChat* chat) { *rv = chat->Stopped(); });
+          return;
+        }
+        *rv = SessionServer()->RunSession(args[0], [](LLMChat* chat) { return chat->Stopped(); });
+      });
     } else if (name == "get_message") {
-      return PackedFunc(
-          [this, sptr_to_self](TVMArgs args, TVMRetValue* rv) { *rv = chat_->GetMessage(); });
+      return PackedFunc([this, sptr_to_self](TVMArgs args, TVMRetValue* rv) {
+        ICHECK_LE(args.size(), 1);
+        if (args.size() == 0) {
+          this->RunChat([&](LLMChat* chat) { *rv = chat->GetMessage(); });
+          return;
+        }
+        *rv = SessionServer()->RunSession(args[0],
+                                          [](LLMChat* chat) { return chat->GetMessage(); });
+      });
+    } else if (name == "get_message_delta") {
+      return PackedFunc([this, sptr_to_self](TVMArgs args, TVMRetValue* rv) {
+        ICHECK_LE(args.size(), 1);
+        if (args.size() == 0) {
+          this->RunChat([&](LLMChat* chat) { *rv = chat->GetMessageDelta(); });
+          return;
+        }
+        *rv = SessionServer()->RunSession(args[0],
+                                          [](LLMChat* chat) { return chat->GetMessageDelta(); });
+      });
+    } else if (name == "load_draft_model") {
+      return PackedFunc([this, sptr_to_self](TVMArgs args, TVMRetValue* rv) {
+        ICHECK(args.size() == 2 || args.size() == 3);
+        int64_t num_draft_tokens = args.size() == 3 ? args[2].operator int64_t() : 4;
+        this->RunChat(
+            [&](LLMChat* chat) { chat->LoadDraftModel(args[0], args[1], num_draft_tokens); });
+      });
+    } else if (name == "unload_draft_model") {
+      return PackedFunc([this, sptr_to_self](TVMArgs args, TVMRetValue* rv) {
+        this->RunChat([](LLMChat* chat) { chat->UnloadDraftModel(); });
+      });
     } else if (name == "runtime_stats_text") {
-      return PackedFunc(
-          [this, sptr_to_self](TVMArgs args, TVMRetValue* rv) { *rv = chat_->RuntimeStatsText(); });
+      return PackedFunc([this, sptr_to_self](TVMArgs args, TVMRetValue* rv) {
+        this->RunChat([&](LLMChat* chat) { *rv = chat->RuntimeStatsText(); });
+      });
+    } else if (name == "runtime_stats_json") {
+      return PackedFunc([this, sptr_to_self](TVMArgs args, TVMRetValue* rv) {
+        this->RunChat([&](LLMChat* chat) { *rv = chat->RuntimeStatsJSON(); });
+      });
+    } else if (name == "start_trace") {
+      return PackedFunc([this, sptr_to_self](TVMArgs args, TVMRetValue* rv) {
+        ICHECK_LE(args.size(), 1);
+        int64_t max_events = args.size() == 1 ? args[0].operator int64_t() : 1000000;
+        this->RunChat([&](LLMChat* chat) { chat->runtime_stats_.StartTrace(max_events); });
+      });
+    } else if (name == "stop_trace") {
+      return PackedFunc([this, sptr_to_self](TVMArgs args, TVMRetValue* rv) {
+        this->RunChat([](LLMChat* chat) { chat->runtime_stats_.StopTrace(); });
+      });
+    } else if (name == "trace_json") {
+      return PackedFunc([this, sptr_to_self](TVMArgs args, TVMRetValue* rv) {
+        this->RunChat([&](LLMChat* chat) { *rv = chat->runtime_stats_.TraceJSON(); });
+      });
     } else if (name == "reset_runtime_stats") {
-      return PackedFunc(
-          [this, sptr_to_self](TVMArgs args, TVMRetValue* rv) { chat_->ResetRuntimeStats(); });
+      return PackedFunc([this, sptr_to_self](TVMArgs args, TVMRetValue* rv) {
+        this->RunChat([](LLMChat* chat) { chat->ResetRuntimeStats(); });
+      });
     } else {
       return PackedFunc(nullptr);
     }
@@ -1040,11 +3056,6 @@ class LLMChatModule : public ModuleNode {
     chat_->device_ = device;
     chat_->tokenizer_ = std::move(tokenizer);
 
-    // load in nd-arracy cache
-    const PackedFunc* fload_cache = tvm::runtime::Registry::Get("vm.builtin.ndarray_cache.load");
-    ICHECK(fload_cache) << "TVM runtime cannot find vm.builtin.ndarray_cache.load";
-    (*fload_cache)(param_path, static_cast<int32_t>(device_.device_type), device.device_id);
-
     // initialize vm, we use the packed function mechanism
     // so there is no explicit abi dependency on these extra
     // classes other than basic tvm runtime.
@@ -1062,24 +3073,13 @@ class LLMChatModule : public ModuleNode {
     chat_->encoding_without_cache_func_ = chat_->vm_->GetFunction("encoding_without_cache");
     chat_->softmax_func_ = chat_->vm_->GetFunction("softmax_with_temperature");
     chat_->get_metadata_func_ = chat_->vm_->GetFunction("get_metadata");
+    chat_->kv_cache_rotate_func_ = chat_->vm_->GetFunction("kv_cache_rotate");
+    chat_->sample_top_p_func_ = chat_->vm_->GetFunction("sample_top_p");
+    chat_->verification_func_ = chat_->vm_->GetFunction("verification");
     auto kv_cache_func = chat_->vm_->GetFunction("create_kv_cache");
 
-    auto fsample_topp_from_prob_ptr =
-        tvm::runtime::Registry::Get("vm.builtin.sample_top_p_from_prob");
-    ICHECK(fsample_topp_from_prob_ptr)
-        << "Cannot find env function vm.builtin.sample_top_p_from_prob";
-    chat_->fsample_topp_from_prob_ = *fsample_topp_from_prob_ptr;
-    auto fsample_topp_from_logits_ptr =
-        tvm::runtime::Registry::Get("vm.builtin.sample_top_p_from_logits");
-    ICHECK(fsample_topp_from_logits_ptr)
-        << "Cannot find env function vm.builtin.sample_top_p_from_logits";
-    chat_->fsample_topp_from_logits_ = *fsample_topp_from_logits_ptr;
-
-    // parameter loading
-    const PackedFunc* fload_params =
-        tvm::runtime::Registry::Get("vm.builtin.param_array_from_cache");
-    ICHECK(fload_params) << "Cannot find env function vm.builtin.param_array_from_cache";
-    chat_->params_ = (*fload_params)("param", -1);
+    // parameter loading, through the builtin cache under the lock that other loads take
+    chat_->params_ = LoadParamsFromNDArrayCache(param_path, device);
 
     // KV cache creation
     chat_->kv_cache_ = chat_->vm_->GetFunction("create_kv_cache")();
@@ -1088,9 +3088,723 @@ class LLMChatModule : public ModuleNode {
   const char* type_key() const final { return "mlc.llm_chat"; }
 
  private:
-  const PackedFunc* fclear_ndarray_cache_ =
-      tvm::runtime::Registry::Get("vm.builtin.ndarray_cache.clear");
+  /*!
+   * \brief Switch to the chat loaded by reload_async, waiting for the load if it is still
+   *  running. Without a pending load, switch back and forth with the chat kept by the
+   *  previous swap.
+   */
+  void SwapModel() {
+    if (!pending_chat_.valid()) {
+      ICHECK(previous_chat_ != nullptr) << "No model to swap to, please call reload_async first";
+      std::swap(chat_, previous_chat_);
+      std::swap(model_id_, previous_model_id_);
+      return;
+    }
+    std::unique_ptr<LLMChat> chat = pending_chat_.get();
+    std::swap(chat_, chat);
+    previous_model_id_ = model_id_;
+    model_id_ = "";
+    // the weights of the old model are freed here unless asked to keep it
+    this->ReleaseChat(std::move(previous_chat_));
+    if (keep_previous_chat_) {
+      previous_chat_ = std::move(chat);
+    } else {
+      this->ReleaseChat(std::move(chat));
+    }
+  }
+
+  /*!
+   * \brief Wait for the load started by reload_async and drop its chat, so that a later
+   *  swap_model cannot replace a model selected after the load started.
+   */
+  void DiscardPendingChat() {
+    if (!pending_chat_.valid()) return;
+    LOG(WARNING) << "Discard the model being loaded by reload_async";
+    // the load cannot be interrupted, and an error of it no longer matters
+    pending_chat_.wait();
+    pending_chat_ = std::future<std::unique_ptr<LLMChat>>();
+  }
+
+  using ResidentChatList = std::list<std::pair<std::string, std::unique_ptr<LLMChat>>>;
+
+  ResidentChatList::iterator FindResidentChat(const std::string& model_id) {
+    return std::find_if(resident_chats_.begin(), resident_chats_.end(),
+                        [&](const auto& entry) { return entry.first == model_id; });
+  }
+
+  /*! \brief Get the device memory held by the selected and the resident chats. */
+  int64_t ResidentBytes() const {
+    int64_t nbytes = chat_ != nullptr ? chat_->DeviceMemoryBytes() : 0;
+    if (previous_chat_ != nullptr) nbytes += previous_chat_->DeviceMemoryBytes();
+    for (const auto& entry : resident_chats_) {
+      nbytes += entry.second->DeviceMemoryBytes();
+    }
+    return nbytes;
+  }
+
+  /*!
+   * \brief Free the least recently selected models until extra_bytes more fit in the memory
+   *  budget, then the model kept by the last swap. The selected model is never evicted.
+   */
+  void EvictModels(int64_t extra_bytes) {
+    if (memory_budget_ <= 0) return;
+    while (!resident_chats_.empty() && ResidentBytes() + extra_bytes > memory_budget_) {
+      LOG(INFO) << "Evict model " << resident_chats_.back().first << " to fit the memory budget";
+      this->ReleaseChat(std::move(resident_chats_.back().second));
+      resident_chats_.pop_back();
+    }
+    // the chat kept by the last swap goes last, since it was selected most recently
+    if (previous_chat_ != nullptr && ResidentBytes() + extra_bytes > memory_budget_) {
+      LOG(INFO) << "Release the previous model to fit the memory budget";
+      this->ReleaseChat(std::move(previous_chat_));
+    }
+  }
+
+  /*!
+   * \brief Make a model resident under model_id without selecting it. Models that are not
+   *  used recently are evicted to make room for its params before it is loaded, and for its
+   *  KV cache after.
+   */
+  void LoadModel(const std::string& model_id, tvm::runtime::Module executable,
+                 const std::string& model_path) {
+    ICHECK(!model_id.empty()) << "The model id cannot be empty";
+    if (chat_ != nullptr && model_id == model_id_) return;
+    auto it = FindResidentChat(model_id);
+    if (it != resident_chats_.end()) {
+      resident_chats_.splice(resident_chats_.begin(), resident_chats_, it);
+      return;
+    }
+    EvictModels(GetParamBytes(model_path));
+    std::unique_ptr<LLMChat> chat = std::make_unique<LLMChat>(device_);
+    chat->Reload(executable, model_path);
+    resident_chats_.emplace_front(model_id, std::move(chat));
+    EvictModels(0);
+    // the new model itself does not fit, keep it anyway since the caller asked for it
+    if (memory_budget_ > 0 && ResidentBytes() > memory_budget_) {
+      LOG(WARNING) << "Model " << model_id << " exceeds the memory budget of " << memory_budget_
+                   << " bytes";
+    }
+  }
+
+  /*!
+   * \brief Create a session of the selected model. The session server is started for the
+   *  first session, and restarted for the first session after another model is selected.
+   */
+  int64_t CreateSession() {
+    std::lock_guard<std::mutex> lock(session_server_mutex_);
+    std::shared_ptr<ChatSessionServer> server = std::atomic_load(&session_server_);
+    if (server == nullptr || !server->Serves(chat_->vm_)) {
+      ICHECK(server == nullptr || server->NumSessions() == 0)
+          << "The sessions of the previously selected model are still open, please remove "
+             "them first";
+      server = std::make_shared<ChatSessionServer>(*chat_);
+      std::atomic_store(&session_server_, server);
+    }
+    return server->CreateSession();
+  }
+
+  /*!
+   * \brief Run f with the selected chat. While the session server serves the model of the
+   *  chat, f runs on the worker of the server, since the chat shares the KV cache pool and
+   *  the device sampling params with the sessions.
+   */
+  template <typename F>
+  auto RunChat(F f) -> decltype(f(std::declval<LLMChat*>())) {
+    // the server cannot start, and the chat cannot be replaced, in the meantime
+    std::lock_guard<std::mutex> lock(session_server_mutex_);
+    LLMChat* chat = chat_.get();
+    ICHECK(chat != nullptr);
+    std::shared_ptr<ChatSessionServer> server = std::atomic_load(&session_server_);
+    if (server != nullptr && server->Serves(chat->vm_)) {
+      return server->Run([chat, f]() { return f(chat); });
+    }
+    return f(chat);
+  }
+
+  /*!
+   * \brief Free a chat, on the worker of the session server when the server serves its model,
+   *  since its KV cache pages are returned to the pool of the sessions.
+   * \note The caller holds session_server_mutex_.
+   */
+  void ReleaseChat(std::unique_ptr<LLMChat> chat) {
+    if (chat == nullptr) return;
+    std::shared_ptr<ChatSessionServer> server = std::atomic_load(&session_server_);
+    if (server != nullptr && server->Serves(chat->vm_)) {
+      server->Run([&chat]() { chat = nullptr; });
+    }
+  }
+
+  std::shared_ptr<ChatSessionServer> SessionServer() {
+    std::shared_ptr<ChatSessionServer> server = std::atomic_load(&session_server_);
+    ICHECK(server != nullptr) << "Unknown session id, please call create_session first";
+    return server;
+  }
+
+  /*! \brief Select a resident model to serve the chat functions. */
+  void SelectModel(const std::string& model_id) {
+    if (chat_ != nullptr && model_id == model_id_) return;
+    auto it = FindResidentChat(model_id);
+    ICHECK(it != resident_chats_.end())
+        << "Model " << model_id << " is not resident, please call load_model first";
+    std::unique_ptr<LLMChat> chat = std::move(it->second);
+    resident_chats_.erase(it);
+    // a chat from the blocking reload has no id and is replaced for good
+    if (chat_ != nullptr && !model_id_.empty()) {
+      resident_chats_.emplace_front(model_id_, std::move(chat_));
+    }
+    this->ReleaseChat(std::move(chat_));
+    chat_ = std::move(chat);
+    model_id_ = model_id;
+  }
+
   std::unique_ptr<LLMChat> chat_ = nullptr;
+  // The id of the selected chat, empty if it is not loaded by load_model.
+  std::string model_id_;
+  // The models kept resident by load_model besides the selected one, most recently used first.
+  ResidentChatList resident_chats_;
+  // The device memory budget of the resident models in bytes, unlimited if not positive.
+  int64_t memory_budget_{0};
+  // The chat being loaded by reload_async in the background.
+  std::future<std::unique_ptr<LLMChat>> pending_chat_;
+  // The chat replaced by the last swap, kept resident when reload_async asks for it.
+  std::unique_ptr<LLMChat> previous_chat_ = nullptr;
+  std::string previous_model_id_;
+  bool keep_previous_chat_{false};
+  // The server of the sessions, which may be called from any thread. The functions without a
+  // session id serve chat_ and must be called from one thread at a time; they run on the
+  // worker of the server while it serves the model of chat_.
+  std::shared_ptr<ChatSessionServer> session_server_ = nullptr;
+  // Serializes starting the session server with the calls that use or replace the chats, and
+  // guards the chats, their model ids, the memory budget and the reload_async state above.
+  std::mutex session_server_mutex_;
+  DLDevice device_;
+};
+
+/*!
+ * \brief Serves many chat sequences on top of one loaded model.
+ *
+ * All sequences share the vm, params and tokenizer of the model and own their
+ * KV caches. Requests join or leave between steps. Each step prefills the newly
+ * admitted requests, then decodes one token of all running sequences. Models built
+ * with the paged KV cache decode them in one call of their batched decode function
+ * with stacked inputs. Other models run the decode forward of each sequence back to
+ * back before a single device synchronization, and sample them together. The prefill
+ * of a step is bounded by the prefill chunk size of the model, so a long prompt
+ * is prefilled over several steps while the running sequences keep decoding.
+ */
+class LLMEngine {
+ public:
+  explicit LLMEngine(DLDevice device) : device_(device) {}
+
+  void Reload(tvm::runtime::Module executable, String model_path) {
+    requests_.clear();
+    pending_.clear();
+    prefilling_.clear();
+    running_.clear();
+    free_chats_.clear();
+    prototype_ = std::make_unique<LLMChat>(LLMChat(device_));
+    prototype_->kv_cache_num_sequences_ = max_batch_size_;
+    prototype_->Reload(executable, model_path);
+    // The prototype is only used to fork sequences, release its KV cache
+    // so that the memory can be taken by the first sequence.
+    prototype_->kv_cache_ = Array<ObjectRef>();
+  }
+
+  /*!
+   * \brief Add a new request, which joins the running batch at a following step.
+   * \param prompt The user input of the request.
+   * \param options_json An optional JSON object of generation options for the request:
+   *  "max_tokens" (the most tokens to generate), "temperature", "top_p", and "stop" (a list
+   *  of stop strings, used besides the one of the conversation template). The options that
+   *  are not given keep the values of mlc-chat-config.json.
+   * \return The id of the request.
+   */
+  int64_t AddRequest(std::string prompt, const std::string& options_json = "") {
+    ICHECK(prototype_ != nullptr) << "Engine model is not loaded";
+    Request request;
+    request.prompt = std::move(prompt);
+    if (!options_json.empty()) {
+      picojson::value options_value;
+      std::string err = picojson::parse(options_value, options_json);
+      ICHECK(err.empty() && options_value.is<picojson::object>())
+          << "The request options must be a JSON object: " << err;
+      picojson::object options = options_value.get<picojson::object>();
+      if (options.count("max_tokens")) {
+        ICHECK(options["max_tokens"].is<int64_t>() && options["max_tokens"].get<int64_t>() > 0)
+            << "max_tokens must be a positive integer";
+        request.max_tokens = options["max_tokens"].get<int64_t>();
+      }
+      if (options.count("temperature")) {
+        ICHECK(options["temperature"].is<double>() && options["temperature"].get<double>() >= 0)
+            << "temperature must be a non-negative number";
+        request.temperature = options["temperature"].get<double>();
+      }
+      if (options.count("top_p")) {
+        ICHECK(options["top_p"].is<double>() && options["top_p"].get<double>() > 0 &&
+               options["top_p"].get<double>() <= 1)
+            << "top_p must be a number in (0, 1]";
+        request.top_p = options["top_p"].get<double>();
+      }
+      if (options.count("stop")) {
+        ICHECK(options["stop"].is<picojson::array>()) << "stop must be a list of strings";
+        for (const picojson::value& stop_str : options["stop"].get<picojson::array>()) {
+          ICHECK(stop_str.is<std::string>()) << "stop must be a list of strings";
+          request.stop_strs.push_back(stop_str.get<std::string>());
+        }
+      }
+    }
+    int64_t request_id = next_request_id_++;
+    requests_[request_id] = std::move(request);
+    pending_.push_back(request_id);
+    return request_id;
+  }
+
+  /*!
+   * \brief Remove a request, stopping its generation if it is still running.
+   * \param request_id The id of the request.
+   */
+  void RemoveRequest(int64_t request_id) {
+    auto it = requests_.find(request_id);
+    ICHECK(it != requests_.end()) << "Unknown request id " << request_id;
+    pending_.erase(std::remove(pending_.begin(), pending_.end(), request_id), pending_.end());
+    prefilling_.erase(std::remove(prefilling_.begin(), prefilling_.end(), request_id),
+                      prefilling_.end());
+    running_.erase(std::remove(running_.begin(), running_.end(), request_id), running_.end());
+    if (it->second.chat != nullptr) {
+      it->second.chat->ClearKVCache();
+      free_chats_.push_back(std::move(it->second.chat));
+    }
+    requests_.erase(it);
+  }
+
+  /*!
+   * \brief Run one engine step.
+   * \return The number of sequences that are still prefilling or running after the step.
+   */
+  int64_t Step() {
+    // Step 1. Admit pending requests in arrival order. The KV cache pages of the whole
+    // sequence are reserved on admission, so a running sequence never runs out of pages in
+    // the middle of a step. A request whose pages are not free waits until others finish.
+    while (!pending_.empty() && this->NumRunningRequests() < max_batch_size_) {
+      int64_t request_id = pending_.front();
+      Request& request = requests_.at(request_id);
+      if (request.chat == nullptr &&
+          !this->RunRequest(request_id, [&]() { this->BeginRequest(&request); })) {
+        pending_.pop_front();
+        continue;
+      }
+      int64_t seq_len = this->MaxSeqLen();
+      int64_t prompt_len = request.chat->PrefilledSeqLen();
+      if (prompt_len >= seq_len) {
+        pending_.pop_front();
+        this->FailRequest(request_id, "The prompt does not fit the KV cache");
+        continue;
+      }
+      if (request.max_tokens > 0) seq_len = std::min(seq_len, prompt_len + request.max_tokens);
+      if (!request.chat->ReserveKVCache(seq_len)) break;
+      request.chat->seq_len_limit_ = seq_len;
+      pending_.pop_front();
+      prefilling_.push_back(request_id);
+    }
+
+    // Step 2. Prefill the admitted prompts in arrival order, up to the prefill chunk size
+    // of tokens in total.
+    int64_t prefill_budget = prototype_->prefill_chunk_size_;
+    while (!prefilling_.empty()) {
+      int64_t request_id = prefilling_.front();
+      Request& request = requests_.at(request_id);
+      int64_t prev_seq_len = request.chat->total_seq_len_;
+      auto tstart = std::chrono::high_resolution_clock::now();
+      bool finished = false;
+      if (!this->RunRequest(request_id,
+                            [&]() { finished = request.chat->PrefillChunk(prefill_budget); })) {
+        prefilling_.pop_front();
+        continue;
+      }
+      auto tend = std::chrono::high_resolution_clock::now();
+      int64_t num_tokens = request.chat->total_seq_len_ - prev_seq_len;
+      this->prefill_total_time += static_cast<double>((tend - tstart).count()) / 1e9;
+      this->prefill_total_tokens += num_tokens;
+      if (finished) {
+        prefilling_.pop_front();
+        if (request.chat->Stopped()) {
+          this->FinishRequest(&request);
+        } else {
+          running_.push_back(request_id);
+        }
+      }
+      if (prefill_budget > 0) {
+        prefill_budget -= num_tokens;
+        if (prefill_budget <= 0) break;
+      }
+    }
+    if (running_.empty()) return prefilling_.size();
+
+    // Step 3. Decode one token of every running sequence. A paged model decodes all of them
+    // in one call of its batched decode function. Otherwise the decode forward of every
+    // sequence is launched back to back, and the device is synchronized once.
+    auto tstart = std::chrono::high_resolution_clock::now();
+    if (this->UseBatchedDecode()) {
+      try {
+        this->BatchedDecodeStep();
+      } catch (const std::exception& err) {
+        // the forward pass of the batch cannot tell which sequence failed
+        for (int64_t request_id : running_) {
+          if (!requests_.at(request_id).finished) this->FailRequest(request_id, err.what());
+        }
+      }
+    } else {
+      for (int64_t request_id : running_) {
+        this->RunRequest(request_id, [&]() { requests_.at(request_id).chat->LaunchDecodeStep(); });
+      }
+      prototype_->SyncComputeStream();
+      for (int64_t request_id : running_) {
+        Request& request = requests_.at(request_id);
+        if (request.finished) continue;
+        this->RunRequest(request_id, [&]() { request.chat->FinishDecodeStep(); });
+      }
+    }
+    auto tend = std::chrono::high_resolution_clock::now();
+    this->decode_total_time += static_cast<double>((tend - tstart).count()) / 1e9;
+    this->decode_total_tokens += running_.size();
+    this->decode_total_steps += 1;
+
+    // Step 4. Retire the finished sequences.
+    std::vector<int64_t> still_running;
+    still_running.reserve(running_.size());
+    for (int64_t request_id : running_) {
+      Request& request = requests_.at(request_id);
+      if (request.finished) continue;
+      if (request.chat->Stopped()) {
+        this->FinishRequest(&request);
+      } else {
+        still_running.push_back(request_id);
+      }
+    }
+    running_ = std::move(still_running);
+    return this->NumRunningRequests();
+  }
+
+  bool Stopped(int64_t request_id) { return GetRequest(request_id).finished; }
+
+  /*! \return The error that stopped the request, empty if it did not fail. */
+  std::string GetError(int64_t request_id) { return GetRequest(request_id).error; }
+
+  /*!
+   * \return Why the request finished: "stop" at a stop token or string, "length" at the
+   *  window or max_tokens, or empty if it failed or is not finished.
+   */
+  std::string GetFinishReason(int64_t request_id) {
+    return GetRequest(request_id).finish_reason;
+  }
+
+  std::string GetMessage(int64_t request_id) {
+    const Request& request = GetRequest(request_id);
+    if (request.chat == nullptr) return "";
+    return request.chat->GetMessage();
+  }
+
+  std::string GetMessageDelta(int64_t request_id) {
+    const Request& request = GetRequest(request_id);
+    if (request.chat == nullptr) return "";
+    return request.chat->GetMessageDelta();
+  }
+
+  int64_t NumPendingRequests() const { return pending_.size(); }
+
+  /*! \return The number of admitted requests, which are prefilling or decoding. */
+  int64_t NumRunningRequests() const { return prefilling_.size() + running_.size(); }
+
+  /*!
+   * \brief Set the maximum number of sequences that decode in the same step. Without
+   *  requests, the default KV cache pool is resized to hold as many full windows.
+   */
+  void SetMaxBatchSize(int64_t max_batch_size) {
+    ICHECK_GT(max_batch_size, 0) << "Max batch size must be positive";
+    max_batch_size_ = max_batch_size;
+    if (prototype_ != nullptr && requests_.empty()) {
+      free_chats_.clear();
+      prototype_->ResizeKVCachePool(max_batch_size);
+    }
+  }
+
+  /*!
+   * \return Text describing runtime stats.
+   */
+  std::string RuntimeStatsText() {
+    std::ostringstream os;
+    os << "prefill: " << std::setprecision(1) << std::fixed
+       << this->prefill_total_tokens / this->prefill_total_time << " tok/s"
+       << ", decode: " << std::setprecision(1) << std::fixed
+       << this->decode_total_tokens / this->decode_total_time << " tok/s"
+       << ", avg-batch-size: " << std::setprecision(1) << std::fixed
+       << static_cast<double>(this->decode_total_tokens) / this->decode_total_steps;
+    return os.str();
+  }
+
+  /*! \brief reset the runtime stats. */
+  void ResetRuntimeStats() {
+    this->prefill_total_tokens = 0;
+    this->decode_total_tokens = 0;
+    this->decode_total_steps = 0;
+    this->prefill_total_time = 0;
+    this->decode_total_time = 0;
+  }
+
+ private:
+  /*! \brief The state of a request. */
+  struct Request {
+    // the user input
+    std::string prompt;
+    // the generation options, the most tokens to generate is unbounded if not positive
+    int64_t max_tokens = 0;
+    std::optional<float> temperature, top_p;
+    std::vector<std::string> stop_strs;
+    // the sequence serving the request, null before the request is admitted
+    std::unique_ptr<LLMChat> chat = nullptr;
+    // whether the generation finished, why it did, and the error that stopped it if it failed
+    bool finished = false;
+    std::string finish_reason;
+    std::string error;
+  };
+
+  const Request& GetRequest(int64_t request_id) {
+    auto it = requests_.find(request_id);
+    ICHECK(it != requests_.end()) << "Unknown request id " << request_id;
+    return it->second;
+  }
+
+  // Take a chat for an admitted request, apply its options and tokenize its prompt.
+  void BeginRequest(Request* request) {
+    request->chat = this->AcquireChat();
+    LLMChat* chat = request->chat.get();
+    // a reused chat may hold the options of its previous request
+    chat->temperature_ = request->temperature.value_or(prototype_->temperature_);
+    chat->top_p_ = request->top_p.value_or(prototype_->top_p_);
+    chat->request_stop_strs_ = request->stop_strs;
+    chat->BeginPrefill(request->prompt);
+  }
+
+  /*!
+   * \brief Run f for a request, and fail only that request if f raises an error.
+   * \return Whether f succeeded.
+   */
+  template <typename F>
+  bool RunRequest(int64_t request_id, F f) {
+    try {
+      f();
+      return true;
+    } catch (const std::exception& err) {
+      this->FailRequest(request_id, err.what());
+      return false;
+    }
+  }
+
+  // Finish a request with an error, and free its KV cache pages. The caller removes it from
+  // the queue it is in, or leaves it to the retirement at the end of the step.
+  // Finish a request whose chat stopped. The message is kept, the pages go to the pending
+  // requests.
+  void FinishRequest(Request* request) {
+    request->finish_reason = request->chat->StoppedAtStop() ? "stop" : "length";
+    request->chat->ClearKVCache();
+    request->finished = true;
+  }
+
+  void FailRequest(int64_t request_id, const std::string& error) {
+    LOG(WARNING) << "Request " << request_id << " failed: " << error;
+    Request& request = requests_.at(request_id);
+    request.finished = true;
+    request.error = error;
+    if (request.chat != nullptr) request.chat->ClearKVCache();
+  }
+
+  bool UseBatchedDecode() const {
+    return running_.size() > 1 && prototype_->decoding_batch_func_ != nullptr &&
+           prototype_->kv_cache_pool_.defined();
+  }
+
+  // Run the forward passes of the running sequences in one call and sample them on the host.
+  void BatchedDecodeStep() {
+    const PagedKVCachePool& pool = prototype_->kv_cache_pool_;
+    if (!batch_.defined() || !batch_->pool.same_as(pool)) {
+      batch_ = PagedKVBatch(pool);
+      batch_caches_ = batch_.CreateCaches();
+    }
+    std::vector<PagedKVSequence> seqs;
+    batch_input_ids_.clear();
+    for (int64_t request_id : running_) {
+      LLMChat* chat = requests_.at(request_id).chat.get();
+      batch_input_ids_.push_back(chat->next_token_);
+      chat->BeginBatchedDecodeStep();
+      seqs.push_back(Downcast<PagedKVCache>(chat->kv_cache_[0])->seq);
+    }
+    batch_.Prepare(std::move(seqs), batch_input_ids_);
+    Array<ObjectRef> ret = prototype_->decoding_batch_func_(
+        batch_->input_ids, batch_->rows, batch_->lengths, batch_caches_, prototype_->params_);
+    NDArray logits = Downcast<NDArray>(ret[0]);
+    int64_t batch_size = running_.size();
+    int64_t vocab_size = logits->shape[2];
+    if (!batch_logits_host_.defined() || batch_logits_host_.cpu()->shape[0] < batch_size) {
+      batch_logits_host_ = PinnedHostArray({std::max(batch_size, max_batch_size_), 1, vocab_size},
+                                           logits->dtype, device_);
+    }
+    DLTensor to = *batch_logits_host_.cpu().operator->();
+    to.shape = logits->shape;
+    NDArray::CopyFromTo(logits.operator->(), &to, prototype_->ComputeStream());
+    prototype_->SyncComputeStream();
+    float* host_logits = static_cast<float*>(batch_logits_host_.cpu()->data);
+    for (int64_t i = 0; i < batch_size; ++i) {
+      LLMChat* chat = requests_.at(running_[i]).chat.get();
+      this->RunRequest(running_[i], [&]() {
+        chat->FinishBatchedDecodeStep(host_logits + i * vocab_size, vocab_size);
+      });
+    }
+  }
+
+  // The longest sequence a request can grow to, which is bounded by the window and the pool.
+  int64_t MaxSeqLen() const {
+    int64_t seq_len = prototype_->max_window_size_;
+    const PagedKVCachePool& pool = prototype_->kv_cache_pool_;
+    if (pool.defined()) {
+      seq_len = std::min(seq_len, pool->NumPages() * pool->page_size());
+    }
+    return seq_len;
+  }
+
+  // Reuse the chat of a removed request when possible so its KV cache is not reallocated.
+  std::unique_ptr<LLMChat> AcquireChat() {
+    if (free_chats_.empty()) {
+      return prototype_->Fork();
+    }
+    std::unique_ptr<LLMChat> chat = std::move(free_chats_.back());
+    free_chats_.pop_back();
+    chat->ResetChat();
+    return chat;
+  }
+
+  //----------------------------
+  // Statistics
+  //----------------------------
+  double prefill_total_time = 0;
+  double decode_total_time = 0;
+  int64_t prefill_total_tokens = 0;
+  int64_t decode_total_tokens = 0;
+  int64_t decode_total_steps = 0;
+  //----------------------------
+  // Requests
+  //----------------------------
+  // maximum number of sequences that decode in the same step
+  int64_t max_batch_size_{8};
+  // the id of the next request
+  int64_t next_request_id_{0};
+  // all requests that are not removed
+  std::unordered_map<int64_t, Request> requests_;
+  // requests waiting to be admitted, in arrival order
+  std::deque<int64_t> pending_;
+  // admitted requests whose prompts are being prefilled, in arrival order
+  std::deque<int64_t> prefilling_;
+  // requests being decoded
+  std::vector<int64_t> running_;
+  // chats released by removed requests
+  std::vector<std::unique_ptr<LLMChat>> free_chats_;
+  // the chat that holds the loaded model
+  std::unique_ptr<LLMChat> prototype_ = nullptr;
+  //----------------------------
+  // Batched decode
+  //----------------------------
+  // the sequences of the step and their caches passed to the model
+  PagedKVBatch batch_{nullptr};
+  Array<ObjectRef> batch_caches_;
+  // the new tokens of the step, and the logits of the step on the host
+  std::vector<int32_t> batch_input_ids_;
+  PinnedHostArray batch_logits_host_;
+  // runtime device
+  Device device_;
+};
+
+class LLMEngineModule : public ModuleNode {
+ public:
+  // overrides
+  PackedFunc GetFunction(const std::string& name, const ObjectPtr<Object>& sptr_to_self) final {
+    if (name == "reload") {
+      return PackedFunc([this, sptr_to_self](TVMArgs args, TVMRetValue* rv) {
+        ICHECK_EQ(args.size(), 2);
+        engine_ = nullptr;
+        engine_ = std::make_unique<LLMEngine>(device_);
+        engine_->Reload(args[0], args[1]);
+      });
+    }
+
+    ICHECK(engine_ != nullptr);
+    if (name == "add_request") {
+      return PackedFunc([this, sptr_to_self](TVMArgs args, TVMRetValue* rv) {
+        ICHECK(args.size() == 1 || args.size() == 2);
+        *rv = engine_->AddRequest(args[0], args.size() == 2 ? args[1].operator std::string() : "");
+      });
+    } else if (name == "remove_request") {
+      return PackedFunc([this, sptr_to_self](TVMArgs args, TVMRetValue* rv) {
+        ICHECK_EQ(args.size(), 1);
+        engine_->RemoveRequest(args[0]);
+      });
+    } else if (name == "step") {
+      return PackedFunc(
+          [this, sptr_to_self](TVMArgs args, TVMRetValue* rv) { *rv = engine_->Step(); });
+    } else if (name == "stopped") {
+      return PackedFunc([this, sptr_to_self](TVMArgs args, TVMRetValue* rv) {
+        ICHECK_EQ(args.size(), 1);
+        *rv = engine_->Stopped(args[0]);
+      });
+    } else if (name == "get_finish_reason") {
+      return PackedFunc([this, sptr_to_self](TVMArgs args, TVMRetValue* rv) {
+        ICHECK_EQ(args.size(), 1);
+        *rv = engine_->GetFinishReason(args[0]);
+      });
+    } else if (name == "get_error") {
+      return PackedFunc([this, sptr_to_self](TVMArgs args, TVMRetValue* rv) {
+        ICHECK_EQ(args.size(), 1);
+        *rv = engine_->GetError(args[0]);
+      });
+    } else if (name == "get_message") {
+      return PackedFunc([this, sptr_to_self](TVMArgs args, TVMRetValue* rv) {
+        ICHECK_EQ(args.size(), 1);
+        *rv = engine_->GetMessage(args[0]);
+      });
+    } else if (name == "get_message_delta") {
+      return PackedFunc([this, sptr_to_self](TVMArgs args, TVMRetValue* rv) {
+        ICHECK_EQ(args.size(), 1);
+        *rv = engine_->GetMessageDelta(args[0]);
+      });
+    } else if (name == "num_pending_requests") {
+      return PackedFunc([this, sptr_to_self](TVMArgs args, TVMRetValue* rv) {
+        *rv = engine_->NumPendingRequests();
+      });
+    } else if (name == "num_running_requests") {
+      return PackedFunc([this, sptr_to_self](TVMArgs args, TVMRetValue* rv) {
+        *rv = engine_->NumRunningRequests();
+      });
+    } else if (name == "set_max_batch_size") {
+      return PackedFunc([this, sptr_to_self](TVMArgs args, TVMRetValue* rv) {
+        ICHECK_EQ(args.size(), 1);
+        engine_->SetMaxBatchSize(args[0]);
+      });
+    } else if (name == "runtime_stats_text") {
+      return PackedFunc([this, sptr_to_self](TVMArgs args, TVMRetValue* rv) {
+        *rv = engine_->RuntimeStatsText();
+      });
+    } else if (name == "reset_runtime_stats") {
+      return PackedFunc(
+          [this, sptr_to_self](TVMArgs args, TVMRetValue* rv) { engine_->ResetRuntimeStats(); });
+    } else {
+      return PackedFunc(nullptr);
+    }
+  }
+
+  void Init(DLDevice device) { device_ = device; }
+
+  const char* type_key() const final { return "mlc.llm_engine"; }
+
+ private:
+  std::unique_ptr<LLMEngine> engine_ = nullptr;
   DLDevice device_;
 };
 
@@ -1105,6 +3819,17 @@ TVM_REGISTER_GLOBAL("mlc.llm_chat_create").set_body_typed([](int device_type, in
   return CreateChatModule(DLDevice{static_cast<DLDeviceType>(device_type), device_id});
 });
 
+tvm::runtime::Module CreateEngineModule(DLDevice device) {
+  ObjectPtr<LLMEngineModule> n = make_object<LLMEngineModule>();
+  n->Init(device);
+  return Module(n);
+}
+
+// register as a system function that can be queried
+TVM_REGISTER_GLOBAL("mlc.llm_engine_create").set_body_typed([](int device_type, int device_id) {
+  return CreateEngineModule(DLDevice{static_cast<DLDeviceType>(device_type), device_id});
+});
+
 // TODO: legacy function to be removed
 tvm::runtime::Module CreateChatModuleLegacy(tvm::runtime::Module executable,
                                             std::unique_ptr<Tokenizer> tokenizer,
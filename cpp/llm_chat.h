@@ -24,6 +24,8 @@ namespace llm {
 // explicit export via TVM_DLL
 MLC_LLM_DLL tvm::runtime::Module CreateChatModule(DLDevice device);
 
+MLC_LLM_DLL tvm::runtime::Module CreateEngineModule(DLDevice device);
+
 MLC_LLM_DLL tvm::runtime::Module CreateChatModuleLegacy(tvm::runtime::Module executable,
                                                         const tvm::runtime::String& tokenizer_path,
                                                         const tvm::runtime::String& param_path,
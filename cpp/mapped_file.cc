@@ -0,0 +1,74 @@
+/*!
+ *  Copyright (c) 2023 by Contributors
+ * \file mapped_file.cc
+ * \brief Implementation of the read-only memory mapping of files.
+ */
+#include "mapped_file.h"
+
+#include <tvm/runtime/logging.h>
+
+#ifdef _WIN32
+#ifndef NOMINMAX
+#define NOMINMAX
+#endif
+#include <windows.h>
+#else
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+namespace mlc {
+namespace llm {
+
+MappedFile::MappedFile(const std::string& path, bool sequential) {
+#ifdef _WIN32
+  HANDLE file = CreateFileA(path.c_str(), GENERIC_READ, FILE_SHARE_READ, nullptr, OPEN_EXISTING,
+                            sequential ? FILE_FLAG_SEQUENTIAL_SCAN : FILE_ATTRIBUTE_NORMAL,
+                            nullptr);
+  ICHECK(file != INVALID_HANDLE_VALUE) << "Cannot open " << path;
+  file_ = file;
+  LARGE_INTEGER size;
+  ICHECK(GetFileSizeEx(file, &size)) << "Cannot get the size of " << path;
+  size_ = static_cast<size_t>(size.QuadPart);
+  if (size_ == 0) return;
+  mapping_ = CreateFileMappingA(file, nullptr, PAGE_READONLY, 0, 0, nullptr);
+  ICHECK(mapping_ != nullptr) << "Cannot map " << path;
+  data_ = static_cast<const char*>(MapViewOfFile(mapping_, FILE_MAP_READ, 0, 0, 0));
+#else
+  fd_ = open(path.c_str(), O_RDONLY);
+  ICHECK_GE(fd_, 0) << "Cannot open " << path;
+  struct stat st;
+  ICHECK_EQ(fstat(fd_, &st), 0) << "Cannot get the size of " << path;
+  size_ = static_cast<size_t>(st.st_size);
+  if (size_ == 0) return;
+  void* data = mmap(nullptr, size_, PROT_READ, MAP_PRIVATE, fd_, 0);
+  ICHECK(data != MAP_FAILED) << "Cannot map " << path;
+  // the advice values are not flags, so each takes its own call; they are only hints
+  if (sequential && madvise(data, size_, MADV_SEQUENTIAL) != 0) {
+    LOG(WARNING) << "madvise(MADV_SEQUENTIAL) failed on " << path << ": " << strerror(errno);
+  }
+  if (madvise(data, size_, MADV_WILLNEED) != 0) {
+    LOG(WARNING) << "madvise(MADV_WILLNEED) failed on " << path << ": " << strerror(errno);
+  }
+  data_ = static_cast<const char*>(data);
+#endif
+  ICHECK(data_ != nullptr) << "Cannot map " << path;
+}
+
+MappedFile::~MappedFile() {
+#ifdef _WIN32
+  if (data_ != nullptr) UnmapViewOfFile(data_);
+  if (mapping_ != nullptr) CloseHandle(mapping_);
+  if (file_ != nullptr) CloseHandle(file_);
+#else
+  if (data_ != nullptr) munmap(const_cast<char*>(data_), size_);
+  if (fd_ >= 0) close(fd_);
+#endif
+}
+
+}  // namespace llm
+}  // namespace mlc
@@ -0,0 +1,49 @@
+/*!
+ *  Copyright (c) 2023 by Contributors
+ * \file mapped_file.h
+ * \brief Read-only memory mapping of files.
+ */
+#ifndef MLC_LLM_CPP_MAPPED_FILE_H_
+#define MLC_LLM_CPP_MAPPED_FILE_H_
+
+#include <cstddef>
+#include <string>
+
+namespace mlc {
+namespace llm {
+
+/*! \brief A read-only memory mapping of a whole file. */
+class MappedFile {
+ public:
+  /*!
+   * \param path The file to map.
+   * \param sequential Whether the file is read front to back once, which lets the kernel read
+   *  ahead and drop the pages behind.
+   */
+  explicit MappedFile(const std::string& path, bool sequential = true);
+
+  ~MappedFile();
+
+  MappedFile(const MappedFile&) = delete;
+  MappedFile& operator=(const MappedFile&) = delete;
+
+  const char* data() const { return data_; }
+
+  size_t size() const { return size_; }
+
+ private:
+#ifdef _WIN32
+  // the HANDLE of the file and of the mapping
+  void* file_{nullptr};
+  void* mapping_{nullptr};
+#else
+  int fd_{-1};
+#endif
+  const char* data_{nullptr};
+  size_t size_{0};
+};
+
+}  // namespace llm
+}  // namespace mlc
+
+#endif  // MLC_LLM_CPP_MAPPED_FILE_H_
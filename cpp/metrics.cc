@@ -0,0 +1,123 @@
+/*!
+ *  Copyright (c) 2023 by Contributors
+ * \file metrics.cc
+ * \brief Implementation of the latency summaries.
+ */
+#define PICOJSON_USE_INT64
+
+#include "metrics.h"
+
+#include <algorithm>
+#include <cmath>
+#include <numeric>
+
+namespace mlc {
+namespace llm {
+
+double Percentile(const std::vector<double>& sorted_samples, double q) {
+  if (sorted_samples.empty()) return 0;
+  double rank = q / 100.0 * (sorted_samples.size() - 1);
+  size_t lower = static_cast<size_t>(std::floor(rank));
+  size_t upper = std::min(lower + 1, sorted_samples.size() - 1);
+  return sorted_samples[lower] + (rank - lower) * (sorted_samples[upper] - sorted_samples[lower]);
+}
+
+picojson::object SummarizeLatencies(std::vector<double> samples) {
+  std::sort(samples.begin(), samples.end());
+  double mean =
+      samples.empty() ? 0 : std::accumulate(samples.begin(), samples.end(), 0.0) / samples.size();
+  picojson::object summary;
+  summary["count"] = picojson::value(static_cast<int64_t>(samples.size()));
+  summary["mean"] = picojson::value(mean);
+  summary["p50"] = picojson::value(Percentile(samples, 50));
+  summary["p90"] = picojson::value(Percentile(samples, 90));
+  summary["p99"] = picojson::value(Percentile(samples, 99));
+  return summary;
+}
+
+void RuntimeStats::Record(const std::string& phase, Clock::time_point begin,
+                          Clock::time_point end) {
+  double ms = static_cast<double>((end - begin).count()) / 1e6;
+  Phase& stats = phases_[phase];
+  stats.min_ms = stats.count == 0 ? ms : std::min(stats.min_ms, ms);
+  stats.max_ms = stats.count == 0 ? ms : std::max(stats.max_ms, ms);
+  stats.count += 1;
+  stats.total_ms += ms;
+  double us = ms * 1e3;
+  int bucket = us < 1 ? 0 : std::min(static_cast<int>(std::log2(us)), kNumBuckets - 1);
+  stats.buckets[bucket] += 1;
+  if (tracing_ && static_cast<int64_t>(trace_events_.size()) < max_trace_events_) {
+    double ts_us = static_cast<double>((begin - trace_start_).count()) / 1e3;
+    trace_events_.push_back({phase, ts_us, us});
+  }
+}
+
+double RuntimeStats::TotalMs(const std::string& phase) const {
+  auto it = phases_.find(phase);
+  return it == phases_.end() ? 0 : it->second.total_ms;
+}
+
+picojson::object RuntimeStats::AsJSON() const {
+  picojson::object phases;
+  for (const auto& [name, stats] : phases_) {
+    picojson::object phase;
+    phase["count"] = picojson::value(stats.count);
+    phase["total_ms"] = picojson::value(stats.total_ms);
+    phase["mean_ms"] = picojson::value(stats.count ? stats.total_ms / stats.count : 0.0);
+    phase["min_ms"] = picojson::value(stats.min_ms);
+    phase["max_ms"] = picojson::value(stats.max_ms);
+    // the histogram lists the non-empty buckets by their lower bounds
+    picojson::array bounds, counts;
+    for (int i = 0; i < kNumBuckets; ++i) {
+      if (stats.buckets[i] == 0) continue;
+      bounds.push_back(picojson::value(i == 0 ? int64_t(0) : int64_t(1) << i));
+      counts.push_back(picojson::value(stats.buckets[i]));
+    }
+    picojson::object histogram;
+    histogram["lower_bound_us"] = picojson::value(bounds);
+    histogram["count"] = picojson::value(counts);
+    phase["histogram"] = picojson::value(histogram);
+    phases[name] = picojson::value(phase);
+  }
+  picojson::object counters;
+  for (const auto& [name, value] : counters_) {
+    counters[name] = picojson::value(value);
+  }
+  picojson::object ret;
+  ret["phases"] = picojson::value(phases);
+  ret["counters"] = picojson::value(counters);
+  return ret;
+}
+
+void RuntimeStats::Reset() {
+  phases_.clear();
+  counters_.clear();
+}
+
+void RuntimeStats::StartTrace(int64_t max_events) {
+  tracing_ = true;
+  max_trace_events_ = max_events;
+  trace_start_ = Clock::now();
+  trace_events_.clear();
+}
+
+std::string RuntimeStats::TraceJSON() const {
+  picojson::array events;
+  for (const TraceEvent& event : trace_events_) {
+    picojson::object e;
+    e["name"] = picojson::value(event.name);
+    e["ph"] = picojson::value("X");
+    e["ts"] = picojson::value(event.ts_us);
+    e["dur"] = picojson::value(event.dur_us);
+    e["pid"] = picojson::value(int64_t(0));
+    e["tid"] = picojson::value(int64_t(0));
+    events.push_back(picojson::value(e));
+  }
+  picojson::object trace;
+  trace["traceEvents"] = picojson::value(events);
+  trace["displayTimeUnit"] = picojson::value("ms");
+  return picojson::value(trace).serialize();
+}
+
+}  // namespace llm
+}  // namespace mlc
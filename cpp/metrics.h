@@ -0,0 +1,146 @@
+/*!
+ *  Copyright (c) 2023 by Contributors
+ * \file metrics.h
+ * \brief Summaries of latency samples for benchmarks and runtime stats.
+ */
+#ifndef MLC_LLM_CPP_METRICS_H_
+#define MLC_LLM_CPP_METRICS_H_
+
+#include <picojson.h>
+
+#include <chrono>
+#include <cstdint>
+#include <map>
+#include <string>
+#include <vector>
+
+#include "allocation_counter.h"
+
+namespace mlc {
+namespace llm {
+
+/*!
+ * \brief Get the q-th percentile of samples, interpolating between the closest ranks.
+ * \param sorted_samples The samples in ascending order.
+ * \param q The percentile in [0, 100].
+ * \return The percentile, 0 if there is no sample.
+ */
+double Percentile(const std::vector<double>& sorted_samples, double q);
+
+/*!
+ * \brief Summarize latency samples.
+ * \param samples The samples in any order.
+ * \return A JSON object of the "count", "mean", "p50", "p90" and "p99" of the samples, in the
+ *  unit of the samples.
+ */
+picojson::object SummarizeLatencies(std::vector<double> samples);
+
+/*!
+ * \brief Per-phase timings and counters of a runtime, with an optional trace of the phases in
+ *  the Chrome trace event format, which chrome://tracing and Perfetto open.
+ *
+ * Phases that enqueue device work are timed on the host, so they count the launch and
+ * whatever synchronization happens inside them, not the device time.
+ */
+class RuntimeStats {
+ public:
+  using Clock = std::chrono::high_resolution_clock;
+
+  /*! \brief Record that a phase ran from begin to end. */
+  void Record(const std::string& phase, Clock::time_point begin, Clock::time_point end);
+
+  /*! \brief Add value to a counter. */
+  void Count(const std::string& counter, int64_t value) { counters_[counter] += value; }
+
+  /*! \return The value of a counter, 0 if it is not counted. */
+  int64_t Counter(const std::string& counter) const {
+    auto it = counters_.find(counter);
+    return it != counters_.end() ? it->second : 0;
+  }
+
+  /*! \return The total milliseconds spent in a phase. */
+  double TotalMs(const std::string& phase) const;
+
+  /*!
+   * \return A JSON object with the "phases", each with its count, total, mean, min and max
+   *  milliseconds and a histogram of its durations, and the "counters".
+   */
+  picojson::object AsJSON() const;
+
+  /*! \brief Clear the timings and the counters, but not the trace. */
+  void Reset();
+
+  /*!
+   * \brief Start recording a trace of the phases, dropping the previous trace.
+   * \param max_events The number of events to keep, later events are dropped.
+   */
+  void StartTrace(int64_t max_events);
+
+  /*! \brief Stop recording the trace, which keeps the events recorded so far. */
+  void StopTrace() { tracing_ = false; }
+
+  /*! \return The trace as a JSON string in the Chrome trace event format. */
+  std::string TraceJSON() const;
+
+ private:
+  // Durations fall in the histogram bucket i when they are in [2^i, 2^(i+1)) microseconds.
+  static constexpr int kNumBuckets = 32;
+
+  struct Phase {
+    int64_t count{0};
+    double total_ms{0}, min_ms{0}, max_ms{0};
+    std::vector<int64_t> buckets = std::vector<int64_t>(kNumBuckets, 0);
+  };
+
+  struct TraceEvent {
+    std::string name;
+    double ts_us, dur_us;
+  };
+
+  // ordered by name so that the JSON is stable across runs
+  std::map<std::string, Phase> phases_;
+  std::map<std::string, int64_t> counters_;
+  bool tracing_{false};
+  int64_t max_trace_events_{0};
+  Clock::time_point trace_start_;
+  std::vector<TraceEvent> trace_events_;
+};
+
+/*! \brief Record the time from its construction to its destruction as a phase. */
+class PhaseScope {
+ public:
+  PhaseScope(RuntimeStats* stats, const char* phase)
+      : stats_(stats), phase_(phase), begin_(RuntimeStats::Clock::now()) {}
+  ~PhaseScope() { stats_->Record(phase_, begin_, RuntimeStats::Clock::now()); }
+
+ private:
+  RuntimeStats* stats_;
+  const char* phase_;
+  RuntimeStats::Clock::time_point begin_;
+};
+
+/*!
+ * \brief Count the heap allocations of the thread from its construction to its destruction,
+ *  when the library counts them, see ThreadAllocationCount.
+ */
+class AllocationScope {
+ public:
+  AllocationScope(RuntimeStats* stats, const char* counter)
+      : stats_(stats), counter_(counter), begin_(ThreadAllocationCount()) {}
+  ~AllocationScope() {
+    if (begin_ < 0) return;
+    // read before Count, whose first use of a counter allocates its entry
+    int64_t count = ThreadAllocationCount() - begin_;
+    stats_->Count(counter_, count);
+  }
+
+ private:
+  RuntimeStats* stats_;
+  const char* counter_;
+  int64_t begin_;
+};
+
+}  // namespace llm
+}  // namespace mlc
+
+#endif  // MLC_LLM_CPP_METRICS_H_
@@ -0,0 +1,362 @@
+/*!
+ *  Copyright (c) 2023 by Contributors
+ * \file paged_kv_cache.cc
+ * \brief Implementation of the paged KV cache.
+ */
+#include "paged_kv_cache.h"
+
+#include <tvm/runtime/registry.h>
+
+#include <algorithm>
+
+namespace mlc {
+namespace llm {
+
+PagedKVCachePoolObj::PagedKVCachePoolObj(int64_t num_caches, int64_t num_pages, int64_t page_size,
+                                         int64_t max_seq_len, int64_t num_heads, int64_t head_dim,
+                                         DLDataType dtype, DLDevice device)
+    : num_caches_(num_caches),
+      page_size_(page_size),
+      max_seq_len_(max_seq_len),
+      num_heads_(num_heads),
+      head_dim_(head_dim),
+      dtype_(dtype),
+      device_(device) {
+  ICHECK_GT(num_pages, 0) << "The KV cache pool needs at least one page";
+  ICHECK_GT(page_size, 0) << "The KV cache page size must be positive";
+  pages_.reserve(num_caches);
+  for (int64_t i = 0; i < num_caches; ++i) {
+    pages_.push_back(NDArray::Empty({num_pages * page_size, num_heads, head_dim}, dtype, device));
+  }
+  for (int64_t i = 0; i < num_pages; ++i) {
+    free_pages_.push(static_cast<int32_t>(i));
+  }
+}
+
+void PagedKVCachePoolObj::Append(PagedKVSequenceObj* seq, int64_t cache_index,
+                                 const NDArray& value, int64_t value_row, int64_t num_rows) {
+  ICHECK_EQ(value->ndim, 3) << "KV cache append expects a value of shape (n, heads, head_dim)";
+  ICHECK_EQ(value->shape[1], num_heads_);
+  ICHECK_EQ(value->shape[2], head_dim_);
+  ICHECK(value.DataType() == DataType(dtype_)) << "KV cache dtype mismatch";
+  if (num_rows < 0) {
+    num_rows = value->shape[0] - value_row;
+  }
+  ICHECK_LE(value_row + num_rows, value->shape[0]);
+  int64_t fill_count = seq->fill_count[cache_index];
+  ICHECK_LE(fill_count + num_rows, max_seq_len_) << "KV cache exceeds the max sequence length";
+  this->Reserve(seq, fill_count + num_rows);
+  const NDArray& pages = pages_[cache_index];
+  this->ForEachRun(seq, fill_count, num_rows,
+                   [&](int64_t row, int64_t physical_row, int64_t run_rows) {
+                     CopyKVCacheRows(value, value_row + row - fill_count, pages, physical_row,
+                                     run_rows);
+                   });
+  seq->fill_count[cache_index] = fill_count + num_rows;
+}
+
+NDArray PagedKVCachePoolObj::View(PagedKVSequenceObj* seq, int64_t cache_index,
+                                  const ShapeTuple& shape) {
+  int64_t fill_count = seq->fill_count[cache_index];
+  ICHECK_EQ(shape.size(), 3);
+  ICHECK_EQ(shape[0], fill_count) << "Requested shape do not match the filled count";
+  ICHECK_EQ(shape[1], num_heads_);
+  ICHECK_EQ(shape[2], head_dim_);
+  NDArray& view = views_[cache_index % 2];
+  if (!view.defined()) {
+    view = NDArray::Empty({max_seq_len_, num_heads_, head_dim_}, dtype_, device_);
+  }
+  const NDArray& pages = pages_[cache_index];
+  this->ForEachRun(seq, 0, fill_count, [&](int64_t row, int64_t physical_row, int64_t run_rows) {
+    CopyKVCacheRows(pages, physical_row, view, row, run_rows);
+  });
+  return view.CreateView(shape, dtype_);
+}
+
+NDArray PagedKVCachePoolObj::Rows(PagedKVSequenceObj* seq, int64_t num_rows) {
+  ICHECK_LE(num_rows, static_cast<int64_t>(seq->page_table.size()) * page_size_)
+      << "The row table is requested beyond the pages of the sequence";
+  if (!seq->row_table.defined()) {
+    seq->row_table = NDArray::Empty({max_seq_len_}, DataType::Int(32), device_);
+    seq->host_row_table.resize(max_seq_len_);
+  }
+  int64_t begin = seq->num_uploaded_rows;
+  if (begin < num_rows) {
+    for (int64_t row = begin; row < num_rows; ++row) {
+      seq->host_row_table[row] =
+          static_cast<int32_t>(seq->page_table[row / page_size_] * page_size_ + row % page_size_);
+    }
+    int64_t shape[1] = {num_rows - begin};
+    DLTensor from = *seq->row_table.operator->();
+    from.data = seq->host_row_table.data() + begin;
+    from.device = DLDevice{kDLCPU, 0};
+    from.shape = shape;
+    from.strides = nullptr;
+    from.byte_offset = 0;
+    DLTensor to = *seq->row_table.operator->();
+    to.shape = shape;
+    to.strides = nullptr;
+    to.byte_offset += begin * sizeof(int32_t);
+    NDArray::CopyFromTo(&from, &to);
+    seq->num_uploaded_rows = num_rows;
+  }
+  return seq->row_table.CreateView({num_rows}, DataType::Int(32));
+}
+
+bool PagedKVCachePoolObj::TryReserve(PagedKVSequenceObj* seq, int64_t num_rows) {
+  ICHECK_LE(num_rows, max_seq_len_) << "KV cache exceeds the max sequence length";
+  int64_t num_new_pages = this->NumPagesFor(num_rows) - seq->page_table.size();
+  if (num_new_pages > this->NumFreePages()) return false;
+  this->Reserve(seq, num_rows);
+  seq->num_reserved_rows = std::max(seq->num_reserved_rows, num_rows);
+  return true;
+}
+
+void PagedKVCachePoolObj::Reset(PagedKVSequenceObj* seq) {
+  for (int32_t page : seq->page_table) {
+    free_pages_.push(page);
+  }
+  seq->page_table.clear();
+  std::fill(seq->fill_count.begin(), seq->fill_count.end(), 0);
+  seq->num_reserved_rows = 0;
+  seq->num_uploaded_rows = 0;
+}
+
+void PagedKVCachePoolObj::Truncate(PagedKVSequenceObj* seq, int64_t cache_index,
+                                   int64_t num_rows) {
+  ICHECK_LE(num_rows, seq->fill_count[cache_index]) << "Cannot truncate a KV cache to grow it";
+  seq->fill_count[cache_index] = num_rows;
+  int64_t max_fill_count = *std::max_element(seq->fill_count.begin(), seq->fill_count.end());
+  int64_t num_used_pages = this->NumPagesFor(std::max(max_fill_count, seq->num_reserved_rows));
+  while (static_cast<int64_t>(seq->page_table.size()) > num_used_pages) {
+    free_pages_.push(seq->page_table.back());
+    seq->page_table.pop_back();
+  }
+  // the rows of the kept pages stay valid in the row table
+  seq->num_uploaded_rows =
+      std::min(seq->num_uploaded_rows, static_cast<int64_t>(seq->page_table.size()) * page_size_);
+}
+
+int64_t PagedKVCachePoolObj::NumBytes() const {
+  int64_t nbytes = 0;
+  for (const NDArray& pages : pages_) {
+    nbytes += GetDataSize(*pages.operator->());
+  }
+  return nbytes;
+}
+
+void PagedKVCachePoolObj::Reserve(PagedKVSequenceObj* seq, int64_t num_rows) {
+  while (static_cast<int64_t>(seq->page_table.size()) * page_size_ < num_rows) {
+    ICHECK(!free_pages_.empty()) << "The KV cache pool runs out of pages, please increase "
+                                    "\"kv_cache_num_pages\" in mlc-chat-config.json";
+    seq->page_table.push_back(free_pages_.top());
+    free_pages_.pop();
+  }
+}
+
+void PagedKVCachePoolObj::ForEachRun(
+    const PagedKVSequenceObj* seq, int64_t begin, int64_t num_rows,
+    const std::function<void(int64_t, int64_t, int64_t)>& f) const {
+  int64_t row = begin;
+  int64_t end = begin + num_rows;
+  while (row < end) {
+    int64_t physical_row = seq->page_table[row / page_size_] * page_size_ + row % page_size_;
+    int64_t run_rows = std::min(page_size_ - row % page_size_, end - row);
+    // extend the run while the next page follows the current one in the pool
+    while (row + run_rows < end &&
+           seq->page_table[(row + run_rows) / page_size_] * page_size_ ==
+               physical_row + run_rows) {
+      run_rows += std::min(page_size_, end - row - run_rows);
+    }
+    f(row, physical_row, run_rows);
+    row += run_rows;
+  }
+}
+
+void CopyKVCacheRows(const NDArray& src, int64_t src_row, const NDArray& dst, int64_t dst_row,
+                     int64_t num_rows) {
+  if (num_rows == 0) return;
+  DLDataType dtype = src->dtype;
+  int64_t row_bytes = src->shape[1] * src->shape[2] * ((dtype.bits * dtype.lanes + 7) / 8);
+  int64_t shape[3] = {num_rows, src->shape[1], src->shape[2]};
+  DLTensor from = *src.operator->();
+  from.shape = shape;
+  from.strides = nullptr;
+  from.byte_offset += src_row * row_bytes;
+  DLTensor to = *dst.operator->();
+  to.shape = shape;
+  to.strides = nullptr;
+  to.byte_offset += dst_row * row_bytes;
+  NDArray::CopyFromTo(&from, &to);
+}
+
+namespace {
+
+/*!
+ * \brief Upload host int32 values to a device array, growing the array if it is too small.
+ * \param values The values, which must not change until the copy is done.
+ * \param storage The device array.
+ * \param device The device of the array.
+ * \param shape The shape of the result, whose size is the number of values.
+ * \return The values on the device, a view of storage.
+ */
+NDArray UploadInt32(const std::vector<int32_t>& values, NDArray* storage, DLDevice device,
+                    ShapeTuple shape) {
+  int64_t size = values.size();
+  if (!storage->defined() || (*storage)->shape[0] < size) {
+    *storage = NDArray::Empty({std::max<int64_t>(size, 64)}, DataType::Int(32), device);
+  }
+  int64_t flat_shape[1] = {size};
+  DLTensor from = *storage->operator->();
+  from.data = const_cast<int32_t*>(values.data());
+  from.device = DLDevice{kDLCPU, 0};
+  from.shape = flat_shape;
+  from.strides = nullptr;
+  from.byte_offset = 0;
+  DLTensor to = *storage->operator->();
+  to.shape = flat_shape;
+  to.strides = nullptr;
+  NDArray::CopyFromTo(&from, &to);
+  return storage->CreateView(shape, DataType::Int(32));
+}
+
+}  // namespace
+
+PagedKVCachePool PagedKVCachePoolObj::CreateLike(int64_t num_pages) const {
+  return PagedKVCachePool(num_caches_, num_pages, page_size_, max_seq_len_, num_heads_, head_dim_,
+                          dtype_, device_);
+}
+
+PagedKVCachePool::PagedKVCachePool(int64_t num_caches, int64_t num_pages, int64_t page_size,
+                                   int64_t max_seq_len, int64_t num_heads, int64_t head_dim,
+                                   DLDataType dtype, DLDevice device) {
+  data_ = make_object<PagedKVCachePoolObj>(num_caches, num_pages, page_size, max_seq_len,
+                                           num_heads, head_dim, dtype, device);
+}
+
+Array<ObjectRef> PagedKVCachePool::CreateSequence() const {
+  ObjectPtr<PagedKVSequenceObj> seq = make_object<PagedKVSequenceObj>();
+  seq->pool = *this;
+  seq->fill_count.resize((*this)->num_caches(), 0);
+  PagedKVSequence seq_ref(seq);
+  Array<ObjectRef> caches;
+  for (int64_t i = 0; i < (*this)->num_caches(); ++i) {
+    ObjectPtr<PagedKVCacheObj> cache = make_object<PagedKVCacheObj>();
+    cache->seq = seq_ref;
+    cache->cache_index = i;
+    caches.push_back(PagedKVCache(cache));
+  }
+  return caches;
+}
+
+PagedKVBatch::PagedKVBatch(PagedKVCachePool pool) {
+  ObjectPtr<PagedKVBatchObj> n = make_object<PagedKVBatchObj>();
+  n->pool = std::move(pool);
+  data_ = std::move(n);
+}
+
+void PagedKVBatch::Prepare(std::vector<PagedKVSequence> seqs,
+                           const std::vector<int32_t>& input_ids) {
+  PagedKVBatchObj* batch = (*this).operator->();
+  int64_t batch_size = seqs.size();
+  int64_t page_size = batch->pool->page_size();
+  ICHECK_GT(batch_size, 0);
+  ICHECK_EQ(input_ids.size(), seqs.size());
+  int64_t max_len = 0;
+  batch->host_lengths_.resize(batch_size);
+  for (int64_t i = 0; i < batch_size; ++i) {
+    const PagedKVSequenceObj* seq = seqs[i].operator->();
+    ICHECK(seq->pool.same_as(batch->pool)) << "The sequences of a batch share one pool";
+    int64_t length = seq->fill_count[0] + 1;
+    ICHECK_LE(length, static_cast<int64_t>(seq->page_table.size()) * page_size)
+        << "The pages of the next row of a batched sequence are not reserved";
+    batch->host_lengths_[i] = static_cast<int32_t>(length);
+    max_len = std::max(max_len, length);
+  }
+  // the rows after the end of a sequence are masked out, and point to row 0 of the pages
+  batch->host_rows_.assign(batch_size * max_len, 0);
+  for (int64_t i = 0; i < batch_size; ++i) {
+    const PagedKVSequenceObj* seq = seqs[i].operator->();
+    int32_t* rows = batch->host_rows_.data() + i * max_len;
+    for (int64_t row = 0; row < batch->host_lengths_[i]; ++row) {
+      rows[row] = static_cast<int32_t>(seq->page_table[row / page_size] * page_size +
+                                       row % page_size);
+    }
+  }
+  batch->host_input_ids_ = input_ids;
+  DLDevice device = batch->pool->Pages(0)->device;
+  batch->input_ids = UploadInt32(batch->host_input_ids_, &batch->input_ids_storage_, device,
+                                 ShapeTuple({batch_size, 1}));
+  batch->rows = UploadInt32(batch->host_rows_, &batch->rows_storage_, device,
+                            ShapeTuple({batch_size, max_len}));
+  batch->lengths = UploadInt32(batch->host_lengths_, &batch->lengths_storage_, device,
+                               ShapeTuple({batch_size}));
+  batch->seqs = std::move(seqs);
+}
+
+Array<ObjectRef> PagedKVBatch::CreateCaches() const {
+  Array<ObjectRef> caches;
+  for (int64_t i = 0; i < (*this)->pool->num_caches(); ++i) {
+    ObjectPtr<PagedKVBatchCacheObj> cache = make_object<PagedKVBatchCacheObj>();
+    cache->batch = *this;
+    cache->cache_index = i;
+    caches.push_back(PagedKVBatchCache(cache));
+  }
+  return caches;
+}
+
+void PagedKVCacheArrayClear(const Array<ObjectRef>& caches) {
+  if (caches.empty()) return;
+  // all caches of a sequence share the page table
+  PagedKVSequence seq = Downcast<PagedKVCache>(caches[0])->seq;
+  seq->pool->Reset(seq.operator->());
+}
+
+TVM_REGISTER_OBJECT_TYPE(PagedKVCachePoolObj);
+TVM_REGISTER_OBJECT_TYPE(PagedKVSequenceObj);
+TVM_REGISTER_OBJECT_TYPE(PagedKVCacheObj);
+TVM_REGISTER_OBJECT_TYPE(PagedKVBatchObj);
+TVM_REGISTER_OBJECT_TYPE(PagedKVBatchCacheObj);
+
+TVM_REGISTER_GLOBAL("mlc.paged_kv_cache_append")
+    .set_body_typed([](PagedKVCache cache, NDArray value) {
+      cache->seq->pool->Append(cache->seq.operator->(), cache->cache_index, value);
+      return cache;
+    });
+
+TVM_REGISTER_GLOBAL("mlc.paged_kv_cache_view")
+    .set_body_typed([](PagedKVCache cache, ShapeTuple shape) {
+      return cache->seq->pool->View(cache->seq.operator->(), cache->cache_index, shape);
+    });
+
+TVM_REGISTER_GLOBAL("mlc.paged_kv_cache_pages").set_body_typed([](PagedKVCache cache) {
+  return cache->seq->pool->Pages(cache->cache_index);
+});
+
+TVM_REGISTER_GLOBAL("mlc.paged_kv_cache_rows")
+    .set_body_typed([](PagedKVCache cache, ShapeTuple shape) {
+      ICHECK_EQ(shape.size(), 1);
+      ICHECK_EQ(shape[0], cache->seq->fill_count[cache->cache_index])
+          << "Requested rows do not match the filled count";
+      return cache->seq->pool->Rows(cache->seq.operator->(), shape[0]);
+    });
+
+TVM_REGISTER_GLOBAL("mlc.paged_kv_cache_batch_append")
+    .set_body_typed([](PagedKVBatchCache cache, NDArray values) {
+      // row i of the values is the new row of sequence i
+      const PagedKVBatchObj* batch = cache->batch.operator->();
+      ICHECK_EQ(values->shape[0], static_cast<int64_t>(batch->seqs.size()));
+      for (size_t i = 0; i < batch->seqs.size(); ++i) {
+        batch->pool->Append(batch->seqs[i].operator->(), cache->cache_index, values, i, 1);
+      }
+      return cache;
+    });
+
+TVM_REGISTER_GLOBAL("mlc.paged_kv_cache_batch_pages").set_body_typed([](PagedKVBatchCache cache) {
+  return cache->batch->pool->Pages(cache->cache_index);
+});
+
+TVM_REGISTER_GLOBAL("mlc.paged_kv_cache_array_clear").set_body_typed(PagedKVCacheArrayClear);
+
+}  // namespace llm
+}  // namespace mlc
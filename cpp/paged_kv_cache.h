@@ -0,0 +1,295 @@
+/*!
+ *  Copyright (c) 2023 by Contributors
+ * \file paged_kv_cache.h
+ * \brief Paged KV cache shared by many sequences.
+ *
+ * Models built with `--use-paged-kv-cache` call `mlc.paged_kv_cache_append` in place of
+ * `vm.builtin.attention_kv_cache_append`, passing the handles created by
+ * PagedKVCachePool::CreateSequence. Their attention reads the pages directly, through the
+ * row table returned by `mlc.paged_kv_cache_rows`.
+ */
+#ifndef MLC_LLM_CPP_PAGED_KV_CACHE_H_
+#define MLC_LLM_CPP_PAGED_KV_CACHE_H_
+
+#include <tvm/runtime/container/array.h>
+#include <tvm/runtime/container/shape_tuple.h>
+#include <tvm/runtime/ndarray.h>
+#include <tvm/runtime/object.h>
+
+#include <functional>
+#include <queue>
+#include <vector>
+
+namespace mlc {
+namespace llm {
+
+using namespace tvm::runtime;
+
+class PagedKVCachePool;
+class PagedKVSequenceObj;
+
+/*!
+ * \brief A pool of fixed-size KV cache pages shared by many sequences.
+ *
+ * Each cache (the key or the value of one layer) stores its pages in one array
+ * of shape (num_pages * page_size, num_heads, head_dim), and a page index
+ * addresses the same rows in all caches. Sequences take pages from a common
+ * free list as they grow and give them back when they are reset, so the pool
+ * is allocated once and never fragments.
+ */
+class PagedKVCachePoolObj : public Object {
+ public:
+  /*!
+   * \param num_caches The number of caches, which is twice the number of layers.
+   * \param num_pages The number of pages in the pool.
+   * \param page_size The number of tokens in a page.
+   * \param max_seq_len The maximum length of a sequence.
+   * \param num_heads The number of attention heads.
+   * \param head_dim The dimension of each head.
+   * \param dtype The data type of the cache.
+   * \param device The device of the cache.
+   */
+  PagedKVCachePoolObj(int64_t num_caches, int64_t num_pages, int64_t page_size,
+                      int64_t max_seq_len, int64_t num_heads, int64_t head_dim, DLDataType dtype,
+                      DLDevice device);
+
+  /*!
+   * \brief Write rows of value, of shape (n, num_heads, head_dim), after the filled rows of a
+   *  cache.
+   * \param value_row The first row of value to write.
+   * \param num_rows The number of rows to write, all rows from value_row if negative.
+   */
+  void Append(PagedKVSequenceObj* seq, int64_t cache_index, const NDArray& value,
+              int64_t value_row = 0, int64_t num_rows = -1);
+
+  /*!
+   * \brief Gather the filled rows of a cache into a contiguous array. It copies the whole
+   *  sequence, so the runtime only uses it outside of the forward passes.
+   */
+  NDArray View(PagedKVSequenceObj* seq, int64_t cache_index, const ShapeTuple& shape);
+
+  /*!
+   * \brief Get the rows of the pages that hold the first num_rows rows of a sequence.
+   *
+   * The row table is kept on the device between calls, and only the rows that are new since
+   * the previous call are uploaded, so a decode step uploads at most one row. Row i of every
+   * cache of the sequence is row table[i] of the page arrays.
+   * \return The int32 row table of shape (num_rows,).
+   */
+  NDArray Rows(PagedKVSequenceObj* seq, int64_t num_rows);
+
+  /*!
+   * \brief Make sure the sequence has pages for num_rows rows, without failing when the pool
+   *  does not have enough free pages. The pages are kept until the sequence is reset.
+   * \return Whether the pages are reserved. Nothing is taken from the pool if not.
+   */
+  bool TryReserve(PagedKVSequenceObj* seq, int64_t num_rows);
+
+  /*! \brief Give all pages of a sequence back to the pool. */
+  void Reset(PagedKVSequenceObj* seq);
+
+  /*!
+   * \brief Keep the first num_rows rows of a cache, and give back the pages that no cache of
+   *  the sequence uses any more.
+   */
+  void Truncate(PagedKVSequenceObj* seq, int64_t cache_index, int64_t num_rows);
+
+  /*! \return The number of pages that are not used by any sequence. */
+  int64_t NumFreePages() const { return free_pages_.size(); }
+
+  /*! \return The number of pages in the pool. */
+  int64_t NumPages() const { return pages_[0]->shape[0] / page_size_; }
+
+  /*! \return The number of pages to hold num_rows rows. */
+  int64_t NumPagesFor(int64_t num_rows) const { return (num_rows + page_size_ - 1) / page_size_; }
+
+  /*! \return The bytes of the pages of all caches. */
+  int64_t NumBytes() const;
+
+  int64_t num_caches() const { return num_caches_; }
+
+  int64_t page_size() const { return page_size_; }
+
+  /*! \return An empty pool with the layout of this pool and another number of pages. */
+  PagedKVCachePool CreateLike(int64_t num_pages) const;
+
+  /*! \return The page array of a cache, of shape (num_pages * page_size, num_heads, head_dim). */
+  const NDArray& Pages(int64_t cache_index) const { return pages_[cache_index]; }
+
+  static constexpr const char* _type_key = "mlc.PagedKVCachePool";
+  TVM_DECLARE_FINAL_OBJECT_INFO(PagedKVCachePoolObj, Object);
+
+ private:
+  // Make sure the sequence has pages for num_rows rows.
+  void Reserve(PagedKVSequenceObj* seq, int64_t num_rows);
+
+  // Call f(row, physical_row, num_rows) for the runs of physically contiguous
+  // rows that cover rows [begin, begin + num_rows) of the sequence.
+  void ForEachRun(const PagedKVSequenceObj* seq, int64_t begin, int64_t num_rows,
+                  const std::function<void(int64_t, int64_t, int64_t)>& f) const;
+
+  int64_t num_caches_;
+  int64_t page_size_;
+  int64_t max_seq_len_;
+  int64_t num_heads_;
+  int64_t head_dim_;
+  DLDataType dtype_;
+  DLDevice device_;
+  // The page array of each cache.
+  std::vector<NDArray> pages_;
+  // The contiguous views of the key and the value caches, shared by all layers and sequences.
+  // Reusing them is safe because the runtime reads one view at a time on the same stream.
+  NDArray views_[2];
+  // The free pages, the lowest index is taken first to keep sequences contiguous.
+  std::priority_queue<int32_t, std::vector<int32_t>, std::greater<int32_t>> free_pages_;
+};
+
+class PagedKVCachePool : public ObjectRef {
+ public:
+  PagedKVCachePool(int64_t num_caches, int64_t num_pages, int64_t page_size, int64_t max_seq_len,
+                   int64_t num_heads, int64_t head_dim, DLDataType dtype, DLDevice device);
+
+  /*!
+   * \brief Create the caches of a new sequence, which are passed to the model as its KV cache.
+   * \return The array of PagedKVCache, one per cache.
+   */
+  Array<ObjectRef> CreateSequence() const;
+
+  TVM_DEFINE_MUTABLE_OBJECT_REF_METHODS(PagedKVCachePool, ObjectRef, PagedKVCachePoolObj);
+};
+
+/*! \brief The page table of one sequence in a pool. */
+class PagedKVSequenceObj : public Object {
+ public:
+  ~PagedKVSequenceObj() { pool->Reset(this); }
+
+  // The pool that owns the pages.
+  PagedKVCachePool pool;
+  // The pages of the sequence, in order.
+  std::vector<int32_t> page_table;
+  // The number of filled rows of each cache.
+  std::vector<int64_t> fill_count;
+  // The number of rows kept by TryReserve, whose pages are not given back by Truncate.
+  int64_t num_reserved_rows = 0;
+  // The row table on the device, and its first num_uploaded_rows rows on the host.
+  NDArray row_table{nullptr};
+  std::vector<int32_t> host_row_table;
+  int64_t num_uploaded_rows = 0;
+
+  static constexpr const char* _type_key = "mlc.PagedKVSequence";
+  TVM_DECLARE_FINAL_OBJECT_INFO(PagedKVSequenceObj, Object);
+};
+
+class PagedKVSequence : public ObjectRef {
+ public:
+  TVM_DEFINE_MUTABLE_OBJECT_REF_METHODS(PagedKVSequence, ObjectRef, PagedKVSequenceObj);
+};
+
+/*! \brief One cache of a sequence, used by the model in place of an attention kv cache. */
+class PagedKVCacheObj : public Object {
+ public:
+  // The sequence the cache belongs to.
+  PagedKVSequence seq;
+  // The index of the cache in the pool.
+  int64_t cache_index;
+
+  static constexpr const char* _type_key = "mlc.PagedKVCache";
+  TVM_DECLARE_FINAL_OBJECT_INFO(PagedKVCacheObj, Object);
+};
+
+class PagedKVCache : public ObjectRef {
+ public:
+  TVM_DEFINE_MUTABLE_OBJECT_REF_METHODS(PagedKVCache, ObjectRef, PagedKVCacheObj);
+};
+
+/*!
+ * \brief Sequences of one pool that a batched decode step grows by one row each.
+ *
+ * The model function `decoding_batch` takes the inputs set by Prepare and the caches created
+ * by CreateCaches. It appends the new row of every sequence with
+ * `mlc.paged_kv_cache_batch_append`, and reads the pages with
+ * `mlc.paged_kv_cache_batch_pages` through the row table of the batch.
+ */
+class PagedKVBatchObj : public Object {
+ public:
+  // The pool of the sequences.
+  PagedKVCachePool pool{nullptr};
+  // The sequences of the current step, in batch order.
+  std::vector<PagedKVSequence> seqs;
+  // The inputs of the current step on the device: the new token of each sequence of shape
+  // (batch, 1), the row table of shape (batch, max_len) after the new rows, and the length
+  // of each sequence after the new rows.
+  NDArray input_ids{nullptr};
+  NDArray rows{nullptr};
+  NDArray lengths{nullptr};
+
+  static constexpr const char* _type_key = "mlc.PagedKVBatch";
+  TVM_DECLARE_FINAL_OBJECT_INFO(PagedKVBatchObj, Object);
+
+ private:
+  friend class PagedKVBatch;
+  // The device arrays the inputs are views of, and their contents on the host.
+  NDArray input_ids_storage_{nullptr};
+  NDArray rows_storage_{nullptr};
+  NDArray lengths_storage_{nullptr};
+  std::vector<int32_t> host_input_ids_;
+  std::vector<int32_t> host_rows_;
+  std::vector<int32_t> host_lengths_;
+};
+
+class PagedKVBatch : public ObjectRef {
+ public:
+  explicit PagedKVBatch(PagedKVCachePool pool);
+
+  /*!
+   * \brief Set the sequences of a decode step and upload its inputs. Each sequence must have
+   *  the page of its next row, which the engine reserves on admission.
+   * \param seqs The sequences, whose caches all hold the same number of rows.
+   * \param input_ids The new token of each sequence.
+   */
+  void Prepare(std::vector<PagedKVSequence> seqs, const std::vector<int32_t>& input_ids);
+
+  /*! \return The caches of the batch to pass to the model, one per cache of the pool. */
+  Array<ObjectRef> CreateCaches() const;
+
+  TVM_DEFINE_MUTABLE_OBJECT_REF_METHODS(PagedKVBatch, ObjectRef, PagedKVBatchObj);
+};
+
+/*! \brief One cache of all sequences of a batch, used by the batched decode of the model. */
+class PagedKVBatchCacheObj : public Object {
+ public:
+  // The batch the cache belongs to.
+  PagedKVBatch batch;
+  // The index of the cache in the pool.
+  int64_t cache_index;
+
+  static constexpr const char* _type_key = "mlc.PagedKVBatchCache";
+  TVM_DECLARE_FINAL_OBJECT_INFO(PagedKVBatchCacheObj, Object);
+};
+
+class PagedKVBatchCache : public ObjectRef {
+ public:
+  TVM_DEFINE_MUTABLE_OBJECT_REF_METHODS(PagedKVBatchCache, ObjectRef, PagedKVBatchCacheObj);
+};
+
+/*!
+ * \brief Copy num_rows rows from src to dst, both of shape (n, num_heads, head_dim).
+ * \param src The array to copy from.
+ * \param src_row The first row to copy in src.
+ * \param dst The array to copy to.
+ * \param dst_row The first row to write in dst.
+ * \param num_rows The number of rows to copy.
+ */
+void CopyKVCacheRows(const NDArray& src, int64_t src_row, const NDArray& dst, int64_t dst_row,
+                     int64_t num_rows);
+
+/*!
+ * \brief Clear the caches of a sequence and give its pages back to the pool.
+ * \param caches The caches created by PagedKVCachePool::CreateSequence.
+ */
+void PagedKVCacheArrayClear(const Array<ObjectRef>& caches);
+
+}  // namespace llm
+}  // namespace mlc
+
+#endif  // MLC_LLM_CPP_PAGED_KV_CACHE_H_
@@ -0,0 +1,241 @@
+/*!
+ *  Copyright (c) 2023 by Contributors
+ * \file param_loader.cc
+ * \brief Implementation of the memory-mapped param loader.
+ */
+#define PICOJSON_USE_INT64
+
+#include "param_loader.h"
+
+#include <picojson.h>
+#include <tvm/runtime/device_api.h>
+#include <tvm/runtime/registry.h>
+
+#include <algorithm>
+#include <atomic>
+#include <cstring>
+#include <fstream>
+#include <future>
+#include <mutex>
+#include <sstream>
+#include <thread>
+#include <vector>
+
+#include "mapped_file.h"
+
+namespace mlc {
+namespace llm {
+
+namespace {
+
+// The maximum number of threads uploading shards at the same time.
+constexpr size_t kMaxUploadWorkers = 4;
+
+/*! \brief Copies host bytes to a device, staging them in pinned memory when it helps. */
+class ParamUploader {
+ public:
+  explicit ParamUploader(DLDevice device) : device_(device) {
+    // Copies from pageable memory go through a small driver buffer on CUDA and ROCm,
+    // staging in large pinned buffers lets each copy run at the full bus bandwidth.
+    DLDevice host{kDLCPU, 0};
+    if (device.device_type == kDLCUDA) {
+      host.device_type = kDLCUDAHost;
+    } else if (device.device_type == kDLROCM) {
+      host.device_type = kDLROCMHost;
+    } else {
+      return;
+    }
+    for (NDArray& staging : staging_) {
+      staging = NDArray::Empty({kStagingBytes}, DataType::UInt(8), host);
+    }
+    stream_ = DeviceAPI::Get(device)->CreateStream(device);
+  }
+
+  ~ParamUploader() {
+    if (stream_ != nullptr) {
+      DeviceAPI::Get(device_)->StreamSync(device_, stream_);
+      DeviceAPI::Get(device_)->FreeStream(device_, stream_);
+    }
+  }
+
+  ParamUploader(const ParamUploader&) = delete;
+  ParamUploader& operator=(const ParamUploader&) = delete;
+
+  /*! \return Whether the copies of the uploader can run concurrently with other uploaders. */
+  bool UsesOwnStream() const { return stream_ != nullptr; }
+
+  /*!
+   * \brief Enqueue copying nbytes from data to the beginning of param.
+   * \note The copy may still be running when the call returns, call Sync to wait for it.
+   */
+  void Upload(const char* data, int64_t nbytes, NDArray param) {
+    if (stream_ == nullptr) {
+      param.CopyFromBytes(data, nbytes);
+      return;
+    }
+    for (int64_t offset = 0; offset < nbytes; offset += kStagingBytes) {
+      int64_t chunk = std::min(kStagingBytes, nbytes - offset);
+      // Fill one buffer while the copy from the other one runs. The buffer is free again
+      // once the copy issued before the previous one is done, which the sync below ensures.
+      const NDArray& staging = staging_[next_staging_];
+      std::memcpy(staging->data, data + offset, chunk);
+      DeviceAPI::Get(device_)->StreamSync(device_, stream_);
+      int64_t shape[1] = {chunk};
+      DLTensor from = *staging.operator->();
+      from.shape = shape;
+      DLTensor to = *param.operator->();
+      to.ndim = 1;
+      to.dtype = from.dtype;
+      to.shape = shape;
+      to.strides = nullptr;
+      to.byte_offset += offset;
+      NDArray::CopyFromTo(&from, &to, stream_);
+      next_staging_ = 1 - next_staging_;
+    }
+  }
+
+  /*! \brief Wait for the enqueued copies. */
+  void Sync() {
+    if (stream_ != nullptr) {
+      DeviceAPI::Get(device_)->StreamSync(device_, stream_);
+    }
+  }
+
+ private:
+  static constexpr int64_t kStagingBytes = 32 << 20;
+
+  DLDevice device_;
+  NDArray staging_[2];
+  int next_staging_{0};
+  TVMStreamHandle stream_{nullptr};
+};
+
+picojson::object ReadNDArrayCacheJSON(const std::string& model_path) {
+  std::ifstream json_istream((model_path + "/ndarray-cache.json").c_str());
+  ICHECK(json_istream) << "Cannot find ndarray-cache.json in " << model_path;
+  std::ostringstream json_ostream;
+  json_ostream << json_istream.rdbuf();
+  picojson::value json_info;
+  std::string err = picojson::parse(json_info, json_ostream.str());
+  ICHECK(err.empty()) << "Cannot parse ndarray-cache.json: " << err;
+  return json_info.get<picojson::object>();
+}
+
+bool IsRawCache(const picojson::array& shards) {
+  for (const picojson::value& shard : shards) {
+    for (const picojson::value& record :
+         shard.get<picojson::object>().at("records").get<picojson::array>()) {
+      if (record.get<picojson::object>().at("format").get<std::string>() != "raw") {
+        return false;
+      }
+    }
+  }
+  return true;
+}
+
+/*! \brief Upload the params in a shard into params, indexed by their names. */
+void UploadShard(const std::string& model_path, const picojson::object& shard,
+                 ParamUploader* uploader, DLDevice device, std::vector<NDArray>* params) {
+  MappedFile file(model_path + "/" + shard.at("dataPath").get<std::string>());
+  for (const picojson::value& record_value : shard.at("records").get<picojson::array>()) {
+    const picojson::object& record = record_value.get<picojson::object>();
+    const std::string& name = record.at("name").get<std::string>();
+    // params are named param_0, param_1, ...
+    ICHECK_EQ(name.compare(0, 6, "param_"), 0) << "Unexpected param name " << name;
+    int64_t index = std::stoll(name.substr(6));
+    ICHECK(index >= 0 && index < static_cast<int64_t>(params->size()))
+        << "Param index out of range: " << name;
+    std::vector<int64_t> shape;
+    for (const picojson::value& dim : record.at("shape").get<picojson::array>()) {
+      shape.push_back(dim.get<int64_t>());
+    }
+    int64_t nbytes = record.at("nbytes").get<int64_t>();
+    int64_t byte_offset = record.at("byteOffset").get<int64_t>();
+    ICHECK_LE(byte_offset + nbytes, static_cast<int64_t>(file.size()))
+        << "Param " << name << " is out of the shard";
+    NDArray param = NDArray::Empty(
+        ShapeTuple(shape), String2DLDataType(record.at("dtype").get<std::string>()), device);
+    uploader->Upload(file.data() + byte_offset, nbytes, param);
+    (*params)[index] = param;
+  }
+  // the mapping must outlive the copies from it
+  uploader->Sync();
+}
+
+}  // namespace
+
+Array<NDArray> LoadParamsFromNDArrayCache(const std::string& model_path, DLDevice device) {
+  // The builtin cache is global and names the params of every model "param_*", so the load is
+  // serialized and the cache is emptied as soon as the params are taken out. The params then
+  // belong to the caller alone and models loaded one after another do not see each other.
+  static std::mutex cache_mutex;
+  std::lock_guard<std::mutex> lock(cache_mutex);
+  const PackedFunc* fload_cache = tvm::runtime::Registry::Get("vm.builtin.ndarray_cache.load");
+  ICHECK(fload_cache) << "TVM runtime cannot find vm.builtin.ndarray_cache.load";
+  const PackedFunc* fload_params =
+      tvm::runtime::Registry::Get("vm.builtin.param_array_from_cache");
+  ICHECK(fload_params) << "Cannot find env function vm.builtin.param_array_from_cache";
+  const PackedFunc* fclear_cache = tvm::runtime::Registry::Get("vm.builtin.ndarray_cache.clear");
+  ICHECK(fclear_cache) << "TVM runtime cannot find vm.builtin.ndarray_cache.clear";
+  (*fclear_cache)();
+  (*fload_cache)(model_path, static_cast<int32_t>(device.device_type), device.device_id);
+  Array<NDArray> params = (*fload_params)("param", -1);
+  (*fclear_cache)();
+  return params;
+}
+
+Array<NDArray> LoadParams(const std::string& model_path, DLDevice device) {
+  picojson::object cache = ReadNDArrayCacheJSON(model_path);
+  const picojson::array& shards = cache.at("records").get<picojson::array>();
+  if (!IsRawCache(shards)) {
+    return LoadParamsFromNDArrayCache(model_path, device);
+  }
+  int64_t num_params =
+      cache.at("metadata").get<picojson::object>().at("ParamSize").get<int64_t>();
+  std::vector<NDArray> params(num_params, NDArray(nullptr));
+
+  // Each worker maps and uploads whole shards, so the page faults of one shard overlap with
+  // the copies of the others. Devices without a copy stream of their own upload on one thread.
+  auto fworker = [&](std::atomic<size_t>* next_shard, ParamUploader* uploader) {
+    for (size_t i = (*next_shard)++; i < shards.size(); i = (*next_shard)++) {
+      UploadShard(model_path, shards[i].get<picojson::object>(), uploader, device, &params);
+    }
+  };
+  std::atomic<size_t> next_shard{0};
+  ParamUploader uploader(device);
+  size_t num_workers = 1;
+  if (uploader.UsesOwnStream()) {
+    num_workers = std::min<size_t>({kMaxUploadWorkers, shards.size(),
+                                    std::max(1u, std::thread::hardware_concurrency())});
+  }
+  std::vector<std::future<void>> workers;
+  for (size_t i = 1; i < num_workers; ++i) {
+    workers.push_back(std::async(std::launch::async, [&]() {
+      ParamUploader worker_uploader(device);
+      fworker(&next_shard, &worker_uploader);
+    }));
+  }
+  fworker(&next_shard, &uploader);
+  for (std::future<void>& worker : workers) {
+    worker.get();
+  }
+  for (int64_t i = 0; i < num_params; ++i) {
+    ICHECK(params[i].defined()) << "Cannot find param_" << i << " in ndarray-cache.json";
+  }
+  return Array<NDArray>(params.begin(), params.end());
+}
+
+int64_t GetParamBytes(const std::string& model_path) {
+  picojson::object cache = ReadNDArrayCacheJSON(model_path);
+  int64_t nbytes = 0;
+  for (const picojson::value& shard : cache.at("records").get<picojson::array>()) {
+    for (const picojson::value& record :
+         shard.get<picojson::object>().at("records").get<picojson::array>()) {
+      nbytes += record.get<picojson::object>().at("nbytes").get<int64_t>();
+    }
+  }
+  return nbytes;
+}
+
+}  // namespace llm
+}  // namespace mlc
@@ -0,0 +1,53 @@
+/*!
+ *  Copyright (c) 2023 by Contributors
+ * \file param_loader.h
+ * \brief Load model params from the ndarray cache shards.
+ */
+#ifndef MLC_LLM_CPP_PARAM_LOADER_H_
+#define MLC_LLM_CPP_PARAM_LOADER_H_
+
+#include <tvm/runtime/container/array.h>
+#include <tvm/runtime/ndarray.h>
+
+#include <string>
+
+namespace mlc {
+namespace llm {
+
+using namespace tvm::runtime;
+
+/*!
+ * \brief Load the params param_0, param_1, ... listed in the ndarray-cache.json of a model.
+ *
+ * The shards are memory-mapped and each param is uploaded to the device straight from the
+ * mapped pages, through a pinned staging buffer on CUDA and ROCm, without reading the shards
+ * into host memory first. Caches with records that need a conversion, such as f32-to-bf16,
+ * are loaded through vm.builtin.ndarray_cache.load instead, which leaves the builtin cache
+ * empty afterwards.
+ * \param model_path The directory of ndarray-cache.json and the shards.
+ * \param device The device of the params.
+ * \return The params in order.
+ */
+Array<NDArray> LoadParams(const std::string& model_path, DLDevice device);
+
+/*!
+ * \brief Load the params param_0, param_1, ... of a model through the builtin ndarray cache of
+ *  TVM, which is global. The loads are serialized, and the cache is left empty afterwards.
+ * \param model_path The directory of ndarray-cache.json and the shards.
+ * \param device The device of the params.
+ * \return The params in order.
+ */
+Array<NDArray> LoadParamsFromNDArrayCache(const std::string& model_path, DLDevice device);
+
+/*!
+ * \brief Get the bytes of the params listed in the ndarray-cache.json of a model, without
+ *  loading them.
+ * \param model_path The directory of ndarray-cache.json.
+ * \return The total bytes of the param records.
+ */
+int64_t GetParamBytes(const std::string& model_path);
+
+}  // namespace llm
+}  // namespace mlc
+
+#endif  // MLC_LLM_CPP_PARAM_LOADER_H_
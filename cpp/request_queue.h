@@ -0,0 +1,98 @@
+/*!
+ *  Copyright (c) 2023 by Contributors
+ * \file request_queue.h
+ * \brief A queue that many threads push to and one thread pops from.
+ */
+#ifndef MLC_LLM_CPP_REQUEST_QUEUE_H_
+#define MLC_LLM_CPP_REQUEST_QUEUE_H_
+
+#include <atomic>
+#include <condition_variable>
+#include <mutex>
+#include <optional>
+#include <utility>
+
+namespace mlc {
+namespace llm {
+
+/*!
+ * \brief An unbounded multi-producer single-consumer queue.
+ *
+ * Push is lock-free: a producer swaps its node into the head with one atomic exchange and
+ * then links it, so producers never wait for each other or for the consumer. The consumer
+ * pops from the tail without atomic read-modify-writes. A consumer that finds the queue
+ * empty sleeps on a condition variable, which producers only lock when it is asleep.
+ */
+template <typename T>
+class MPSCQueue {
+ public:
+  MPSCQueue() : head_(new Node()), tail_(head_.load()) {}
+
+  ~MPSCQueue() {
+    while (TryPop().has_value()) {
+    }
+    delete tail_;
+  }
+
+  MPSCQueue(const MPSCQueue&) = delete;
+  MPSCQueue& operator=(const MPSCQueue&) = delete;
+
+  /*! \brief Push a value, from any thread. */
+  void Push(T value) {
+    Node* node = new Node();
+    node->value.emplace(std::move(value));
+    Node* prev = head_.exchange(node, std::memory_order_acq_rel);
+    // paired with the store of consumer_waiting_ in Pop, neither side may miss the other
+    prev->next.store(node, std::memory_order_seq_cst);
+    if (consumer_waiting_.load(std::memory_order_seq_cst)) {
+      std::lock_guard<std::mutex> lock(mutex_);
+      cv_.notify_one();
+    }
+  }
+
+  /*! \brief Pop the oldest value if there is one, from the consumer thread. */
+  std::optional<T> TryPop() {
+    Node* next = tail_->next.load(std::memory_order_acquire);
+    if (next == nullptr) return std::nullopt;
+    std::optional<T> value = std::move(next->value);
+    // the popped node becomes the new stub
+    next->value.reset();
+    delete tail_;
+    tail_ = next;
+    return value;
+  }
+
+  /*! \brief Pop the oldest value, waiting for one if the queue is empty, from the consumer. */
+  T Pop() {
+    while (true) {
+      std::optional<T> value = TryPop();
+      if (value.has_value()) return std::move(*value);
+      std::unique_lock<std::mutex> lock(mutex_);
+      consumer_waiting_.store(true, std::memory_order_seq_cst);
+      cv_.wait(lock, [this]() {
+        return tail_->next.load(std::memory_order_seq_cst) != nullptr;
+      });
+      consumer_waiting_.store(false, std::memory_order_relaxed);
+    }
+  }
+
+ private:
+  struct Node {
+    std::atomic<Node*> next{nullptr};
+    std::optional<T> value;
+  };
+
+  // The last pushed node, written by producers.
+  std::atomic<Node*> head_;
+  // The stub node before the oldest value, owned by the consumer.
+  Node* tail_;
+  // Whether the consumer sleeps or is about to, and the wakeup of the consumer.
+  std::atomic<bool> consumer_waiting_{false};
+  std::mutex mutex_;
+  std::condition_variable cv_;
+};
+
+}  // namespace llm
+}  // namespace mlc
+
+#endif  // MLC_LLM_CPP_REQUEST_QUEUE_H_
@@ -0,0 +1,335 @@
+/*!
+ *  Copyright (c) 2023 by Contributors
+ * \file sampler.cc
+ * \brief Implementation of the host sampling.
+ */
+#include "sampler.h"
+
+#include <tvm/runtime/logging.h>
+
+#include <algorithm>
+#include <cmath>
+#include <numeric>
+
+#if defined(__AVX2__)
+// the whole file targets AVX2
+#define MLC_LLM_SAMPLER_AVX2 1
+#define MLC_LLM_TARGET_AVX2
+#include <immintrin.h>
+#elif (defined(__x86_64__) || defined(__i386__)) && (defined(__GNUC__) || defined(__clang__))
+// only the AVX2 kernels target AVX2, and they run after the CPU is checked for it
+#define MLC_LLM_SAMPLER_AVX2 1
+#define MLC_LLM_TARGET_AVX2 __attribute__((target("avx2")))
+#include <immintrin.h>
+#elif defined(__ARM_NEON) && defined(__aarch64__)
+#include <arm_neon.h>
+#endif
+
+namespace mlc {
+namespace llm {
+
+namespace {
+
+// The tokens sorted at first when looking for the top-p candidates.
+constexpr int64_t kTopPBlock = 64;
+
+// The constants of the Cephes expf, which is accurate to about 1e-7 relative error. The
+// input is clamped so that the result stays a normal float, and the exponentials of inputs
+// below kExpMin, such as the -inf of masked logits, are 0.
+constexpr float kExpMin = -87.0f;
+constexpr float kExpMax = 88.0f;
+constexpr float kLog2e = 1.44269504088896341f;
+constexpr float kExpC1 = 0.693359375f;
+constexpr float kExpC2 = -2.12194440e-4f;
+constexpr float kExpP[6] = {1.9875691500e-4f, 1.3981999507e-3f, 8.3334519073e-3f,
+                            4.1665795894e-2f, 1.6666665459e-1f, 5.0000001201e-1f};
+
+#ifdef MLC_LLM_SAMPLER_AVX2
+/*! \return Whether the CPU runs the AVX2 kernels. */
+bool HasAVX2() {
+#if defined(__AVX2__)
+  return true;
+#else
+  static const bool has_avx2 = __builtin_cpu_supports("avx2");
+  return has_avx2;
+#endif
+}
+
+/*! \return The maximum of x[0:n] rounded down to a multiple of 8, n must be at least 8. */
+MLC_LLM_TARGET_AVX2 float MaxValueAVX2(const float* x, int64_t n) {
+  __m256 max8 = _mm256_loadu_ps(x);
+  for (int64_t i = 8; i + 8 <= n; i += 8) {
+    max8 = _mm256_max_ps(max8, _mm256_loadu_ps(x + i));
+  }
+  __m128 max4 = _mm_max_ps(_mm256_castps256_ps128(max8), _mm256_extractf128_ps(max8, 1));
+  max4 = _mm_max_ps(max4, _mm_movehl_ps(max4, max4));
+  max4 = _mm_max_ss(max4, _mm_shuffle_ps(max4, max4, 1));
+  return _mm_cvtss_f32(max4);
+}
+
+/*! \brief ScaledExp of x[0:n] rounded down to a multiple of 8. */
+MLC_LLM_TARGET_AVX2 void ScaledExpAVX2(const float* x, int64_t n, float shift, float scale,
+                                       float* y) {
+  const __m256 shift8 = _mm256_set1_ps(shift), scale8 = _mm256_set1_ps(scale);
+  for (int64_t i = 0; i + 8 <= n; i += 8) {
+    __m256 v = _mm256_mul_ps(_mm256_sub_ps(_mm256_loadu_ps(x + i), shift8), scale8);
+    __m256 nonzero = _mm256_cmp_ps(v, _mm256_set1_ps(kExpMin), _CMP_GE_OQ);
+    v = _mm256_min_ps(_mm256_max_ps(v, _mm256_set1_ps(kExpMin)), _mm256_set1_ps(kExpMax));
+    __m256 fx = _mm256_floor_ps(
+        _mm256_add_ps(_mm256_mul_ps(v, _mm256_set1_ps(kLog2e)), _mm256_set1_ps(0.5f)));
+    v = _mm256_sub_ps(v, _mm256_mul_ps(fx, _mm256_set1_ps(kExpC1)));
+    v = _mm256_sub_ps(v, _mm256_mul_ps(fx, _mm256_set1_ps(kExpC2)));
+    __m256 p = _mm256_set1_ps(kExpP[0]);
+    for (int k = 1; k < 6; ++k) {
+      p = _mm256_add_ps(_mm256_mul_ps(p, v), _mm256_set1_ps(kExpP[k]));
+    }
+    p = _mm256_add_ps(_mm256_mul_ps(_mm256_mul_ps(p, v), v),
+                      _mm256_add_ps(v, _mm256_set1_ps(1.0f)));
+    __m256i pow2 = _mm256_slli_epi32(
+        _mm256_add_epi32(_mm256_cvtps_epi32(fx), _mm256_set1_epi32(127)), 23);
+    __m256 result = _mm256_mul_ps(p, _mm256_castsi256_ps(pow2));
+    _mm256_storeu_ps(y + i, _mm256_and_ps(result, nonzero));
+  }
+}
+
+/*! \brief PenalizeLogits of tokens[0:n] rounded down to a multiple of 8. */
+MLC_LLM_TARGET_AVX2 void PenalizeLogitsAVX2(float* logits, const int32_t* tokens, int64_t n,
+                                            float penalty) {
+  const __m256 penalty8 = _mm256_set1_ps(penalty);
+  alignas(32) float penalized[8];
+  for (int64_t i = 0; i + 8 <= n; i += 8) {
+    __m256i index = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(tokens + i));
+    __m256 v = _mm256_i32gather_ps(logits, index, 4);
+    __m256 positive = _mm256_cmp_ps(v, _mm256_setzero_ps(), _CMP_GT_OQ);
+    _mm256_store_ps(penalized, _mm256_blendv_ps(_mm256_mul_ps(v, penalty8),
+                                                _mm256_div_ps(v, penalty8), positive));
+    // AVX2 has no scatter, the tokens are distinct so the stores do not conflict
+    for (int k = 0; k < 8; ++k) {
+      logits[tokens[i + k]] = penalized[k];
+    }
+  }
+}
+#endif
+
+/*! \return The maximum of x[0:n], n must be positive. */
+float MaxValue(const float* x, int64_t n) {
+  int64_t i = 0;
+  float result = x[0];
+#if defined(MLC_LLM_SAMPLER_AVX2)
+  if (n >= 8 && HasAVX2()) {
+    result = MaxValueAVX2(x, n);
+    i = n - n % 8;
+  }
+#elif defined(__ARM_NEON) && defined(__aarch64__)
+  if (n >= 4) {
+    float32x4_t max4 = vld1q_f32(x);
+    for (i = 4; i + 4 <= n; i += 4) {
+      max4 = vmaxq_f32(max4, vld1q_f32(x + i));
+    }
+    result = vmaxvq_f32(max4);
+  }
+#endif
+  for (; i < n; ++i) {
+    result = std::max(result, x[i]);
+  }
+  return result;
+}
+
+/*! \brief Set y[i] = exp((x[i] - shift) * scale) for i in [0, n). */
+void ScaledExp(const float* x, int64_t n, float shift, float scale, float* y) {
+  int64_t i = 0;
+#if defined(MLC_LLM_SAMPLER_AVX2)
+  if (HasAVX2()) {
+    ScaledExpAVX2(x, n, shift, scale, y);
+    i = n - n % 8;
+  }
+#elif defined(__ARM_NEON) && defined(__aarch64__)
+  const float32x4_t shift4 = vdupq_n_f32(shift), scale4 = vdupq_n_f32(scale);
+  for (; i + 4 <= n; i += 4) {
+    float32x4_t v = vmulq_f32(vsubq_f32(vld1q_f32(x + i), shift4), scale4);
+    uint32x4_t nonzero = vcgeq_f32(v, vdupq_n_f32(kExpMin));
+    v = vminq_f32(vmaxq_f32(v, vdupq_n_f32(kExpMin)), vdupq_n_f32(kExpMax));
+    float32x4_t fx = vrndmq_f32(vaddq_f32(vmulq_f32(v, vdupq_n_f32(kLog2e)), vdupq_n_f32(0.5f)));
+    v = vsubq_f32(v, vmulq_f32(fx, vdupq_n_f32(kExpC1)));
+    v = vsubq_f32(v, vmulq_f32(fx, vdupq_n_f32(kExpC2)));
+    float32x4_t p = vdupq_n_f32(kExpP[0]);
+    for (int k = 1; k < 6; ++k) {
+      p = vaddq_f32(vmulq_f32(p, v), vdupq_n_f32(kExpP[k]));
+    }
+    p = vaddq_f32(vmulq_f32(vmulq_f32(p, v), v), vaddq_f32(v, vdupq_n_f32(1.0f)));
+    int32x4_t pow2 = vshlq_n_s32(vaddq_s32(vcvtq_s32_f32(fx), vdupq_n_s32(127)), 23);
+    float32x4_t result = vmulq_f32(p, vreinterpretq_f32_s32(pow2));
+    vst1q_f32(y + i, vreinterpretq_f32_u32(vandq_u32(vreinterpretq_u32_f32(result), nonzero)));
+  }
+#endif
+  for (; i < n; ++i) {
+    float v = (x[i] - shift) * scale;
+    y[i] = v >= kExpMin ? std::exp(v) : 0.0f;
+  }
+}
+
+/*! \brief Divide the positive logits of the distinct tokens by penalty, multiply the others. */
+void PenalizeLogits(float* logits, const int32_t* tokens, int64_t n, float penalty) {
+  int64_t i = 0;
+#if defined(MLC_LLM_SAMPLER_AVX2)
+  if (HasAVX2()) {
+    PenalizeLogitsAVX2(logits, tokens, n, penalty);
+    i = n - n % 8;
+  }
+#endif
+  for (; i < n; ++i) {
+    float logit = logits[tokens[i]];
+    logits[tokens[i]] = logit > 0 ? logit / penalty : logit * penalty;
+  }
+}
+
+}  // namespace
+
+int32_t HostSampler::SampleFromProbs(const float* probs, int64_t vocab_size, int64_t top_k,
+                                     float top_p, double uniform) {
+  ICHECK_GT(vocab_size, 0);
+  int64_t num_candidates = top_k > 0 && top_k < vocab_size ? top_k : vocab_size;
+  indices_.resize(vocab_size);
+  std::iota(indices_.begin(), indices_.end(), 0);
+  if (num_candidates < vocab_size) {
+    std::nth_element(indices_.begin(), indices_.begin() + num_candidates, indices_.end(),
+                     [probs](int32_t a, int32_t b) { return probs[a] > probs[b]; });
+  }
+  double mass = 0;
+  for (int64_t i = 0; i < num_candidates; ++i) {
+    mass += probs[indices_[i]];
+  }
+  return SampleFromCandidates(probs, num_candidates, mass, top_p, uniform);
+}
+
+int32_t HostSampler::SampleFromLogits(const float* logits, int64_t vocab_size, float temperature,
+                                      int64_t top_k, float top_p, double uniform) {
+  ICHECK_GT(vocab_size, 0);
+  float max_logit = MaxValue(logits, vocab_size);
+  if (temperature < 1e-6f) {
+    return std::find(logits, logits + vocab_size, max_logit) - logits;
+  }
+  weights_.resize(vocab_size);
+  // with top-k, only the exponentials of the candidates are computed
+  if (top_k > 0 && top_k < vocab_size) {
+    indices_.resize(vocab_size);
+    std::iota(indices_.begin(), indices_.end(), 0);
+    std::nth_element(indices_.begin(), indices_.begin() + top_k, indices_.end(),
+                     [logits](int32_t a, int32_t b) { return logits[a] > logits[b]; });
+    double mass = 0;
+    for (int64_t i = 0; i < top_k; ++i) {
+      int32_t token = indices_[i];
+      weights_[token] = std::exp((logits[token] - max_logit) / temperature);
+      mass += weights_[token];
+    }
+    return SampleFromCandidates(weights_.data(), top_k, mass, top_p, uniform);
+  }
+  ScaledExp(logits, vocab_size, max_logit, 1.0f / temperature, weights_.data());
+  return SampleFromProbs(weights_.data(), vocab_size, 0, top_p, uniform);
+}
+
+void HostSampler::ComputeProbs(const float* logits, int64_t vocab_size, float temperature,
+                               int64_t top_k, float top_p, float* probs) {
+  ICHECK_GT(vocab_size, 0);
+  float max_logit = MaxValue(logits, vocab_size);
+  if (temperature < 1e-6f) {
+    std::fill(probs, probs + vocab_size, 0.0f);
+    probs[std::find(logits, logits + vocab_size, max_logit) - logits] = 1.0f;
+    return;
+  }
+  int64_t num_candidates = vocab_size;
+  indices_.resize(vocab_size);
+  std::iota(indices_.begin(), indices_.end(), 0);
+  double mass = 0;
+  if (top_k > 0 && top_k < vocab_size) {
+    num_candidates = top_k;
+    std::nth_element(indices_.begin(), indices_.begin() + top_k, indices_.end(),
+                     [logits](int32_t a, int32_t b) { return logits[a] > logits[b]; });
+    std::fill(probs, probs + vocab_size, 0.0f);
+    for (int64_t i = 0; i < top_k; ++i) {
+      int32_t token = indices_[i];
+      probs[token] = std::exp((logits[token] - max_logit) / temperature);
+      mass += probs[token];
+    }
+  } else {
+    ScaledExp(logits, vocab_size, max_logit, 1.0f / temperature, probs);
+    mass = std::accumulate(probs, probs + vocab_size, 0.0);
+  }
+  double kept_mass = mass;
+  int64_t num_kept = SelectTopP(probs, num_candidates, mass, top_p, &kept_mass);
+  for (int64_t i = num_kept; i < num_candidates; ++i) {
+    probs[indices_[i]] = 0.0f;
+  }
+  float scale = static_cast<float>(1.0 / kept_mass);
+  for (int64_t i = 0; i < num_kept; ++i) {
+    probs[indices_[i]] *= scale;
+  }
+}
+
+int32_t HostSampler::SampleFromCandidates(const float* probs, int64_t num_candidates,
+                                          double mass, float top_p, double uniform) {
+  double sampled_mass = mass;
+  int64_t num_sampled = SelectTopP(probs, num_candidates, mass, top_p, &sampled_mass);
+  double threshold = uniform * sampled_mass;
+  double cumsum = 0;
+  for (int64_t i = 0; i < num_sampled; ++i) {
+    cumsum += probs[indices_[i]];
+    if (cumsum > threshold) return indices_[i];
+  }
+  // rounding may leave the threshold above the sum, fall back to the last nonzero candidate
+  for (int64_t i = num_sampled - 1; i > 0; --i) {
+    if (probs[indices_[i]] > 0) return indices_[i];
+  }
+  return indices_[0];
+}
+
+int64_t HostSampler::SelectTopP(const float* probs, int64_t num_candidates, double mass,
+                                float top_p, double* kept_mass) {
+  auto greater = [probs](int32_t a, int32_t b) { return probs[a] > probs[b]; };
+  auto begin = indices_.begin();
+  int64_t num_sampled = num_candidates;
+  *kept_mass = mass;
+  if (top_p > 0 && top_p < 1) {
+    // Sort the most likely candidates in growing blocks until they reach the mass.
+    double target = top_p * mass;
+    double cumsum = 0;
+    int64_t num_sorted = 0;
+    int64_t block_end = std::min(kTopPBlock, num_candidates);
+    while (true) {
+      if (block_end < num_candidates) {
+        std::nth_element(begin + num_sorted, begin + block_end, begin + num_candidates, greater);
+      }
+      std::sort(begin + num_sorted, begin + block_end, greater);
+      for (; num_sorted < block_end; ++num_sorted) {
+        cumsum += probs[indices_[num_sorted]];
+        if (cumsum >= target) break;
+      }
+      if (num_sorted < block_end || block_end == num_candidates) {
+        num_sampled = std::min(num_sorted + 1, num_candidates);
+        *kept_mass = cumsum;
+        break;
+      }
+      block_end = std::min(block_end * 2, num_candidates);
+    }
+  }
+  return num_sampled;
+}
+
+void HostSampler::ApplyRepetitionPenalty(float* logits, int64_t vocab_size,
+                                         const std::vector<int32_t>& token_ids, float penalty) {
+  if (penalty == 1.0f || token_ids.empty()) return;
+  ICHECK_GT(penalty, 0) << "The repetition penalty must be positive";
+  penalized_.assign((vocab_size + 63) / 64, 0);
+  penalized_tokens_.clear();
+  for (int32_t token : token_ids) {
+    if (token < 0 || token >= vocab_size) continue;
+    uint64_t bit = uint64_t(1) << (token % 64);
+    if (penalized_[token / 64] & bit) continue;
+    penalized_[token / 64] |= bit;
+    penalized_tokens_.push_back(token);
+  }
+  PenalizeLogits(logits, penalized_tokens_.data(), penalized_tokens_.size(), penalty);
+}
+
+}  // namespace llm
+}  // namespace mlc
@@ -0,0 +1,98 @@
+/*!
+ *  Copyright (c) 2023 by Contributors
+ * \file sampler.h
+ * \brief Sampling from the logits or probabilities of one position on the host.
+ */
+#ifndef MLC_LLM_CPP_SAMPLER_H_
+#define MLC_LLM_CPP_SAMPLER_H_
+
+#include <cstdint>
+#include <vector>
+
+namespace mlc {
+namespace llm {
+
+/*!
+ * \brief Samples tokens on the host with temperature, top-k, top-p and repetition penalty.
+ *
+ * Top-k and top-p select the candidates by partial selection instead of sorting the
+ * vocabulary: top-k takes the k most likely tokens with nth_element, and top-p sorts the
+ * most likely tokens in growing blocks until their mass reaches top_p, which usually takes
+ * one block of a few dozen tokens. The scratch buffers are kept between calls.
+ */
+class HostSampler {
+ public:
+  /*!
+   * \brief Sample from probabilities over the vocabulary, which need not be normalized.
+   * \param probs The probabilities.
+   * \param vocab_size The number of probabilities.
+   * \param top_k The number of most likely tokens to sample from, all tokens if not positive.
+   * \param top_p The probability mass of the most likely tokens to sample from, after top-k.
+   * \param uniform A random number in [0, 1).
+   * \return The sampled token.
+   */
+  int32_t SampleFromProbs(const float* probs, int64_t vocab_size, int64_t top_k, float top_p,
+                          double uniform);
+
+  /*!
+   * \brief Sample from logits over the vocabulary with a temperature, greedily if it is 0.
+   * \param logits The logits.
+   * \param vocab_size The number of logits.
+   * \param temperature The temperature of the softmax.
+   * \param top_k The number of most likely tokens to sample from, all tokens if not positive.
+   * \param top_p The probability mass of the most likely tokens to sample from, after top-k.
+   * \param uniform A random number in [0, 1).
+   * \return The sampled token.
+   */
+  int32_t SampleFromLogits(const float* logits, int64_t vocab_size, float temperature,
+                           int64_t top_k, float top_p, double uniform);
+
+  /*!
+   * \brief Compute the normalized distribution that SampleFromLogits draws from: the softmax
+   *  of the logits with a temperature over the top-k and top-p candidates, which are selected
+   *  as in SampleFromLogits, or all the mass on the most likely token if the temperature is 0.
+   * \param logits The logits.
+   * \param vocab_size The number of logits.
+   * \param temperature The temperature of the softmax.
+   * \param top_k The number of most likely tokens to keep, all tokens if not positive.
+   * \param top_p The probability mass of the most likely tokens to keep, after top-k.
+   * \param probs The distribution over the vocabulary, 0 for the tokens that are not kept.
+   */
+  void ComputeProbs(const float* logits, int64_t vocab_size, float temperature, int64_t top_k,
+                    float top_p, float* probs);
+
+  /*!
+   * \brief Penalize the tokens that appear in token_ids, by dividing their positive logits
+   *  and multiplying their negative logits by the penalty. A token is penalized once no
+   *  matter how often it appears.
+   * \param logits The logits to penalize in place.
+   * \param vocab_size The number of logits.
+   * \param token_ids The generated tokens.
+   * \param penalty The penalty, no penalty if it is 1.
+   */
+  void ApplyRepetitionPenalty(float* logits, int64_t vocab_size,
+                              const std::vector<int32_t>& token_ids, float penalty);
+
+ private:
+  // Sample from the first num_candidates entries of indices_, which hold mass in total.
+  int32_t SampleFromCandidates(const float* probs, int64_t num_candidates, double mass,
+                               float top_p, double uniform);
+
+  // Move the most likely of the first num_candidates entries of indices_ to the front until
+  // their mass reaches top_p of mass, and return their number and their mass in kept_mass.
+  int64_t SelectTopP(const float* probs, int64_t num_candidates, double mass, float top_p,
+                     double* kept_mass);
+
+  // The candidate tokens.
+  std::vector<int32_t> indices_;
+  // The unnormalized probabilities computed from the logits.
+  std::vector<float> weights_;
+  // The bitset of the tokens penalized so far in ApplyRepetitionPenalty, and the tokens.
+  std::vector<uint64_t> penalized_;
+  std::vector<int32_t> penalized_tokens_;
+};
+
+}  // namespace llm
+}  // namespace mlc
+
+#endif  // MLC_LLM_CPP_SAMPLER_H_
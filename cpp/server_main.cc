@@ -0,0 +1,747 @@
+/*!
+ *  Copyright (c) 2023 by Contributors
+ * \file server_main.cc
+ * \brief An HTTP server of OpenAI-style completions on the batched engine, which streams the
+ *  tokens as server-sent events.
+ */
+// Like the CLI, the server only interacts with the engine module through the tvm runtime.
+#include <arpa/inet.h>
+#include <fcntl.h>
+#include <netinet/in.h>
+#include <poll.h>
+#include <signal.h>
+#include <sys/socket.h>
+#include <tvm/runtime/module.h>
+#include <tvm/runtime/registry.h>
+#include <unistd.h>
+
+#define PICOJSON_USE_INT64
+#include <picojson.h>
+
+#include <algorithm>
+#include <argparse/argparse.hpp>
+#include <atomic>
+#include <cctype>
+#include <cerrno>
+#include <chrono>
+#include <cstdlib>
+#include <cstring>
+#include <ctime>
+#include <filesystem>
+#include <iostream>
+#include <optional>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+#include "device_name.h"
+#include "llm_chat.h"
+#include "request_queue.h"
+
+namespace {
+
+using mlc::llm::MPSCQueue;
+
+// The limits of the request head and body that the server reads.
+constexpr size_t kMaxHeaderBytes = 64 << 10;
+constexpr size_t kMaxBodyBytes = 1 << 20;
+
+/*! \brief A command from the I/O thread to the engine thread. */
+struct EngineCommand {
+  enum Kind { kAdd, kCancel, kStop } kind;
+  // the connection that made the request
+  int64_t conn_id;
+  std::string prompt;
+  // the JSON object of the generation options passed to add_request
+  std::string options;
+
+  explicit EngineCommand(Kind kind, int64_t conn_id = 0, std::string prompt = "",
+                         std::string options = "")
+      : kind(kind), conn_id(conn_id), prompt(std::move(prompt)), options(std::move(options)) {}
+};
+
+/*! \brief Output of a request, from the engine thread to the I/O thread. */
+struct EngineEvent {
+  int64_t conn_id{0};
+  // the text generated since the previous event
+  std::string delta;
+  bool finished{false};
+  // why the request finished, "stop" or "length" as in the OpenAI API, empty if not finished
+  std::string finish_reason;
+  // the error that stopped the request, empty if none
+  std::string error;
+};
+
+/*!
+ * \brief Runs the engine on its own thread, so that the I/O thread never waits for a step.
+ *
+ * The I/O thread pushes commands without locking, and the worker steps the engine while any
+ * request runs, sleeping on the command queue otherwise. The output of each step is pushed
+ * back with a byte written to the wakeup pipe of the I/O loop.
+ */
+class EngineWorker {
+ public:
+  EngineWorker(tvm::runtime::Module engine_mod, int wake_fd)
+      : engine_mod_(engine_mod), wake_fd_(wake_fd) {
+    thread_ = std::thread([this]() { this->Run(); });
+  }
+
+  ~EngineWorker() {
+    commands_.Push(EngineCommand(EngineCommand::kStop));
+    thread_.join();
+  }
+
+  void Submit(EngineCommand command) { commands_.Push(std::move(command)); }
+
+  std::optional<EngineEvent> TryPopEvent() { return events_.TryPop(); }
+
+  /*! \return The number of requests queued in the engine before they are admitted. */
+  int64_t NumPending() const { return num_pending_.load(std::memory_order_relaxed); }
+
+  /*! \return The number of requests the engine prefills or decodes. */
+  int64_t NumRunning() const { return num_running_.load(std::memory_order_relaxed); }
+
+ private:
+  void Run() {
+    auto f_add_request = engine_mod_.GetFunction("add_request");
+    auto f_remove_request = engine_mod_.GetFunction("remove_request");
+    auto f_step = engine_mod_.GetFunction("step");
+    auto f_stopped = engine_mod_.GetFunction("stopped");
+    auto f_get_error = engine_mod_.GetFunction("get_error");
+    auto f_get_finish_reason = engine_mod_.GetFunction("get_finish_reason");
+    auto f_get_message_delta = engine_mod_.GetFunction("get_message_delta");
+    auto f_num_pending = engine_mod_.GetFunction("num_pending_requests");
+    auto f_num_running = engine_mod_.GetFunction("num_running_requests");
+    // the engine request of each connection
+    std::unordered_map<int64_t, int64_t> requests;
+    while (true) {
+      // with nothing to generate, wait for a command
+      std::optional<EngineCommand> command =
+          requests.empty() ? std::optional<EngineCommand>(commands_.Pop()) : commands_.TryPop();
+      for (; command.has_value(); command = commands_.TryPop()) {
+        if (command->kind == EngineCommand::kStop) return;
+        if (command->kind == EngineCommand::kAdd) {
+          try {
+            requests[command->conn_id] = f_add_request(command->prompt, command->options);
+          } catch (const std::exception& err) {
+            events_.Push({command->conn_id, "", true, "", err.what()});
+            this->Wake();
+          }
+        } else if (auto it = requests.find(command->conn_id); it != requests.end()) {
+          f_remove_request(it->second);
+          requests.erase(it);
+        }
+      }
+      if (requests.empty()) {
+        this->PublishQueueDepth(0, 0);
+        continue;
+      }
+      try {
+        f_step();
+      } catch (const std::exception& err) {
+        // the engine fails only the request whose step raised an error, an error that gets
+        // here cannot be told apart from a broken engine, so every request ends with it
+        for (const auto& [conn_id, request_id] : requests) {
+          f_remove_request(request_id);
+          events_.Push({conn_id, "", true, "", err.what()});
+        }
+        requests.clear();
+        this->Wake();
+        continue;
+      }
+      for (auto it = requests.begin(); it != requests.end();) {
+        // read the delta after stopped, so the last delta holds the rest of the message
+        bool stopped = f_stopped(it->second);
+        std::string error = stopped ? f_get_error(it->second).operator std::string() : "";
+        std::string delta = error.empty() ? f_get_message_delta(it->second).operator std::string()
+                                          : "";
+        if (!delta.empty() || stopped) {
+          std::string finish_reason =
+              stopped && error.empty() ? f_get_finish_reason(it->second).operator std::string()
+                                       : "";
+          events_.Push(
+              {it->first, std::move(delta), stopped, std::move(finish_reason), std::move(error)});
+        }
+        if (stopped) {
+          f_remove_request(it->second);
+          it = requests.erase(it);
+        } else {
+          ++it;
+        }
+      }
+      this->PublishQueueDepth(f_num_pending(), f_num_running());
+      this->Wake();
+    }
+  }
+
+  void PublishQueueDepth(int64_t num_pending, int64_t num_running) {
+    num_pending_.store(num_pending, std::memory_order_relaxed);
+    num_running_.store(num_running, std::memory_order_relaxed);
+  }
+
+  void Wake() {
+    char byte = 0;
+    // a full pipe already wakes the loop
+    ssize_t ret = write(wake_fd_, &byte, 1);
+    (void)ret;
+  }
+
+  tvm::runtime::Module engine_mod_;
+  int wake_fd_;
+  MPSCQueue<EngineCommand> commands_;
+  MPSCQueue<EngineEvent> events_;
+  std::atomic<int64_t> num_pending_{0}, num_running_{0};
+  std::thread thread_;
+};
+
+/*! \brief The parts of an HTTP request that the server uses. */
+struct HTTPRequest {
+  std::string method;
+  // the path without the query
+  std::string path;
+  std::string body;
+};
+
+/*!
+ * \brief Parse an HTTP/1.1 request from the bytes read so far.
+ * \param input The bytes read from the connection.
+ * \param request The parsed request.
+ * \return 0 if the request is complete, -1 if more bytes are needed, or the HTTP status of the
+ *  error otherwise.
+ */
+int ParseHTTPRequest(const std::string& input, HTTPRequest* request) {
+  size_t head_end = input.find("\r\n\r\n");
+  if (head_end == std::string::npos) {
+    return input.size() > kMaxHeaderBytes ? 431 : -1;
+  }
+  size_t line_end = input.find("\r\n");
+  std::istringstream request_line(input.substr(0, line_end));
+  std::string target, version;
+  request_line >> request->method >> target >> version;
+  if (request->method.empty() || target.empty() || version.compare(0, 5, "HTTP/") != 0) {
+    return 400;
+  }
+  request->path = target.substr(0, target.find('?'));
+  size_t content_length = 0;
+  for (size_t pos = line_end + 2; pos < head_end;) {
+    size_t end = input.find("\r\n", pos);
+    std::string line = input.substr(pos, end - pos);
+    pos = end + 2;
+    size_t colon = line.find(':');
+    if (colon == std::string::npos) return 400;
+    std::string name = line.substr(0, colon);
+    std::transform(name.begin(), name.end(), name.begin(),
+                   [](unsigned char c) { return std::tolower(c); });
+    std::string value = line.substr(colon + 1);
+    value.erase(0, value.find_first_not_of(" \t"));
+    if (name == "content-length") {
+      char* value_end = nullptr;
+      unsigned long long length = std::strtoull(value.c_str(), &value_end, 10);
+      if (value_end == value.c_str()) return 400;
+      if (length > kMaxBodyBytes) return 413;
+      content_length = length;
+    } else if (name == "transfer-encoding") {
+      // chunked request bodies are not supported
+      return 411;
+    }
+  }
+  size_t body_begin = head_end + 4;
+  if (input.size() < body_begin + content_length) return -1;
+  request->body = input.substr(body_begin, content_length);
+  return 0;
+}
+
+const char* StatusReason(int status) {
+  switch (status) {
+    case 200:
+      return "OK";
+    case 400:
+      return "Bad Request";
+    case 404:
+      return "Not Found";
+    case 405:
+      return "Method Not Allowed";
+    case 411:
+      return "Length Required";
+    case 413:
+      return "Payload Too Large";
+    case 429:
+      return "Too Many Requests";
+    case 431:
+      return "Request Header Fields Too Large";
+    case 503:
+      return "Service Unavailable";
+    default:
+      return "Internal Server Error";
+  }
+}
+
+std::string HTTPResponse(int status, const std::string& body,
+                         const std::string& content_type = "application/json") {
+  std::ostringstream os;
+  os << "HTTP/1.1 " << status << " " << StatusReason(status) << "\r\n"
+     << "Content-Type: " << content_type << "\r\n"
+     << "Content-Length: " << body.size() << "\r\n"
+     << "Connection: close\r\n\r\n"
+     << body;
+  return os.str();
+}
+
+/*! \return The response of an error, in the shape of the errors of the OpenAI API. */
+std::string ErrorResponse(int status, const std::string& message, const std::string& type) {
+  picojson::object error;
+  error["message"] = picojson::value(message);
+  error["type"] = picojson::value(type);
+  picojson::object body;
+  body["error"] = picojson::value(error);
+  return HTTPResponse(status, picojson::value(body).serialize());
+}
+
+/*! \brief A client connection, which makes one request and is closed after the response. */
+struct Connection {
+  int fd{-1};
+  std::string input;
+  // the bytes to write, and whether to close the connection once they are written
+  std::string output;
+  bool close_after_write{false};
+  // whether the request is in the engine
+  bool in_engine{false};
+  bool stream{false};
+  // the id of the completion, and the text so far of a response that is not streamed
+  std::string completion_id;
+  std::string text;
+  int64_t created{0};
+};
+
+/*! \brief Counters of the server, reported by GET /metrics. */
+struct ServerMetrics {
+  int64_t accepted_requests{0};
+  int64_t rejected_requests{0};
+  int64_t completed_requests{0};
+  int64_t cancelled_requests{0};
+};
+
+/*!
+ * \brief The HTTP server, whose event loop runs the sockets of all connections on one thread
+ *  with non-blocking I/O, and passes the completions to an EngineWorker.
+ *
+ * It serves POST /v1/completions, with "prompt" and the optional "stream", "max_tokens",
+ * "temperature", "top_p" and "stop" of the OpenAI API, and GET /metrics. A request is rejected
+ * with 429 when max_queue_depth requests are already being generated or queued, which bounds
+ * the latency of the admitted requests. No more connections are accepted while
+ * max_connections are open, the later ones wait in the listen backlog of the kernel.
+ */
+class CompletionServer {
+ public:
+  CompletionServer(tvm::runtime::Module engine_mod, std::string model_name,
+                   int64_t max_queue_depth, int64_t max_connections)
+      : model_name_(std::move(model_name)),
+        max_queue_depth_(max_queue_depth),
+        max_connections_(max_connections) {
+    int pipe_fds[2];
+    ICHECK_EQ(pipe(pipe_fds), 0) << "Cannot create the wakeup pipe: " << std::strerror(errno);
+    wake_read_fd_ = pipe_fds[0];
+    wake_write_fd_ = pipe_fds[1];
+    SetNonBlocking(wake_read_fd_);
+    SetNonBlocking(wake_write_fd_);
+    worker_ = std::make_unique<EngineWorker>(engine_mod, wake_write_fd_);
+  }
+
+  ~CompletionServer() {
+    worker_ = nullptr;
+    for (auto& [conn_id, conn] : connections_) close(conn.fd);
+    if (listen_fd_ >= 0) close(listen_fd_);
+    close(wake_read_fd_);
+    close(wake_write_fd_);
+  }
+
+  /*! \brief Listen on the address and serve until the process is stopped. */
+  void Serve(const std::string& host, int port) {
+    listen_fd_ = socket(AF_INET, SOCK_STREAM, 0);
+    ICHECK_GE(listen_fd_, 0) << "Cannot create the socket: " << std::strerror(errno);
+    int reuse = 1;
+    setsockopt(listen_fd_, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse));
+    sockaddr_in addr{};
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(static_cast<uint16_t>(port));
+    ICHECK_EQ(inet_pton(AF_INET, host.c_str(), &addr.sin_addr), 1)
+        << "Invalid IPv4 address " << host;
+    ICHECK_EQ(bind(listen_fd_, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)), 0)
+        << "Cannot bind " << host << ":" << port << ": " << std::strerror(errno);
+    ICHECK_EQ(listen(listen_fd_, SOMAXCONN), 0) << "Cannot listen: " << std::strerror(errno);
+    SetNonBlocking(listen_fd_);
+    std::cout << "Serving " << model_name_ << " on http://" << host << ":" << port << std::endl;
+
+    std::vector<pollfd> fds;
+    std::vector<int64_t> conn_ids;
+    while (true) {
+      fds.clear();
+      conn_ids.clear();
+      // at the cap on connections, the listen socket is not polled until one closes
+      bool accepting = static_cast<int64_t>(connections_.size()) < max_connections_;
+      fds.push_back({accepting ? listen_fd_ : -1, POLLIN, 0});
+      fds.push_back({wake_read_fd_, POLLIN, 0});
+      for (const auto& [conn_id, conn] : connections_) {
+        // keep reading to notice when the client goes away
+        fds.push_back({conn.fd, static_cast<short>(POLLIN | (conn.output.empty() ? 0 : POLLOUT)),
+                       0});
+        conn_ids.push_back(conn_id);
+      }
+      if (poll(fds.data(), fds.size(), -1) < 0) {
+        if (errno == EINTR) continue;
+        LOG(FATAL) << "poll failed: " << std::strerror(errno);
+      }
+      if (fds[0].revents & POLLIN) this->Accept();
+      if (fds[1].revents & POLLIN) this->HandleEvents();
+      for (size_t i = 2; i < fds.size(); ++i) {
+        auto it = connections_.find(conn_ids[i - 2]);
+        if (it == connections_.end()) continue;
+        if (fds[i].revents & (POLLIN | POLLHUP | POLLERR)) {
+          if (!this->Read(it->first, &it->second)) continue;
+        }
+        if (fds[i].revents & POLLOUT) this->Write(it->first, &it->second);
+      }
+    }
+  }
+
+ private:
+  static void SetNonBlocking(int fd) { fcntl(fd, F_SETFL, fcntl(fd, F_GETFL, 0) | O_NONBLOCK); }
+
+  void Accept() {
+    while (static_cast<int64_t>(connections_.size()) < max_connections_) {
+      int fd = accept(listen_fd_, nullptr, nullptr);
+      if (fd < 0) return;
+      SetNonBlocking(fd);
+      Connection& conn = connections_[next_conn_id_++];
+      conn.fd = fd;
+    }
+  }
+
+  // Read from the connection, return false if it is closed.
+  bool Read(int64_t conn_id, Connection* conn) {
+    char buffer[16 << 10];
+    while (true) {
+      ssize_t n = read(conn->fd, buffer, sizeof(buffer));
+      if (n > 0) {
+        // bytes after the request are ignored
+        if (conn->completion_id.empty() && !conn->close_after_write) {
+          conn->input.append(buffer, n);
+        }
+        continue;
+      }
+      if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) break;
+      if (n < 0 && errno == EINTR) continue;
+      // the client closed the connection or it failed
+      this->Close(conn_id);
+      return false;
+    }
+    if (!conn->completion_id.empty() || conn->close_after_write) return true;
+    HTTPRequest request;
+    int status = conn->input.size() > kMaxHeaderBytes + kMaxBodyBytes
+                     ? 413
+                     : ParseHTTPRequest(conn->input, &request);
+    if (status < 0) return true;
+    if (status > 0) {
+      this->Respond(conn, ErrorResponse(status, StatusReason(status), "invalid_request_error"));
+    } else {
+      this->HandleRequest(conn_id, conn, request);
+    }
+    return true;
+  }
+
+  void Write(int64_t conn_id, Connection* conn) {
+    while (!conn->output.empty()) {
+      ssize_t n = write(conn->fd, conn->output.data(), conn->output.size());
+      if (n > 0) {
+        conn->output.erase(0, n);
+        continue;
+      }
+      if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) return;
+      if (n < 0 && errno == EINTR) continue;
+      this->Close(conn_id);
+      return;
+    }
+    if (conn->close_after_write) this->Close(conn_id);
+  }
+
+  void Close(int64_t conn_id) {
+    auto it = connections_.find(conn_id);
+    if (it == connections_.end()) return;
+    if (it->second.in_engine) {
+      worker_->Submit(EngineCommand(EngineCommand::kCancel, conn_id));
+      --num_active_;
+      ++metrics_.cancelled_requests;
+    }
+    close(it->second.fd);
+    connections_.erase(it);
+  }
+
+  void Respond(Connection* conn, std::string response) {
+    conn->output += response;
+    conn->close_after_write = true;
+  }
+
+  void HandleRequest(int64_t conn_id, Connection* conn, const HTTPRequest& request) {
+    if (request.path == "/metrics") {
+      if (request.method != "GET") {
+        return this->Respond(conn, ErrorResponse(405, "Use GET", "invalid_request_error"));
+      }
+      return this->Respond(conn, HTTPResponse(200, this->MetricsJSON()));
+    }
+    if (request.path != "/v1/completions") {
+      return this->Respond(conn, ErrorResponse(404, "Unknown path " + request.path,
+                                               "invalid_request_error"));
+    }
+    if (request.method != "POST") {
+      return this->Respond(conn, ErrorResponse(405, "Use POST", "invalid_request_error"));
+    }
+    picojson::value body;
+    std::string err = picojson::parse(body, request.body);
+    if (!err.empty() || !body.is<picojson::object>() || !body.contains("prompt") ||
+        !body.get("prompt").is<std::string>()) {
+      return this->Respond(conn, ErrorResponse(400, "Expect a JSON object with a \"prompt\" string",
+                                               "invalid_request_error"));
+    }
+    std::string options, options_err = ParseOptions(body.get<picojson::object>(), &options);
+    if (!options_err.empty()) {
+      return this->Respond(conn, ErrorResponse(400, options_err, "invalid_request_error"));
+    }
+    if (num_active_ >= max_queue_depth_) {
+      ++metrics_.rejected_requests;
+      return this->Respond(conn, ErrorResponse(429, "Too many requests in the queue, retry later",
+                                               "server_busy"));
+    }
+    conn->stream = body.contains("stream") && body.get("stream").is<bool>() &&
+                   body.get("stream").get<bool>();
+    conn->completion_id = "cmpl-" + std::to_string(conn_id);
+    conn->created = static_cast<int64_t>(std::time(nullptr));
+    conn->in_engine = true;
+    ++num_active_;
+    ++metrics_.accepted_requests;
+    worker_->Submit(EngineCommand(EngineCommand::kAdd, conn_id,
+                                  body.get("prompt").get<std::string>(), options));
+    if (conn->stream) {
+      conn->output +=
+          "HTTP/1.1 200 OK\r\nContent-Type: text/event-stream\r\nCache-Control: no-cache\r\n"
+          "Connection: close\r\n\r\n";
+    }
+  }
+
+  /*!
+   * \brief Check the generation options of a completion request.
+   * \param body The request body.
+   * \param options The options in the JSON object of the engine add_request.
+   * \return The error message of an invalid option, empty if all are valid.
+   */
+  static std::string ParseOptions(const picojson::object& body, std::string* options) {
+    picojson::object engine_options;
+    auto it = body.find("max_tokens");
+    if (it != body.end() && !it->second.is<picojson::null>()) {
+      if (!it->second.is<int64_t>() || it->second.get<int64_t>() < 1) {
+        return "\"max_tokens\" must be a positive integer";
+      }
+      engine_options["max_tokens"] = it->second;
+    }
+    it = body.find("temperature");
+    if (it != body.end() && !it->second.is<picojson::null>()) {
+      if (!it->second.is<double>() || it->second.get<double>() < 0) {
+        return "\"temperature\" must be a non-negative number";
+      }
+      engine_options["temperature"] = it->second;
+    }
+    it = body.find("top_p");
+    if (it != body.end() && !it->second.is<picojson::null>()) {
+      if (!it->second.is<double>() || it->second.get<double>() <= 0 ||
+          it->second.get<double>() > 1) {
+        return "\"top_p\" must be a number in (0, 1]";
+      }
+      engine_options["top_p"] = it->second;
+    }
+    it = body.find("stop");
+    if (it != body.end() && !it->second.is<picojson::null>()) {
+      // a single stop string or a list of them
+      picojson::array stop_strs;
+      if (it->second.is<std::string>()) {
+        stop_strs.push_back(it->second);
+      } else if (it->second.is<picojson::array>()) {
+        stop_strs = it->second.get<picojson::array>();
+      } else {
+        return "\"stop\" must be a string or a list of strings";
+      }
+      for (const picojson::value& stop_str : stop_strs) {
+        if (!stop_str.is<std::string>()) return "\"stop\" must be a string or a list of strings";
+      }
+      engine_options["stop"] = picojson::value(stop_strs);
+    }
+    *options = picojson::value(engine_options).serialize();
+    return "";
+  }
+
+  void HandleEvents() {
+    char buffer[256];
+    while (read(wake_read_fd_, buffer, sizeof(buffer)) > 0) {
+    }
+    for (std::optional<EngineEvent> event = worker_->TryPopEvent(); event.has_value();
+         event = worker_->TryPopEvent()) {
+      auto it = connections_.find(event->conn_id);
+      // the client went away and its cancel is on the way
+      if (it == connections_.end() || !it->second.in_engine) continue;
+      Connection& conn = it->second;
+      if (event->finished) {
+        conn.in_engine = false;
+        --num_active_;
+        if (event->error.empty()) ++metrics_.completed_requests;
+      }
+      if (!event->error.empty()) {
+        if (conn.stream) {
+          picojson::object error;
+          error["message"] = picojson::value(event->error);
+          error["type"] = picojson::value("server_error");
+          picojson::object chunk;
+          chunk["error"] = picojson::value(error);
+          conn.output += "data: " + picojson::value(chunk).serialize() + "\n\ndata: [DONE]\n\n";
+          conn.close_after_write = true;
+        } else {
+          this->Respond(&conn, ErrorResponse(500, event->error, "server_error"));
+        }
+        continue;
+      }
+      if (conn.stream) {
+        conn.output += "data: " + this->CompletionJSON(conn, event->delta, event->finish_reason) +
+                       "\n\n";
+        if (event->finished) {
+          conn.output += "data: [DONE]\n\n";
+          conn.close_after_write = true;
+        }
+      } else {
+        conn.text += event->delta;
+        if (event->finished) {
+          std::string completion = this->CompletionJSON(conn, conn.text, event->finish_reason);
+          this->Respond(&conn, HTTPResponse(200, completion));
+        }
+      }
+    }
+  }
+
+  // A completion object, or a chunk of one when streaming.
+  std::string CompletionJSON(const Connection& conn, const std::string& text,
+                             const std::string& finish_reason) {
+    picojson::object choice;
+    choice["text"] = picojson::value(text);
+    choice["index"] = picojson::value(0.0);
+    choice["logprobs"] = picojson::value();
+    choice["finish_reason"] =
+        finish_reason.empty() ? picojson::value() : picojson::value(finish_reason);
+    picojson::object completion;
+    completion["id"] = picojson::value(conn.completion_id);
+    completion["object"] = picojson::value("text_completion");
+    completion["created"] = picojson::value(static_cast<double>(conn.created));
+    completion["model"] = picojson::value(model_name_);
+    completion["choices"] = picojson::value(picojson::array{picojson::value(choice)});
+    return picojson::value(completion).serialize();
+  }
+
+  std::string MetricsJSON() {
+    picojson::object metrics;
+    metrics["queue_depth"] = picojson::value(static_cast<double>(worker_->NumPending()));
+    metrics["running_requests"] = picojson::value(static_cast<double>(worker_->NumRunning()));
+    metrics["active_requests"] = picojson::value(static_cast<double>(num_active_));
+    metrics["max_queue_depth"] = picojson::value(static_cast<double>(max_queue_depth_));
+    metrics["open_connections"] = picojson::value(static_cast<double>(connections_.size()));
+    metrics["max_connections"] = picojson::value(static_cast<double>(max_connections_));
+    metrics["accepted_requests"] = picojson::value(static_cast<double>(metrics_.accepted_requests));
+    metrics["rejected_requests"] = picojson::value(static_cast<double>(metrics_.rejected_requests));
+    metrics["completed_requests"] =
+        picojson::value(static_cast<double>(metrics_.completed_requests));
+    metrics["cancelled_requests"] =
+        picojson::value(static_cast<double>(metrics_.cancelled_requests));
+    return picojson::value(metrics).serialize();
+  }
+
+  std::string model_name_;
+  // the number of requests in the engine, which admission control bounds by max_queue_depth_
+  int64_t max_queue_depth_;
+  // the most connections open at the same time, which bounds the memory of the I/O thread
+  int64_t max_connections_;
+  int64_t num_active_{0};
+  ServerMetrics metrics_;
+  int listen_fd_{-1};
+  // the pipe the engine worker writes to when it has events
+  int wake_read_fd_{-1}, wake_write_fd_{-1};
+  std::unordered_map<int64_t, Connection> connections_;
+  int64_t next_conn_id_{0};
+  std::unique_ptr<EngineWorker> worker_;
+};
+
+}  // namespace
+
+int main(int argc, char* argv[]) {
+  using namespace tvm::runtime;
+  argparse::ArgumentParser args("mlc_chat_server");
+
+  args.add_argument("--model-lib").help("the model library to load").default_value("");
+  args.add_argument("--model-path")
+      .help("the directory of mlc-chat-config.json, the tokenizer and the params")
+      .default_value("");
+  args.add_argument("--model-name")
+      .help("the model name in the responses, the local id of the model path if not given")
+      .default_value("");
+  args.add_argument("--device-name").default_value("auto");
+  args.add_argument("--device_id").default_value(0).scan<'i', int>();
+  args.add_argument("--host").default_value("127.0.0.1");
+  args.add_argument("--port").default_value(8000).scan<'i', int>();
+  args.add_argument("--max-batch-size")
+      .help("maximum number of requests generated at the same time")
+      .default_value(8)
+      .scan<'i', int>();
+  args.add_argument("--max-queue-depth")
+      .help("maximum number of requests generated or queued, later requests get 429")
+      .default_value(64)
+      .scan<'i', int>();
+  args.add_argument("--max-connections")
+      .help("maximum number of open connections, later ones wait in the listen backlog")
+      .default_value(256)
+      .scan<'i', int>();
+
+  try {
+    args.parse_args(argc, argv);
+  } catch (const std::runtime_error& err) {
+    std::cerr << err.what() << std::endl;
+    std::cerr << args << std::endl;
+    return 1;
+  }
+
+  std::string model_path = args.get<std::string>("--model-path");
+  if (model_path.empty() || args.get<std::string>("--model-lib").empty()) {
+    std::cerr << "Both --model-lib and --model-path are required" << std::endl;
+    std::cerr << args << std::endl;
+    return 1;
+  }
+  std::string model_name = args.get<std::string>("--model-name");
+  if (model_name.empty()) {
+    // the artifact layouts are "<local_id>/params" and "prebuilt/<local_id>"
+    std::filesystem::path path = std::filesystem::absolute(model_path).lexically_normal();
+    if (path.filename().empty()) path = path.parent_path();
+    model_name = (path.filename() == "params" ? path.parent_path() : path).filename().string();
+  }
+  // writes to clients that went away fail with EPIPE instead of killing the server
+  signal(SIGPIPE, SIG_IGN);
+
+  try {
+    DLDevice device = GetDevice(DetectDeviceName(args.get<std::string>("--device-name")),
+                                args.get<int>("--device_id"));
+    Module lib = Module::LoadFromFile(args.get<std::string>("--model-lib"));
+    Module engine_mod = mlc::llm::CreateEngineModule(device);
+    engine_mod.GetFunction("reload")(lib, tvm::String(model_path));
+    engine_mod.GetFunction("set_max_batch_size")(args.get<int>("--max-batch-size"));
+    CompletionServer server(engine_mod, model_name, args.get<int>("--max-queue-depth"),
+                            args.get<int>("--max-connections"));
+    server.Serve(args.get<std::string>("--host"), args.get<int>("--port"));
+  } catch (const std::runtime_error& err) {
+    std::cerr << err.what() << std::endl;
+    return 1;
+  }
+  return 0;
+}
@@ -1,7 +1,9 @@
-from typing import List
+from typing import List, Optional
 
 import json
-from tvm import relax
+import tvm
+from tvm import relax, te, topi
+from tvm.relax.testing import nn
 
 
 def create_metadata_func(
@@ -10,14 +12,199 @@ def create_metadata_func(
     max_window_size: int,
     stop_tokens: List[int],
     add_prefix_space: bool,
+    kv_cache: Optional[dict] = None,
 ):
-    metadata = json.dumps(
-        {
-            "model_name": model_name,
-            "max_window_size": max_window_size,
-            "stop_tokens": stop_tokens,
-            "add_prefix_space": add_prefix_space,
-        }
-    )
+    metadata = {
+        "model_name": model_name,
+        "max_window_size": max_window_size,
+        "stop_tokens": stop_tokens,
+        "add_prefix_space": add_prefix_space,
+    }
+    if kv_cache is not None:
+        metadata["kv_cache"] = kv_cache
+    metadata = json.dumps(metadata)
     with bb.function("get_metadata", params=[]):
         bb.emit_func_output(relax.StringImm(metadata))
+
+
+def kv_cache_metadata(
+    num_layers: int,
+    num_heads: int,
+    head_dim: int,
+    dtype: str,
+    paged: bool = False,
+    quantization: str = "none",
+) -> dict:
+    """The layout of the KV cache, one key and one value cache per layer,
+    each of shape (seq_len, num_heads, head_dim).
+
+    For a quantized cache, head_dim and dtype describe the stored rows, see
+    kv_cache_quantize, so that the runtime moves the rows without knowing the
+    quantization."""
+    return {
+        "num_layers": num_layers,
+        "num_heads": num_heads,
+        "head_dim": head_dim,
+        "dtype": dtype,
+        "paged": paged,
+        "quantization": quantization,
+    }
+
+
+# The bytes after each head of an int8 KV cache row, which hold the scale of the head.
+KV_CACHE_SCALE_BYTES = 2
+
+
+def kv_cache_row_dim(head_dim: int, quantization: str) -> int:
+    """The last dimension of the KV cache rows of heads of head_dim."""
+    if quantization == "int8":
+        return head_dim + KV_CACHE_SCALE_BYTES
+    assert quantization == "none", f"Unknown KV cache quantization {quantization}"
+    return head_dim
+
+
+def kv_cache_quantize(x: te.Tensor) -> te.Tensor:
+    """Quantize KV states of shape (n, num_heads, head_dim) to int8 rows of shape
+    (n, num_heads, head_dim + KV_CACHE_SCALE_BYTES).
+
+    Each head is scaled by its absolute maximum over 127, and the scale is stored
+    as float16 in the last bytes of the head, low byte first, so the scales live
+    in the same cache as the values and move with them.
+    """
+    n, num_heads, head_dim = x.shape
+    k = te.reduce_axis((0, head_dim), name="k")
+    amax = te.compute(
+        (n, num_heads),
+        lambda i, h: te.max(tvm.tir.abs(x[i, h, k].astype("float32")), axis=k),
+        name="kv_amax",
+    )
+    # the smallest normal float16 keeps the scale of an all-zero head invertible
+    scale = te.compute(
+        (n, num_heads),
+        lambda i, h: tvm.tir.max(amax[i, h] / 127.0, 2.0**-14).astype("float16"),
+        name="kv_scale",
+    )
+
+    def quantize_compute(i, h, j):
+        value = x[i, h, j].astype("float32") / scale[i, h].astype("float32")
+        value = tvm.tir.round(value)
+        value = tvm.tir.max(tvm.tir.min(value, 127.0), -127.0).astype("int8")
+        bits = tvm.tir.reinterpret("int16", scale[i, h]).astype("int32") & 0xFFFF
+        byte = (bits >> (8 * tvm.tir.max(j - head_dim, 0))) & 0xFF
+        byte = tvm.tir.if_then_else(byte > 127, byte - 256, byte).astype("int8")
+        return tvm.tir.if_then_else(j < head_dim, value, byte)
+
+    return te.compute(
+        (n, num_heads, head_dim + KV_CACHE_SCALE_BYTES),
+        quantize_compute,
+        name="kv_cache_quantize",
+    )
+
+
+def kv_cache_dequantize(q: te.Tensor, dtype: str) -> te.Tensor:
+    """Dequantize int8 rows made by kv_cache_quantize to KV states of dtype."""
+    n, num_heads, row_dim = q.shape
+    head_dim = row_dim - KV_CACHE_SCALE_BYTES
+
+    def scale_compute(i, h):
+        low = q[i, h, head_dim].astype("int32") & 0xFF
+        high = q[i, h, head_dim + 1].astype("int32") & 0xFF
+        bits = low | (high << 8)
+        bits = tvm.tir.if_then_else(bits > 32767, bits - 65536, bits).astype("int16")
+        return tvm.tir.reinterpret("float16", bits).astype("float32")
+
+    scale = te.compute((n, num_heads), scale_compute, name="kv_scale")
+    return te.compute(
+        (n, num_heads, head_dim),
+        lambda i, h, j: (q[i, h, j].astype("float32") * scale[i, h]).astype(dtype),
+        name="kv_cache_dequantize",
+    )
+
+
+def create_sample_top_p_func(
+    bb: relax.BlockBuilder, vocab_size: int, num_bisect_iters: int = 20
+) -> None:
+    """Sample the next token from the logits with temperature and top-p on device,
+    so that only the token id is copied back to the host.
+
+    The top-p threshold is found by bisecting the probability value, which only
+    needs reductions over the vocabulary instead of a sort. The token is drawn
+    among the probabilities above the threshold with the Gumbel-max trick, with
+    the noise hashed from the token index and the seed.
+    """
+
+    def f_init_bounds(prob: te.Tensor):
+        k = te.reduce_axis((0, vocab_size), name="k")
+        max_prob = te.compute(
+            (), lambda: te.max(prob[0, 0, k], axis=k), name="max_prob"
+        )
+        return te.compute(
+            (2,),
+            lambda i: tvm.tir.Select(i == 0, tvm.tir.const(0, "float32"), max_prob[()]),
+            name="bounds",
+        )
+
+    def f_bisect(prob: te.Tensor, bounds: te.Tensor, top_p: te.Tensor):
+        # bounds holds [lo, hi], the mass of the probabilities >= lo is at least top_p
+        mid = (bounds[0] + bounds[1]) * 0.5
+        k = te.reduce_axis((0, vocab_size), name="k")
+        mass = te.compute(
+            (),
+            lambda: te.sum(
+                tvm.tir.Select(prob[0, 0, k] >= mid, prob[0, 0, k], 0.0), axis=k
+            ),
+            name="mass",
+        )
+        return te.compute(
+            (2,),
+            lambda i: tvm.tir.Select(
+                mass[()] >= top_p[()],
+                tvm.tir.Select(i == 0, mid, bounds[1]),
+                tvm.tir.Select(i == 0, bounds[0], mid),
+            ),
+            name="bisect",
+        )
+
+    def f_draw(scaled: te.Tensor, prob: te.Tensor, bounds: te.Tensor, seed):
+        def gumbel_noise(j):
+            # murmur3 finalizer of the token index mixed with the seed
+            x = tvm.tir.Cast("uint32", j) * tvm.tir.const(0x9E3779B1, "uint32")
+            x = x + tvm.tir.Cast("uint32", seed)
+            x = x ^ (x >> 16)
+            x = x * tvm.tir.const(0x85EBCA6B, "uint32")
+            x = x ^ (x >> 13)
+            x = x * tvm.tir.const(0xC2B2AE35, "uint32")
+            x = x ^ (x >> 16)
+            u = (tvm.tir.Cast("float32", x >> 8) + 0.5) * (1.0 / (1 << 24))
+            return -tvm.tir.log(-tvm.tir.log(u))
+
+        score = te.compute(
+            (vocab_size,),
+            lambda j: tvm.tir.Select(
+                prob[0, 0, j] >= bounds[0],
+                scaled[0, 0, j] + gumbel_noise(j),
+                tvm.tir.min_value("float32"),
+            ),
+            name="score",
+        )
+        return topi.argmax(score, axis=0, keepdims=True)
+
+    with bb.function("sample_top_p"):
+        logits = nn.Placeholder((1, 1, vocab_size), dtype="float32", name="logits")
+        temperature = nn.Placeholder((), dtype="float32", name="temperature")
+        top_p = nn.Placeholder((), dtype="float32", name="top_p")
+        seed = tvm.tir.Var("seed", "int64")
+        seed_shape = relax.Var("seed", relax.ShapeStructInfo((seed,)))
+        with bb.dataflow():
+            scaled = bb.emit(relax.op.divide(logits, temperature))
+            prob = bb.emit(relax.op.nn.softmax(scaled, axis=-1))
+            bounds = nn.emit_te(f_init_bounds, prob, primfunc_name_hint="top_p_init")
+            for _ in range(num_bisect_iters):
+                bounds = nn.emit_te(
+                    f_bisect, prob, bounds, top_p, primfunc_name_hint="top_p_bisect"
+                )
+            token = nn.emit_te(
+                f_draw, scaled, prob, bounds, seed, primfunc_name_hint="top_p_draw"
+            )
+            gv = bb.emit_output(token)
+        bb.emit_func_output(gv, [logits, temperature, top_p, seed_shape])
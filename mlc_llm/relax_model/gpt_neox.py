@@ -20,7 +20,11 @@ from tvm.relax.testing import nn
 from tvm.runtime import NDArray
 from tvm.script import relax as R
 
-from .commons import create_metadata_func
+from .commons import (
+    create_metadata_func,
+    create_sample_top_p_func,
+    kv_cache_metadata,
+)
 from .modules import (
     Embedding,
     LayerNorm,
@@ -641,12 +645,19 @@ def get_model(model_name: str, model_path: str, dtype: str, hf_config):
     create_decoding_func(bb, config, [k for k, _ in param_list])
     create_kv_cache_func(bb, config)
     create_softmax_func(bb, config)
+    create_sample_top_p_func(bb, config.vocab_size)
     create_metadata_func(
         bb,
         model_name=model_name,
         max_window_size=config.max_sequence_length,
         stop_tokens=stop_tokens,
         add_prefix_space=False,
+        kv_cache=kv_cache_metadata(
+            num_layers=config.num_hidden_layers,
+            num_heads=config.num_attention_heads,
+            head_dim=config.hidden_size // config.num_attention_heads,
+            dtype=config.dtype,
+        ),
     )
     mod = bb.get()
     for gv in mod.functions:
@@ -8,7 +8,14 @@ from tvm import relax, te
 from tvm.relax.testing import nn
 from tvm.script import relax as R
 
-from .commons import create_metadata_func
+from .commons import (
+    create_metadata_func,
+    create_sample_top_p_func,
+    kv_cache_dequantize,
+    kv_cache_metadata,
+    kv_cache_quantize,
+    kv_cache_row_dim,
+)
 
 
 @dataclass
@@ -30,6 +37,8 @@ class LlamaConfig:
         eos_token_id=1,
         tie_word_embeddings=False,
         position_embedding_base=10000,
+        paged_kv_cache=False,
+        kv_cache_quantization="none",
         **kwargs,
     ):
         self.dtype = dtype
@@ -47,6 +56,8 @@ class LlamaConfig:
         self.eos_token_id = eos_token_id
         self.tie_word_embeddings = tie_word_embeddings
         self.position_embedding_base = position_embedding_base
+        self.paged_kv_cache = paged_kv_cache
+        self.kv_cache_quantization = kv_cache_quantization
         self.kwargs = kwargs
 
 
@@ -173,13 +184,80 @@ def apply_rotary_pos_emb(q, k, cos, sin, offset: int = 0):
     return q_embed, k_embed
 
 
+def paged_kv_cache_gather(
+    cache: relax.Expr,
+    rows: relax.Expr,
+    row_shape: Tuple[tvm.tir.PrimExpr, tvm.tir.PrimExpr],
+    dtype: str,
+    pages_func: str = "mlc.paged_kv_cache_pages",
+) -> relax.Var:
+    """Read the rows of a paged KV cache through a row table.
+
+    The gather is injective, so it is fused into the attention that consumes it instead
+    of copying the cache into a contiguous array first. The result has the shape of the
+    row table followed by row_shape, which is (num_heads, head_dim).
+    """
+    pages = nn.emit(
+        relax.Call(
+            relax.extern(pages_func),
+            args=[cache],
+            sinfo_args=[relax.TensorStructInfo(ndim=3, dtype=dtype)],
+        )
+    )
+    # the pool size is only known at runtime
+    num_pool_rows = tvm.tir.Var("num_pool_rows", "int64")
+    pages = relax.BlockBuilder.current().match_cast(
+        pages, relax.TensorStructInfo((num_pool_rows, *row_shape), dtype)
+    )
+    return nn.emit(relax.op.take(pages, rows, axis=0))
+
+
+def apply_rotary_pos_emb_batch(q, k, cos, sin, lengths):
+    """Rotary embedding of one new token of each sequence, at position lengths[b] - 1."""
+
+    def f_rotary_embedding(tensor, cos, sin, lengths):
+        n_feat_half = tensor.shape[-1] // 2
+
+        def rotary_compute(b, i, h, j):
+            pos = tvm.tir.Cast("int64", lengths[b]) - 1
+            return cos[pos, j] * tensor[b, i, h, j] + sin[pos, j] * tvm.tir.Select(
+                j >= n_feat_half,
+                tensor[b, i, h, j - n_feat_half],
+                -tensor[b, i, h, j + n_feat_half],
+            )
+
+        return tvm.te.compute(tensor.shape, rotary_compute, name="rotary")
+
+    q_embed = nn.emit_te(
+        f_rotary_embedding, q, cos, sin, lengths, primfunc_name_hint="rotary_embedding"
+    )
+    k_embed = nn.emit_te(
+        f_rotary_embedding, k, cos, sin, lengths, primfunc_name_hint="rotary_embedding"
+    )
+    return q_embed, k_embed
+
+
 class LlamaAttention(nn.Module):
     """Multi-headed attention from 'Attention Is All You Need' paper"""
 
-    def __init__(self, hidden_size: int, num_heads: int, dtype: str):
+    def __init__(
+        self,
+        hidden_size: int,
+        num_heads: int,
+        dtype: str,
+        paged_kv_cache: bool = False,
+        kv_cache_quantization: str = "none",
+    ):
         self.hidden_size = hidden_size
         self.num_heads = num_heads
         self.head_dim = self.hidden_size // self.num_heads
+        self.kv_cache_quantization = kv_cache_quantization
+        self.paged_kv_cache = paged_kv_cache
+        # The paged KV cache is managed by the mlc_llm runtime, see cpp/paged_kv_cache.h
+        if paged_kv_cache:
+            self.kv_cache_prefix = "mlc.paged_kv_cache"
+        else:
+            self.kv_cache_prefix = "vm.builtin.attention_kv_cache"
 
         if (self.head_dim * self.num_heads) != self.hidden_size:
             raise ValueError(
@@ -247,12 +325,27 @@ class LlamaAttention(nn.Module):
         kv_states_shape = R.shape(
             [kv_states_shape[0], kv_seq_len, kv_states_shape[2], kv_states_shape[3]]
         )
-        kv_cache_shape = R.shape([kv_seq_len, kv_states_shape[2], kv_states_shape[3]])
+        quantized = self.kv_cache_quantization != "none"
+        kv_cache_shape = R.shape(
+            [
+                kv_seq_len,
+                kv_states_shape[2],
+                kv_cache_row_dim(self.head_dim, self.kv_cache_quantization),
+            ]
+        )
+        kv_cache_dtype = "int8" if quantized else kv_states_dtype
 
         squeezed_key = nn.emit(squeeze(key_states, axis=0))
         squeezed_value = nn.emit(squeeze(value_states, axis=0))
+        if quantized:
+            squeezed_key = nn.emit_te(
+                kv_cache_quantize, squeezed_key, primfunc_name_hint="kv_cache_quantize"
+            )
+            squeezed_value = nn.emit_te(
+                kv_cache_quantize, squeezed_value, primfunc_name_hint="kv_cache_quantize"
+            )
         k_cache, v_cache = past_key_value
-        f_kv_cache_append = relax.extern("vm.builtin.attention_kv_cache_append")
+        f_kv_cache_append = relax.extern(self.kv_cache_prefix + "_append")
         k_cache = nn.emit(
             relax.Call(
                 f_kv_cache_append,
@@ -268,21 +361,47 @@ class LlamaAttention(nn.Module):
             )
         )
         past_key_value = (k_cache, v_cache)
-        f_kv_cache_view = relax.extern("vm.builtin.attention_kv_cache_view")
-        k_cache = nn.emit(
-            relax.Call(
-                f_kv_cache_view,
-                args=[k_cache, kv_cache_shape],
-                sinfo_args=[R.Tensor(kv_cache_shape, kv_states_dtype)],
+        if self.paged_kv_cache:
+            # the key and the value caches of a layer share the row table of the sequence
+            rows = nn.emit(
+                relax.Call(
+                    relax.extern("mlc.paged_kv_cache_rows"),
+                    args=[k_cache, R.shape([kv_seq_len])],
+                    sinfo_args=[R.Tensor((kv_seq_len,), "int32")],
+                )
             )
-        )
-        v_cache = nn.emit(
-            relax.Call(
-                f_kv_cache_view,
-                args=[v_cache, kv_cache_shape],
-                sinfo_args=[R.Tensor(kv_cache_shape, kv_states_dtype)],
+            row_shape = kv_cache_shape.values[1:]
+            k_cache = paged_kv_cache_gather(k_cache, rows, row_shape, kv_cache_dtype)
+            v_cache = paged_kv_cache_gather(v_cache, rows, row_shape, kv_cache_dtype)
+        else:
+            f_kv_cache_view = relax.extern(self.kv_cache_prefix + "_view")
+            k_cache = nn.emit(
+                relax.Call(
+                    f_kv_cache_view,
+                    args=[k_cache, kv_cache_shape],
+                    sinfo_args=[R.Tensor(kv_cache_shape, kv_cache_dtype)],
+                )
+            )
+            v_cache = nn.emit(
+                relax.Call(
+                    f_kv_cache_view,
+                    args=[v_cache, kv_cache_shape],
+                    sinfo_args=[R.Tensor(kv_cache_shape, kv_cache_dtype)],
+                )
+            )
+        if quantized:
+            k_cache = nn.emit_te(
+                kv_cache_dequantize,
+                k_cache,
+                kv_states_dtype,
+                primfunc_name_hint="kv_cache_dequantize",
+            )
+            v_cache = nn.emit_te(
+                kv_cache_dequantize,
+                v_cache,
+                kv_states_dtype,
+                primfunc_name_hint="kv_cache_dequantize",
             )
-        )
         key_states = nn.emit(reshape(k_cache, kv_states_shape))
         value_states = nn.emit(reshape(v_cache, kv_states_shape))
 
@@ -339,6 +458,111 @@ class LlamaAttention(nn.Module):
         attn_output = self.o_proj(attn_output)
         return attn_output, ((None, None) if past_key_value is None else past_key_value)
 
+    def forward_batch(
+        self,
+        hidden_states: relax.Expr,
+        cos_cached: relax.Expr,
+        sin_cached: relax.Expr,
+        rows: relax.Expr,
+        lengths: relax.Expr,
+        past_key_value: Tuple[relax.Expr],
+        attention_mask: relax.Expr,
+    ) -> Tuple[relax.Expr, Tuple[relax.Expr]]:
+        """Attention of one new token of each sequence of a batch over the paged KV cache.
+
+        rows is the row table of shape (bsz, max_len) of the sequences after the new
+        tokens are appended, and lengths holds the length of each sequence.
+        """
+        from tvm.relax.op import astype, matmul, maximum, permute_dims, reshape, squeeze
+        from tvm.relax.op.nn import softmax
+
+        bsz, q_len, _ = hidden_states.struct_info.shape
+        max_len = rows.struct_info.shape[1]
+        assert q_len == 1, "Batched decoding takes one token of each sequence."
+        head_shape = (bsz, q_len, self.num_heads, self.head_dim)
+        query_states = nn.emit(reshape(self.q_proj(hidden_states), head_shape))
+        key_states = nn.emit(reshape(self.k_proj(hidden_states), head_shape))
+        value_states = nn.emit(reshape(self.v_proj(hidden_states), head_shape))
+        query_states, key_states = apply_rotary_pos_emb_batch(
+            query_states, key_states, cos_cached, sin_cached, lengths
+        )
+
+        quantized = self.kv_cache_quantization != "none"
+        kv_states_dtype = key_states.struct_info.dtype
+        kv_cache_dtype = "int8" if quantized else kv_states_dtype
+        row_dim = kv_cache_row_dim(self.head_dim, self.kv_cache_quantization)
+        squeezed_key = nn.emit(squeeze(key_states, axis=1))
+        squeezed_value = nn.emit(squeeze(value_states, axis=1))
+        if quantized:
+            squeezed_key = nn.emit_te(
+                kv_cache_quantize, squeezed_key, primfunc_name_hint="kv_cache_quantize"
+            )
+            squeezed_value = nn.emit_te(
+                kv_cache_quantize, squeezed_value, primfunc_name_hint="kv_cache_quantize"
+            )
+        k_cache, v_cache = past_key_value
+        f_kv_cache_append = relax.extern("mlc.paged_kv_cache_batch_append")
+        k_cache = nn.emit(
+            relax.Call(
+                f_kv_cache_append,
+                args=[k_cache, squeezed_key],
+                sinfo_args=[relax.ObjectStructInfo()],
+            )
+        )
+        v_cache = nn.emit(
+            relax.Call(
+                f_kv_cache_append,
+                args=[v_cache, squeezed_value],
+                sinfo_args=[relax.ObjectStructInfo()],
+            )
+        )
+        past_key_value = (k_cache, v_cache)
+
+        row_shape = (self.num_heads, row_dim)
+        kv_states = []
+        for cache in past_key_value:
+            states = paged_kv_cache_gather(
+                cache, rows, row_shape, kv_cache_dtype, "mlc.paged_kv_cache_batch_pages"
+            )
+            if quantized:
+                states = nn.emit(reshape(states, (bsz * max_len, self.num_heads, row_dim)))
+                states = nn.emit_te(
+                    kv_cache_dequantize,
+                    states,
+                    kv_states_dtype,
+                    primfunc_name_hint="kv_cache_dequantize",
+                )
+                states = nn.emit(
+                    reshape(states, (bsz, max_len, self.num_heads, self.head_dim))
+                )
+            kv_states.append(nn.emit(permute_dims(states, [0, 2, 1, 3])))
+        key_states, value_states = kv_states
+        query_states = nn.emit(permute_dims(query_states, [0, 2, 1, 3]))
+
+        attn_weights = nn.emit(
+            matmul(query_states, permute_dims(key_states, [0, 1, 3, 2]))
+            / relax.const(math.sqrt(self.head_dim), query_states.struct_info.dtype)
+        )
+        attn_weights = nn.emit(
+            maximum(
+                attn_weights,
+                relax.const(
+                    tvm.tir.min_value(attn_weights.struct_info.dtype).value,
+                    attn_weights.struct_info.dtype,
+                ),
+            )
+        )
+        attn_weights = nn.emit(relax.op.minimum(attn_weights, attention_mask))
+        if attn_weights.struct_info.dtype != "float32":
+            attn_weights = astype(attn_weights, "float32")
+        attn_weights = nn.emit(softmax(attn_weights, axis=-1))
+        if attn_weights.struct_info.dtype != query_states.struct_info.dtype:
+            attn_weights = astype(attn_weights, query_states.struct_info.dtype)
+        attn_output = nn.emit(matmul(attn_weights, value_states))
+        attn_output = permute_dims(attn_output, [0, 2, 1, 3])
+        attn_output = reshape(attn_output, (bsz, q_len, self.hidden_size))
+        return self.o_proj(attn_output), past_key_value
+
 
 class LlamaDecoderLayer(nn.Module):
     def __init__(self, config: LlamaConfig):
@@ -347,6 +571,8 @@ class LlamaDecoderLayer(nn.Module):
             hidden_size=self.hidden_size,
             num_heads=config.num_attention_heads,
             dtype=config.dtype,
+            paged_kv_cache=config.paged_kv_cache,
+            kv_cache_quantization=config.kv_cache_quantization,
         )
         self.mlp = LlamaMLP(
             hidden_size=self.hidden_size,
@@ -392,6 +618,51 @@ class LlamaDecoderLayer(nn.Module):
 
         return hidden_states, present_key_value
 
+    def forward_batch(
+        self,
+        hidden_states: relax.Expr,
+        cos_cached: relax.Expr,
+        sin_cached: relax.Expr,
+        rows: relax.Expr,
+        lengths: relax.Expr,
+        past_key_value: Tuple[relax.Expr],
+        attention_mask: relax.Expr,
+    ) -> Tuple[relax.Expr, Tuple[relax.Expr, relax.Expr]]:
+        residual = hidden_states
+        hidden_states = self.input_layernorm(hidden_states)
+        hidden_states, present_key_value = self.self_attn.forward_batch(
+            hidden_states=hidden_states,
+            cos_cached=cos_cached,
+            sin_cached=sin_cached,
+            rows=rows,
+            lengths=lengths,
+            past_key_value=past_key_value,
+            attention_mask=attention_mask,
+        )
+        hidden_states = nn.emit(residual + hidden_states)
+        residual = hidden_states
+        hidden_states = self.post_attention_layernorm(hidden_states)
+        hidden_states = self.mlp(hidden_states)
+        hidden_states = nn.emit(residual + hidden_states)
+        return hidden_states, present_key_value
+
+
+def _make_batch_decode_mask(lengths, max_len, dtype):
+    """The mask of the rows of each sequence in a row table of max_len rows."""
+
+    def mask_te(lengths):
+        return te.compute(
+            (lengths.shape[0], 1, 1, max_len),
+            lambda b, _, i, j: tvm.tir.Select(
+                j < tvm.tir.Cast("int64", lengths[b]),
+                tvm.tir.max_value(dtype),
+                tvm.tir.min_value(dtype),
+            ),
+            name="batch_decode_mask_te",
+        )
+
+    return nn.emit_te(mask_te, lengths, primfunc_name_hint="batch_decode_mask")
+
 
 def _make_causal_mask(input_ids_shape, dtype, src_len):
     from tvm.relax.op import broadcast_to, full, triu
@@ -503,6 +774,36 @@ class LlamaModel(nn.Module):
         assert len(next_decoder_cache) == len(self.layers) * 2
         return hidden_states, next_decoder_cache
 
+    def forward_batch(
+        self,
+        input_ids: relax.Expr,
+        cos_cached: relax.Expr,
+        sin_cached: relax.Expr,
+        rows: relax.Expr,
+        lengths: relax.Expr,
+        past_key_values: relax.Expr,
+    ):
+        inputs_embeds = self.embed_tokens(input_ids)
+        attention_mask = _make_batch_decode_mask(
+            lengths, rows.struct_info.shape[1], inputs_embeds.struct_info.dtype
+        )
+        hidden_states = inputs_embeds
+        next_decoder_cache = ()
+        for idx, decoder_layer in enumerate(self.layers):
+            past_key_value = (past_key_values[idx * 2], past_key_values[idx * 2 + 1])
+            hidden_states, key_value_cache = decoder_layer.forward_batch(
+                hidden_states,
+                cos_cached=cos_cached,
+                sin_cached=sin_cached,
+                rows=rows,
+                lengths=lengths,
+                past_key_value=past_key_value,
+                attention_mask=attention_mask,
+            )
+            next_decoder_cache += key_value_cache
+        hidden_states = self.norm(hidden_states)
+        return hidden_states, next_decoder_cache
+
 
 class LlamaForCausalLM(nn.Module):
     def __init__(self, config: LlamaConfig):
@@ -530,6 +831,7 @@ class LlamaForCausalLM(nn.Module):
         input_ids: relax.Expr,
         all_seq_len_shape: relax.Expr,
         past_key_values: relax.Expr,
+        all_logits: bool = False,
     ):
         hidden_states, key_value_cache = self.model(
             input_ids=input_ids,
@@ -546,20 +848,53 @@ class LlamaForCausalLM(nn.Module):
                 name="slice",
             )
 
-        logits = self.lm_head(
-            nn.emit_te(te_slicing, hidden_states, primfunc_name_hint="slice")
-        )
+        if all_logits:
+            logits = self.lm_head(hidden_states)
+        else:
+            logits = self.lm_head(
+                nn.emit_te(te_slicing, hidden_states, primfunc_name_hint="slice")
+            )
         if logits.struct_info.dtype != "float32":
             logits = nn.emit(relax.op.astype(logits, "float32"))
 
         return logits, key_value_cache
 
+    def forward_batch(
+        self,
+        input_ids: relax.Expr,
+        rows: relax.Expr,
+        lengths: relax.Expr,
+        past_key_values: relax.Expr,
+    ):
+        hidden_states, key_value_cache = self.model.forward_batch(
+            input_ids=input_ids,
+            cos_cached=self.cos_cached,
+            sin_cached=self.sin_cached,
+            rows=rows,
+            lengths=lengths,
+            past_key_values=past_key_values,
+        )
+        logits = self.lm_head(hidden_states)
+        if logits.struct_info.dtype != "float32":
+            logits = nn.emit(relax.op.astype(logits, "float32"))
+        return logits, key_value_cache
+
+
+def create_encoding_func(
+    bb: relax.BlockBuilder,
+    config: LlamaConfig,
+    func_name: str = "encoding",
+    all_logits: bool = False,
+) -> None:
+    """Create the function that runs a sequence of tokens after the KV cache.
 
-def create_encoding_func(bb: relax.BlockBuilder, config: LlamaConfig) -> None:
+    With all_logits, the function returns the logits of every token instead of the
+    last one, which is how speculative decoding verifies the tokens of a draft model.
+    """
     bsz = 1
     seq_len = tvm.tir.Var("n", "int64")
     all_seq_len = tvm.tir.Var("m", "int64")
-    with bb.function("encoding"):
+    with bb.function(func_name):
         model = LlamaForCausalLM(config)
         input_ids = nn.Placeholder((bsz, seq_len), dtype="int32", name="input_ids")
         all_seq_len_shape = relax.Var(
@@ -573,7 +908,10 @@ def create_encoding_func(bb: relax.BlockBuilder, config: LlamaConfig) -> None:
         )
         with bb.dataflow():
             logits, key_value_cache = model(
-                input_ids, all_seq_len_shape, past_key_values=past_key_values
+                input_ids,
+                all_seq_len_shape,
+                past_key_values=past_key_values,
+                all_logits=all_logits,
             )
             params = [
                 input_ids,
@@ -584,7 +922,7 @@ def create_encoding_func(bb: relax.BlockBuilder, config: LlamaConfig) -> None:
         bb.emit_func_output(gv, params)
 
     mod = bb.get()
-    gv = mod.get_global_var("encoding")
+    gv = mod.get_global_var(func_name)
     bb.update_func(gv, mod[gv].with_attr("num_input", 3))
 
 
@@ -621,17 +959,63 @@ def create_decoding_func(bb: relax.BlockBuilder, config: LlamaConfig) -> None:
     bb.update_func(gv, mod[gv].with_attr("num_input", 3))
 
 
+def create_batch_decoding_func(bb: relax.BlockBuilder, config: LlamaConfig) -> None:
+    """Create the function that decodes one token of each sequence of a batch.
+
+    The sequences live in one paged KV cache pool. The runtime passes the row table
+    of the sequences after the new tokens, of shape (b, m) where m is the longest
+    length, and the length of each sequence. The kv_cache holds the batch handles of
+    the key and the value cache of each layer, see cpp/paged_kv_cache.h.
+    """
+    bsz = tvm.tir.Var("b", "int64")
+    max_len = tvm.tir.Var("m", "int64")
+
+    with bb.function("decoding_batch"):
+        model = LlamaForCausalLM(config)
+        input_ids = nn.Placeholder((bsz, 1), dtype="int32", name="input_ids")
+        rows = nn.Placeholder((bsz, max_len), dtype="int32", name="rows")
+        lengths = nn.Placeholder((bsz,), dtype="int32", name="lengths")
+        past_key_values = relax.Var(
+            "kv_cache",
+            relax.TupleStructInfo(
+                [relax.ObjectStructInfo() for _ in range(config.num_hidden_layers * 2)]
+            ),
+        )
+        with bb.dataflow():
+            logits, key_value_cache = model.forward_batch(
+                input_ids, rows, lengths, past_key_values=past_key_values
+            )
+            params = [
+                input_ids,
+                rows,
+                lengths,
+                past_key_values,
+            ] + model.parameters()
+            gv = bb.emit_output((logits, relax.Tuple(key_value_cache)))
+        bb.emit_func_output(gv, params)
+
+    mod = bb.get()
+    gv = mod.get_global_var("decoding_batch")
+    bb.update_func(gv, mod[gv].with_attr("num_input", 4))
+
+
 def create_kv_cache_func(bb: relax.BlockBuilder, config: LlamaConfig) -> None:
     init_shape = relax.ShapeExpr(
         (
             config.max_sequence_length,
             config.num_attention_heads,
-            config.hidden_size // config.num_attention_heads,
+            kv_cache_row_dim(
+                config.hidden_size // config.num_attention_heads,
+                config.kv_cache_quantization,
+            ),
         )
     )
+    quantized = config.kv_cache_quantization != "none"
     with bb.function("create_kv_cache", []):
         with bb.dataflow():
-            zeros = bb.emit(relax.op.zeros(init_shape, config.dtype))
+            zeros = bb.emit(
+                relax.op.zeros(init_shape, "int8" if quantized else config.dtype)
+            )
             caches = []
             f_kv_cache_create = relax.extern("vm.builtin.attention_kv_cache_create")
             for _ in range(config.num_hidden_layers * 2):
@@ -648,6 +1032,65 @@ def create_kv_cache_func(bb: relax.BlockBuilder, config: LlamaConfig) -> None:
         bb.emit_func_output(gv)
 
 
+def create_kv_cache_rotate_func(bb: relax.BlockBuilder, config: LlamaConfig) -> None:
+    """Rotate cached keys back by `delta` positions.
+
+    The runtime calls it when it drops the middle of the context, so that the
+    keys kept after the dropped rows match their new positions.
+    """
+    num_heads = config.num_attention_heads
+    head_dim = config.hidden_size // config.num_attention_heads
+    base = config.position_embedding_base
+
+    def f_kv_cache_rotate(k: te.Tensor, delta: tvm.tir.PrimExpr):
+        n_feat_half = head_dim // 2
+
+        def rotate_compute(i, h, j):
+            inv_freq = tvm.tir.power(
+                tvm.tir.const(base, "float32"),
+                tvm.tir.Cast("float32", (j % n_feat_half) * 2) * (-1.0 / head_dim),
+            )
+            angle = tvm.tir.Cast("float32", delta) * inv_freq
+            rotated = tvm.tir.Select(
+                j >= n_feat_half, k[i, h, j - n_feat_half], -k[i, h, j + n_feat_half]
+            )
+            # rotating by -delta negates the sin term of the rotary embedding
+            value = tvm.tir.cos(angle) * k[i, h, j].astype("float32") - tvm.tir.sin(
+                angle
+            ) * rotated.astype("float32")
+            return value.astype(k.dtype)
+
+        return te.compute(k.shape, rotate_compute, name="kv_cache_rotate")
+
+    def f_kv_cache_rotate_quantized(q: te.Tensor, delta: tvm.tir.PrimExpr):
+        k = kv_cache_dequantize(q, "float32")
+        return kv_cache_quantize(f_kv_cache_rotate(k, delta))
+
+    quantized = config.kv_cache_quantization != "none"
+    seq_len = tvm.tir.Var("n", "int64")
+    delta = tvm.tir.Var("d", "int64")
+    with bb.function("kv_cache_rotate"):
+        k = nn.Placeholder(
+            (
+                seq_len,
+                num_heads,
+                kv_cache_row_dim(head_dim, config.kv_cache_quantization),
+            ),
+            dtype="int8" if quantized else config.dtype,
+            name="k",
+        )
+        delta_shape = relax.Var("delta", relax.ShapeStructInfo((delta,)))
+        with bb.dataflow():
+            rotated = nn.emit_te(
+                f_kv_cache_rotate_quantized if quantized else f_kv_cache_rotate,
+                k,
+                delta,
+                primfunc_name_hint="kv_cache_rotate",
+            )
+            gv = bb.emit_output(rotated)
+        bb.emit_func_output(gv, [k, delta_shape])
+
+
 def create_softmax_func(bb: relax.BlockBuilder, config: LlamaConfig) -> None:
     with bb.function("softmax_with_temperature"):
         logits = nn.Placeholder(
@@ -670,21 +1113,44 @@ def get_model(args, hf_config):
     max_seq_len = args.max_seq_len
 
     if model_name.startswith("vicuna-") or model_name.startswith("llama-"):
-        config = LlamaConfig(**hf_config, dtype=dtype)
+        config = LlamaConfig(
+            **hf_config,
+            dtype=dtype,
+            paged_kv_cache=args.use_paged_kv_cache,
+            kv_cache_quantization=args.kv_cache_quantization,
+        )
         if max_seq_len != -1:
             config.max_sequence_length = max_seq_len
 
         bb = relax.BlockBuilder()
         create_encoding_func(bb, config)
+        create_encoding_func(bb, config, "verification", all_logits=True)
         create_decoding_func(bb, config)
+        if config.paged_kv_cache:
+            create_batch_decoding_func(bb, config)
         create_kv_cache_func(bb, config)
+        create_kv_cache_rotate_func(bb, config)
         create_softmax_func(bb, config)
+        create_sample_top_p_func(bb, config.vocab_size)
         create_metadata_func(
             bb,
             model_name=model_name,
             max_window_size=config.max_sequence_length,
             stop_tokens=[2],
             add_prefix_space=False,
+            kv_cache=kv_cache_metadata(
+                num_layers=config.num_hidden_layers,
+                num_heads=config.num_attention_heads,
+                head_dim=kv_cache_row_dim(
+                    config.hidden_size // config.num_attention_heads,
+                    config.kv_cache_quantization,
+                ),
+                dtype="int8"
+                if config.kv_cache_quantization != "none"
+                else config.dtype,
+                paged=config.paged_kv_cache,
+                quantization=config.kv_cache_quantization,
+            ),
         )
 
         mod = bb.get()
@@ -21,7 +21,11 @@ from tvm.relax.testing import nn
 from tvm.runtime import NDArray
 from tvm.script import relax as R
 
-from .commons import create_metadata_func
+from .commons import (
+    create_metadata_func,
+    create_sample_top_p_func,
+    kv_cache_metadata,
+)
 from .modules import (
     Embedding,
     LayerNorm,
@@ -614,12 +618,19 @@ def get_model(args, hf_config):
     create_encoding_func(bb, config, param_list)
     create_decoding_func(bb, config, param_list)
     create_kv_cache_func(bb, config)
+    create_sample_top_p_func(bb, config.vocab_size)
     create_metadata_func(
         bb,
         model_name=model_name,
         max_window_size=config.max_sequence_length,
         stop_tokens=[106068],
         add_prefix_space=True,
+        kv_cache=kv_cache_metadata(
+            num_layers=config.num_hidden_layers,
+            num_heads=config.num_attention_heads,
+            head_dim=config.hidden_size // config.num_attention_heads,
+            dtype=config.dtype,
+        ),
     )
     mod = bb.get()
     for gv in mod.functions:
@@ -0,0 +1,128 @@
+/*!
+ *  Copyright (c) 2023 by Contributors
+ * \file grammar_test.cc
+ * \brief Unit tests of RegexDFA, TokenGrammar and MapByteFallbackTokens.
+ */
+#include "grammar.h"
+
+#include <cmath>
+#include <functional>
+#include <iostream>
+#include <string>
+#include <vector>
+
+namespace {
+
+using namespace mlc::llm;
+
+int num_failures = 0;
+
+void Check(bool cond, const std::string& what) {
+  if (cond) return;
+  std::cerr << "FAILED: " << what << std::endl;
+  ++num_failures;
+}
+
+bool Matches(const RegexDFA& dfa, const std::string& text) {
+  int32_t state = dfa.Start();
+  for (char c : text) {
+    state = dfa.Next(state, static_cast<uint8_t>(c));
+    if (state < 0) return false;
+  }
+  return dfa.IsAccepting(state);
+}
+
+bool RaisesError(const std::function<void()>& f) {
+  try {
+    f();
+  } catch (const std::exception&) {
+    return true;
+  }
+  return false;
+}
+
+void TestRegexDFA() {
+  RegexDFA number("-?\\d+(\\.\\d{1,2})?");
+  Check(Matches(number, "42"), "\\d+ matches 42");
+  Check(Matches(number, "-3.14"), "the optional group matches -3.14");
+  Check(!Matches(number, "3.141"), "{1,2} rejects three decimals");
+  Check(!Matches(number, "3."), "the group needs a digit after the dot");
+  Check(!Matches(number, ""), "\\d+ rejects the empty text");
+
+  RegexDFA choice("(yes|no)");
+  Check(Matches(choice, "yes") && Matches(choice, "no"), "| matches both branches");
+  Check(!Matches(choice, "yesno"), "| matches one branch");
+
+  RegexDFA cls("[^a-c]x*");
+  Check(Matches(cls, "dxx") && !Matches(cls, "bx"), "a negated class excludes its range");
+  Check(!Matches(RegexDFA("."), "\xC3\xA9"), ". matches a single byte");
+  Check(Matches(RegexDFA("\xC3\xA9"), "\xC3\xA9"), "UTF-8 literals match their bytes");
+
+  Check(RaisesError([]() { RegexDFA("(ab"); }), "an unmatched ( is an error");
+  Check(RaisesError([]() { RegexDFA("*a"); }), "nothing to repeat is an error");
+}
+
+void TestTokenGrammar() {
+  // token 3 is the stop token, token 4 produces no text
+  std::vector<std::string> texts = {"1", "23", "a", "", ""};
+  TokenGrammar grammar(RegexDFA("\\d{2,3}"), texts, {3});
+  const float neg_inf = -INFINITY;
+
+  std::vector<float> logits(texts.size(), 0.0f);
+  grammar.MaskLogits(grammar.Start(), logits.data(), logits.size());
+  Check(logits[0] == 0 && logits[1] == 0, "the digit tokens are allowed at the start");
+  Check(logits[2] == neg_inf, "a letter is masked");
+  Check(logits[3] == neg_inf, "the stop token is masked before a match");
+  Check(logits[4] == neg_inf, "a token without text is masked");
+
+  int32_t state = grammar.Advance(grammar.Start(), 1);
+  logits.assign(texts.size(), 0.0f);
+  grammar.MaskLogits(state, logits.data(), logits.size());
+  Check(logits[0] == 0 && logits[3] == 0, "after a match, one more digit or stop is allowed");
+  Check(logits[1] == neg_inf, "a token that overruns {2,3} is masked");
+
+  state = grammar.Advance(state, 0);
+  logits.assign(texts.size(), 0.0f);
+  grammar.MaskLogits(state, logits.data(), logits.size());
+  Check(logits[0] == neg_inf && logits[3] == 0, "only stop is allowed after three digits");
+  Check(grammar.Advance(state, 3) == -1, "the stop token finishes the text");
+  Check(RaisesError([&]() { grammar.Advance(state, 2); }), "a masked token cannot advance");
+}
+
+void TestMapByteFallbackTokens() {
+  const std::string replacement_char = "\xEF\xBF\xBD";
+  // two special tokens, the 256 byte tokens, then ordinary tokens
+  std::vector<std::string> texts = {"", ""};
+  for (int byte = 0; byte < 256; ++byte) {
+    texts.push_back(byte < 0x80 ? std::string(1, static_cast<char>(byte)) : replacement_char);
+  }
+  texts.push_back("hello");
+  Check(MapByteFallbackTokens(&texts), "the byte tokens are found");
+  Check(texts[2 + 0x41] == "A", "an ASCII byte token keeps its text");
+  Check(texts[2 + 0xC3] == "\xC3", "a lead byte token gets its byte");
+  Check(texts[2 + 0xA9] == "\xA9", "a continuation byte token gets its byte");
+  Check(texts.back() == "hello", "ordinary tokens are kept");
+
+  // the two byte tokens of "é" are allowed one after the other
+  TokenGrammar grammar(RegexDFA("\xC3\xA9"), texts, {});
+  int32_t state = grammar.Advance(grammar.Start(), 2 + 0xC3);
+  Check(grammar.Advance(state, 2 + 0xA9) >= 0, "the byte tokens spell a UTF-8 character");
+
+  std::vector<std::string> no_bytes = {"a", "b", replacement_char};
+  Check(!MapByteFallbackTokens(&no_bytes), "a vocabulary without byte tokens is kept");
+  Check(no_bytes[2] == replacement_char, "U+FFFD is kept without byte tokens");
+}
+
+}  // namespace
+
+int main() {
+  TestRegexDFA();
+  TestTokenGrammar();
+  TestMapByteFallbackTokens();
+  if (num_failures != 0) {
+    std::cerr << num_failures << " checks failed" << std::endl;
+    return 1;
+  }
+  std::cout << "All checks passed" << std::endl;
+  return 0;
+}
@@ -0,0 +1,123 @@
+/*!
+ *  Copyright (c) 2023 by Contributors
+ * \file sampler_test.cc
+ * \brief Unit tests of HostSampler.
+ */
+#include "sampler.h"
+
+#include <cmath>
+#include <iostream>
+#include <string>
+#include <vector>
+
+namespace {
+
+using namespace mlc::llm;
+
+int num_failures = 0;
+
+void Check(bool cond, const std::string& what) {
+  if (cond) return;
+  std::cerr << "FAILED: " << what << std::endl;
+  ++num_failures;
+}
+
+void TestMaskedTokens() {
+  // a vocabulary that is not a multiple of the vector width, with the even tokens masked, so
+  // that a masked token comes first for a uniform of 0 and last for one near 1
+  const int64_t vocab_size = 38;
+  std::vector<float> logits(vocab_size, -INFINITY);
+  for (int64_t i = 1; i < vocab_size; i += 2) logits[i] = 0.1f * i;
+  HostSampler sampler;
+  for (double uniform : {0.0, 0.3, 0.7, 0.999999, std::nextafter(1.0, 0.0)}) {
+    for (float top_p : {0.5f, 1.0f}) {
+      int32_t token = sampler.SampleFromLogits(logits.data(), vocab_size, 1.0f, 0, top_p, uniform);
+      Check(token >= 0 && token < vocab_size && logits[token] != -INFINITY,
+            "a masked token is never sampled with uniform " + std::to_string(uniform));
+    }
+  }
+  // only the last token is unmasked
+  std::vector<float> one(vocab_size, -INFINITY);
+  one[vocab_size - 1] = -100.0f;
+  Check(sampler.SampleFromLogits(one.data(), vocab_size, 0.7f, 0, 1.0f, 0.999) == vocab_size - 1,
+        "the only unmasked token is sampled");
+}
+
+void TestSampleFromLogits() {
+  // the weights of tokens 0 and 1 are 1 and 3, the rest are masked
+  std::vector<float> logits(19, -INFINITY);
+  logits[0] = 0.0f;
+  logits[1] = std::log(3.0f);
+  HostSampler sampler;
+  Check(sampler.SampleFromLogits(logits.data(), logits.size(), 1.0f, 0, 1.0f, 0.2) == 0,
+        "token 0 takes the first quarter");
+  Check(sampler.SampleFromLogits(logits.data(), logits.size(), 1.0f, 0, 1.0f, 0.3) == 1,
+        "token 1 takes the rest");
+  Check(sampler.SampleFromLogits(logits.data(), logits.size(), 1.0f, 0, 0.5f, 0.9) == 1,
+        "top-p keeps the most likely token");
+  Check(sampler.SampleFromLogits(logits.data(), logits.size(), 0.0f, 0, 1.0f, 0.9) == 1,
+        "temperature 0 is greedy");
+  Check(sampler.SampleFromLogits(logits.data(), logits.size(), 1.0f, 1, 1.0f, 0.9) == 1,
+        "top-k 1 is greedy");
+}
+
+void TestComputeProbs() {
+  // the weights are 1, 2, 3 and 4 over a vocabulary that is not a multiple of the vector width
+  const int64_t vocab_size = 21;
+  std::vector<float> logits(vocab_size, -INFINITY), probs(vocab_size);
+  for (int64_t i = 0; i < 4; ++i) logits[10 + i] = std::log(static_cast<float>(i + 1));
+  HostSampler sampler;
+  auto near = [](float a, float b) { return std::abs(a - b) < 1e-5f; };
+
+  sampler.ComputeProbs(logits.data(), vocab_size, 1.0f, 0, 1.0f, probs.data());
+  Check(near(probs[10], 0.1f) && near(probs[13], 0.4f) && probs[0] == 0,
+        "the softmax keeps every token without top-k and top-p");
+
+  // 4 and 3 are the 0.7 of the mass that reaches top_p = 0.6
+  sampler.ComputeProbs(logits.data(), vocab_size, 1.0f, 0, 0.6f, probs.data());
+  Check(near(probs[13], 4.0f / 7) && near(probs[12], 3.0f / 7) && probs[11] == 0 &&
+            probs[10] == 0,
+        "top-p keeps the most likely tokens until they reach the mass, normalized");
+
+  sampler.ComputeProbs(logits.data(), vocab_size, 1.0f, 3, 0.5f, probs.data());
+  Check(near(probs[13], 4.0f / 7) && near(probs[12], 3.0f / 7) && probs[11] == 0,
+        "top-p applies to the mass of the top-k tokens");
+
+  sampler.ComputeProbs(logits.data(), vocab_size, 0.0f, 0, 0.6f, probs.data());
+  Check(probs[13] == 1.0f && probs[12] == 0, "temperature 0 puts all the mass on the argmax");
+}
+
+void TestRepetitionPenalty() {
+  const int64_t vocab_size = 50;
+  std::vector<float> logits(vocab_size), expected(vocab_size);
+  for (int64_t i = 0; i < vocab_size; ++i) {
+    logits[i] = expected[i] = static_cast<float>(i) - 20.0f;
+  }
+  // more distinct tokens than the vector width, with repeats and an out of range id
+  std::vector<int32_t> token_ids = {3, 7, 3, 25, 49, 0, 11, 12, 13, 30, 31, 7, 40, 41, 99, 20};
+  std::vector<bool> seen(vocab_size, false);
+  for (int32_t token : token_ids) {
+    if (token >= vocab_size || seen[token]) continue;
+    seen[token] = true;
+    float logit = expected[token];
+    expected[token] = logit > 0 ? logit / 2.0f : logit * 2.0f;
+  }
+  HostSampler sampler;
+  sampler.ApplyRepetitionPenalty(logits.data(), vocab_size, token_ids, 2.0f);
+  Check(logits == expected, "each distinct token is penalized once");
+}
+
+}  // namespace
+
+int main() {
+  TestMaskedTokens();
+  TestSampleFromLogits();
+  TestComputeProbs();
+  TestRepetitionPenalty();
+  if (num_failures != 0) {
+    std::cerr << num_failures << " checks failed" << std::endl;
+    return 1;
+  }
+  std::cout << "All checks passed" << std::endl;
+  return 0;
+}